@@ -4,11 +4,47 @@
 #include <stdint.h>
 
 typedef struct twh_window twh_window_t;
+typedef struct twh_swapchain twh_swapchain_t;
+
+enum TWH_PIXEL_FORMAT
+{
+    TWH_PIXEL_FORMAT_RGBX, /* swapped into the window's channel order on render */
+    TWH_PIXEL_FORMAT_BGRX, /* the window's native channel order, copied as is */
+};
+typedef enum TWH_PIXEL_FORMAT TWH_PIXEL_FORMAT;
+
+/* where row 0 (y = 0) of a framebuffer is shown */
+enum TWH_ORIGIN
+{
+    TWH_ORIGIN_BOTTOM_LEFT, /* flipped on render */
+    TWH_ORIGIN_TOP_LEFT,    /* the window's native row order */
+};
+typedef enum TWH_ORIGIN TWH_ORIGIN;
+
+typedef struct twh_rect
+{
+    int x, y, w, h;
+} twh_rect_t;
+
+#define TWH_DAMAGE_RECTS 8
+
+/* what changed since the framebuffer was last rendered */
+typedef struct twh_damage
+{
+    int full;
+    int count;
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int x0, y0, x1, y1; /* bounds of the pixels written by set_color */
+} twh_damage_t;
 
 typedef struct twh_framebuffer
 {
     int width, height;
     unsigned char *buffer;
+    TWH_PIXEL_FORMAT format;
+    TWH_ORIGIN origin;
+    twh_window_t *window; /* set when buffer is the window surface itself */
+    twh_damage_t damage;
 } twh_framebuffer_t;
 
 enum TWH_KEY_CODE
@@ -143,31 +179,219 @@ enum TWH_MOUSE_BUTTON
 };
 typedef enum TWH_MOUSE_BUTTON TWH_MOUSE_BUTTON;
 
+#define TWH_KEY_WORDS ((TWH_KEY_NUM + 63) / 64)
+
+/*
+ * Keys and buttons held down, plus the edges seen by the last
+ * twh_poll_events. A plain struct, copy it to hand a snapshot over.
+ */
+typedef struct twh_input_state
+{
+    uint64_t keys_down[TWH_KEY_WORDS];
+    uint64_t keys_pressed[TWH_KEY_WORDS];
+    uint64_t keys_released[TWH_KEY_WORDS];
+    uint32_t buttons_down;
+    uint32_t buttons_pressed;
+    uint32_t buttons_released;
+    unsigned int poll;
+} twh_input_state_t;
+
+enum TWH_INIT_HINT
+{
+    TWH_HINT_BLIT_THREADS,    /* worker threads converting framebuffers, default 0 */
+    TWH_HINT_BLIT_MIN_PIXELS, /* smaller blits stay on the calling thread */
+    TWH_HINT_HUGE_PAGES,      /* nonzero (default) lets big framebuffers use huge pages */
+    TWH_HINT_FRAME_STATS,     /* nonzero times the stages of twh_get_frame_stats, default 0 */
+};
+typedef enum TWH_INIT_HINT TWH_INIT_HINT;
+
+enum TWH_STAGE
+{
+    TWH_STAGE_BLIT,    /* converting framebuffers into window surfaces */
+    TWH_STAGE_PRESENT, /* handing surfaces to the window system, flushing the requests included */
+    TWH_STAGE_FLUSH,   /* blocking until the window system is done with a surface or wants a frame */
+    TWH_STAGE_EVENTS,  /* twh_poll_events, callbacks included */
+    TWH_STAGE_FRAME,   /* twh_frame_begin to twh_frame_end, before pacing */
+    TWH_STAGE_LATENCY, /* an input event to the next render presenting its window */
+    TWH_STAGE_NUM,
+};
+typedef enum TWH_STAGE TWH_STAGE;
+
+/* bucket i counts durations below 2^i but not 2^(i-1) microseconds, the last one all longer */
+#define TWH_STATS_BUCKETS 24
+
+typedef struct twh_stage_stats
+{
+    unsigned int count; /* since the last reset */
+    float last;         /* seconds */
+    float min;          /* min, avg and p99 over the last samples only */
+    float avg;
+    float p99;
+    unsigned int histogram[TWH_STATS_BUCKETS]; /* since the last reset */
+} twh_stage_stats_t;
+
+typedef struct twh_frame_stats
+{
+    twh_stage_stats_t stages[TWH_STAGE_NUM];
+    unsigned int events_last; /* processed by the last twh_poll_events */
+    unsigned int events_total;
+} twh_frame_stats_t;
+
+enum TWH_EVENT_TYPE
+{
+    TWH_EVENT_KEY,
+    TWH_EVENT_MOUSE_BUTTON,
+    TWH_EVENT_SCROLL,
+    TWH_EVENT_MOTION,
+    TWH_EVENT_CLOSE,
+};
+typedef enum TWH_EVENT_TYPE TWH_EVENT_TYPE;
+
+typedef struct twh_event
+{
+    TWH_EVENT_TYPE type;
+    twh_window_t *window;
+    float time; /* when the window system saw it, on the twh_get_timef clock */
+    union
+    {
+        struct
+        {
+            TWH_KEY_CODE code;
+            int pressed;
+        } key;
+        struct
+        {
+            TWH_MOUSE_BUTTON button;
+            int pressed;
+        } mouse;
+        struct
+        {
+            float offset;
+        } scroll;
+        struct
+        {
+            float x, y;
+        } motion;
+    };
+} twh_event_t;
+
 typedef void (*twh_key_callback_func_t)(twh_window_t *wnd, TWH_KEY_CODE keycode, int pressed);
 typedef void (*twh_mouse_callback_func_t)(twh_window_t *wnd, TWH_MOUSE_BUTTON mb, int pressed);
 typedef void (*twh_scroll_callback_func_t)(twh_window_t *wnd, float offset);
+typedef void (*twh_motion_callback_func_t)(twh_window_t *wnd, float x, float y);
 
+void twh_init_hint(TWH_INIT_HINT hint, int value);
 void twh_init(void);
 void twh_terminate(void);
 float twh_get_timef(void);
 
+/*
+ * Frame pacing: twh_frame_end sleeps until the next frame deadline. A
+ * target of 0 (the default) disables the limiter.
+ */
+void twh_set_target_fps(double fps);
+void twh_frame_begin(void);
+void twh_frame_end(void);
+
+/* all zero unless TWH_HINT_FRAME_STATS was set before twh_init */
+void twh_get_frame_stats(twh_frame_stats_t *out_stats);
+void twh_reset_frame_stats(void);
+
+/* NULL when out of memory for the window surface */
 twh_window_t *twh_window_create(const char *title, int width, int height);
 void twh_window_release(twh_window_t *wnd);
 void twh_set_user_data(twh_window_t *wnd, void *userdata);
 void *twh_get_user_data(twh_window_t *wnd);
 int twh_window_should_close(twh_window_t *wnd);
+/* the client area, windows can be resized by the user */
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height);
 void twh_window_close(twh_window_t *wnd);
 
 void twh_poll_events();
+/* like twh_poll_events, but first sleeps until an event arrives or the timeout (negative: none) expires */
+void twh_wait_events(double timeout);
 void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback);
 void twh_set_mouse_callback(twh_window_t *wnd, twh_mouse_callback_func_t mouse_callback);
 void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scroll_callback);
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback);
+/* the position as of the last twh_poll_events, relative to the window */
 void twh_get_cursor_pos(twh_window_t *wnd, float *x, float *y);
 
+/*
+ * Besides the callbacks, twh_poll_events queues every event in a fixed
+ * size ring (events are dropped while it is full). One other thread may
+ * drain it without locks, returns 0 once the queue is empty.
+ */
+int twh_next_event(twh_event_t *out_event);
+/* the time of the event whose callback is running, or of the last one polled */
+float twh_get_event_time(void);
+
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd);
+int twh_is_key_down(const twh_input_state_t *input, TWH_KEY_CODE key);
+int twh_is_key_pressed(const twh_input_state_t *input, TWH_KEY_CODE key);
+int twh_is_key_released(const twh_input_state_t *input, TWH_KEY_CODE key);
+int twh_is_button_down(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb);
+int twh_is_button_pressed(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb);
+int twh_is_button_released(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb);
+
+/* RGBX with a bottom-left origin, unless the layout is changed, NULL when out of memory */
 twh_framebuffer_t *twh_framebuffer_create(int width, int height);
 void twh_framebuffer_release(twh_framebuffer_t *fb);
+/*
+ * How the buffer is read from now on, the pixels are not converted. BGRX
+ * with a top-left origin is presented with plain row copies.
+ */
+void twh_framebuffer_set_layout(twh_framebuffer_t *fb, TWH_PIXEL_FORMAT format, TWH_ORIGIN origin);
 void twh_framebuffer_set_color_u8(twh_framebuffer_t *fb, int x, int y, uint8_t r, uint8_t g, uint8_t b);
 void twh_framebuffer_set_color_u32(twh_framebuffer_t *fb, int x, int y, uint32_t rgb);
+
+/*
+ * Bulk writes, clipped to the framebuffers and tracked as damage. `rgb` is
+ * 0xRRGGBB as for set_color_u32 and rows are buffer rows as for set_color.
+ * Copies between framebuffers of different origins keep the image upright.
+ */
+void twh_framebuffer_clear(twh_framebuffer_t *fb, uint32_t rgb);
+void twh_framebuffer_fill_rect(twh_framebuffer_t *fb, int x, int y, int w, int h, uint32_t rgb);
+void twh_framebuffer_hspan(twh_framebuffer_t *fb, int x, int y, int w, uint32_t rgb);
+void twh_framebuffer_vspan(twh_framebuffer_t *fb, int x, int y, int h, uint32_t rgb);
+void twh_framebuffer_copy_rect(twh_framebuffer_t *dst, int dst_x, int dst_y,
+                               const twh_framebuffer_t *src, int src_x, int src_y, int w, int h);
+void twh_framebuffer_blit(twh_framebuffer_t *dst, int x, int y, const twh_framebuffer_t *src);
+
+/*
+ * Only damaged areas are converted and presented. The set_color functions
+ * track their own damage, writes through buffer must be marked here.
+ *
+ * Framebuffers of any size can be rendered, they are shown at the largest
+ * integer scale that fits the window and centred between black bars.
+ */
+void twh_framebuffer_mark_dirty(twh_framebuffer_t *fb, int x, int y, int w, int h);
 void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb);
+/*
+ * Renders framebuffers[i] to windows[i] like twh_framebuffer_render, but
+ * sends all the uploads to the window system with a single flush. Instead
+ * of blocking the batch, a window whose last frame is not shown yet may be
+ * skipped, its damage is kept for the next render.
+ */
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count);
+
+/*
+ * The returned framebuffer aliases the window surface, rendering it is a
+ * present without any conversion. It is owned by the window and must not
+ * be released. Get it again every frame, it is reallocated (losing its
+ * contents) to follow the window size, and 0 x 0 while that is out of
+ * memory.
+ */
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd);
+
+/*
+ * 2 or 3 window sized framebuffers, presented in order by a background
+ * thread. Acquire blocks until the next framebuffer has been presented.
+ * NULL when out of memory for the framebuffers.
+ */
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count);
+void twh_swapchain_release(twh_swapchain_t *swapchain);
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain);
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb);
 
 #endif /* TWH_H */
\ No newline at end of file
@@ -0,0 +1,468 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "twh.h"
+#include "twh_internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef TWH_BENCH_XLIB
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#endif
+
+/*
+ * Throughput of the blit kernels, of twh_framebuffer_render, of a
+ * swapchain, of batched renders to many windows and of finding the window
+ * of an event, as CSV on stdout. Run it under Xvfb (or with the headless
+ * backend) to keep the numbers comparable between releases.
+ *
+ *   twh-bench [frames [blit_threads]]
+ */
+
+#define DEFAULT_FRAMES 120
+#define WARMUP_FRAMES 10
+#define SWAPCHAIN_IMAGES 3
+#define BATCH_MAX_WINDOWS 16
+#define BYTES_PER_PIXEL 8 /* every presented pixel is read and written once */
+#define DISPATCH_LOOKUPS 4096 /* per window and frame, reported as its pixels */
+#define DISPATCH_RUN 4        /* events in a row for the same window */
+
+struct resolution
+{
+    const char *name;
+    int width, height;
+};
+
+static const struct resolution g_resolutions[] = {
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440},
+    {"2160p", 3840, 2160},
+};
+#define RESOLUTION_COUNT ((int)(sizeof(g_resolutions) / sizeof(g_resolutions[0])))
+
+/* the windows of a monitoring wall, small and many */
+static const struct resolution g_batch_resolution = {"270p", 480, 270};
+static const int g_batch_windows[] = {1, 2, 4, 8, 12, 16};
+#define BATCH_COUNT ((int)(sizeof(g_batch_windows) / sizeof(g_batch_windows[0])))
+
+static const struct resolution g_dispatch_resolution = {"lookups", DISPATCH_LOOKUPS, 1};
+static const int g_dispatch_windows[] = {1, 4, 16, 64, 256};
+#define DISPATCH_COUNT ((int)(sizeof(g_dispatch_windows) / sizeof(g_dispatch_windows[0])))
+
+static double get_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* nearest rank of sorted samples */
+static double percentile(const double *samples, int count, int p)
+{
+    int rank = (p * count + 99) / 100;
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_header(void)
+{
+    printf("bench,kernel,resolution,width,height,scale,windows,frames,"
+           "ns_per_pixel,gb_per_s,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n");
+}
+
+/* rates count the pixels a frame writes to all its windows, the same after scaling */
+static void print_row(const char *bench, const char *kernel, const struct resolution *res, int scale,
+                      int windows, double *samples, int count)
+{
+    double pixels = (double)res->width * res->height * windows;
+    double total = 0;
+    int i;
+
+    qsort(samples, count, sizeof(double), compare_samples);
+    for (i = 0; i < count; i++)
+    {
+        total += samples[i];
+    }
+    total /= count;
+
+    printf("%s,%s,%s,%d,%d,%d,%d,%d,%.4f,%.3f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+           bench, kernel, res->name, res->width, res->height, scale, windows, count,
+           total * 1e9 / pixels, pixels * BYTES_PER_PIXEL / total / 1e9, total * 1e3,
+           percentile(samples, count, 50) * 1e3, percentile(samples, count, 90) * 1e3,
+           percentile(samples, count, 99) * 1e3, samples[count - 1] * 1e3);
+    fflush(stdout);
+}
+
+/* the bare conversion of a framebuffer that is `scale` times smaller than `res` */
+static void bench_blit_layout(double *samples, int frames, const char *kernel, const struct resolution *res,
+                              int scale, TWH_PIXEL_FORMAT format, TWH_ORIGIN origin)
+{
+    twh_framebuffer_t *fb = twh_framebuffer_create(res->width / scale, res->height / scale);
+    size_t size = (size_t)res->width * res->height * TWH_CHANNELS;
+    unsigned char *dst = (unsigned char *)twh_pixels_alloc(size);
+
+    if (fb == NULL || dst == NULL)
+    {
+        fprintf(stderr, "blit %s: out of memory\n", res->name);
+        twh_pixels_free(dst, size);
+        twh_framebuffer_release(fb);
+        return;
+    }
+    twh_framebuffer_set_layout(fb, format, origin);
+    for (size_t i = 0; i < (size_t)fb->width * fb->height * TWH_CHANNELS; i++)
+    {
+        fb->buffer[i] = (unsigned char)(i * 7);
+    }
+    for (int f = -WARMUP_FRAMES; f < frames; f++)
+    {
+        double start = get_time();
+        twh_blit_bgr(fb, dst, scale);
+        if (f >= 0)
+        {
+            samples[f] = get_time() - start;
+        }
+    }
+    print_row("blit", kernel, res, scale, 1, samples, frames);
+
+    twh_pixels_free(dst, size);
+    twh_framebuffer_release(fb);
+}
+
+/*
+ * Once per kernel this CPU runs, unscaled and at 2x. Framebuffers already
+ * in the window layout skip the kernels, they are reported as "copy".
+ */
+static void bench_blit(double *samples, int frames)
+{
+    const char *initial = twh_blit_kernel_name();
+    const char *kernel;
+
+    for (int k = 0; (kernel = twh_blit_kernel_at(k)) != NULL; k++)
+    {
+        if (!twh_blit_select_kernel(kernel))
+        {
+            continue;
+        }
+        for (int r = 0; r < RESOLUTION_COUNT; r++)
+        {
+            for (int scale = 1; scale <= 2; scale++)
+            {
+                bench_blit_layout(samples, frames, kernel, &g_resolutions[r], scale,
+                                  TWH_PIXEL_FORMAT_RGBX, TWH_ORIGIN_BOTTOM_LEFT);
+            }
+        }
+    }
+    twh_blit_select_kernel(initial);
+
+    for (int r = 0; r < RESOLUTION_COUNT; r++)
+    {
+        for (int scale = 1; scale <= 2; scale++)
+        {
+            bench_blit_layout(samples, frames, "copy", &g_resolutions[r], scale,
+                              TWH_PIXEL_FORMAT_BGRX, TWH_ORIGIN_TOP_LEFT);
+        }
+    }
+}
+
+/* a fully damaged framebuffer, converted and presented to a window of its size */
+static void bench_render(double *samples, int frames)
+{
+    for (int r = 0; r < RESOLUTION_COUNT; r++)
+    {
+        const struct resolution *res = &g_resolutions[r];
+        twh_window_t *wnd = twh_window_create("twh-bench", res->width, res->height);
+        twh_framebuffer_t *fb = twh_framebuffer_create(res->width, res->height);
+
+        twh_framebuffer_clear(fb, 0x336699);
+        for (int f = -WARMUP_FRAMES; f < frames; f++)
+        {
+            twh_framebuffer_mark_dirty(fb, 0, 0, res->width, res->height);
+            double start = get_time();
+            twh_framebuffer_render(wnd, fb);
+            if (f >= 0)
+            {
+                samples[f] = get_time() - start;
+            }
+            twh_poll_events();
+        }
+        print_row("render", twh_blit_kernel_name(), res, 1, 1, samples, frames);
+
+        twh_framebuffer_release(fb);
+        twh_window_release(wnd);
+    }
+}
+
+/* the time between presents of a swapchain kept busy, its sustained frame rate */
+static void bench_present(double *samples, int frames)
+{
+    for (int r = 0; r < RESOLUTION_COUNT; r++)
+    {
+        const struct resolution *res = &g_resolutions[r];
+        twh_window_t *wnd = twh_window_create("twh-bench", res->width, res->height);
+        twh_swapchain_t *swapchain = twh_swapchain_create(wnd, SWAPCHAIN_IMAGES);
+        double last = get_time();
+
+        for (int f = -WARMUP_FRAMES; f < frames; f++)
+        {
+            twh_framebuffer_t *fb = twh_swapchain_acquire(swapchain);
+            twh_framebuffer_clear(fb, (uint32_t)f * 0x010101);
+            twh_swapchain_present(swapchain, fb);
+            twh_poll_events();
+
+            double now = get_time();
+            if (f >= 0)
+            {
+                samples[f] = now - last;
+            }
+            last = now;
+        }
+        print_row("present", twh_blit_kernel_name(), res, 1, 1, samples, frames);
+
+        twh_swapchain_release(swapchain);
+        twh_window_release(wnd);
+    }
+}
+
+/* whether some framebuffer still has damage a render did not take */
+static int batch_pending(twh_framebuffer_t **framebuffers, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const twh_damage_t *damage = &framebuffers[i]->damage;
+        if (damage->full || damage->count > 0 || damage->x0 < damage->x1)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* many small windows rendered one by one, then in batches of one flush each until all were presented */
+static void bench_batch(double *samples, int frames)
+{
+    const struct resolution *res = &g_batch_resolution;
+    twh_window_t *windows[BATCH_MAX_WINDOWS];
+    twh_framebuffer_t *framebuffers[BATCH_MAX_WINDOWS];
+
+    for (int b = 0; b < BATCH_COUNT; b++)
+    {
+        int count = g_batch_windows[b];
+
+        for (int i = 0; i < count; i++)
+        {
+            windows[i] = twh_window_create("twh-bench", res->width, res->height);
+            framebuffers[i] = twh_framebuffer_create(res->width, res->height);
+            twh_framebuffer_clear(framebuffers[i], 0x102030 * (uint32_t)(i + 1));
+        }
+        for (int batched = 0; batched <= 1; batched++)
+        {
+            for (int f = -WARMUP_FRAMES; f < frames; f++)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    twh_framebuffer_mark_dirty(framebuffers[i], 0, 0, res->width, res->height);
+                }
+                double start = get_time();
+                if (batched)
+                {
+                    /* a window that was not ready keeps its damage for the next batch */
+                    twh_render_batch(windows, framebuffers, count);
+                    while (batch_pending(framebuffers, count))
+                    {
+                        twh_poll_events();
+                        twh_render_batch(windows, framebuffers, count);
+                    }
+                }
+                else
+                {
+                    for (int i = 0; i < count; i++)
+                    {
+                        twh_framebuffer_render(windows[i], framebuffers[i]);
+                    }
+                }
+                if (f >= 0)
+                {
+                    samples[f] = get_time() - start;
+                }
+                twh_poll_events();
+            }
+            print_row(batched ? "render-batch" : "render-each", twh_blit_kernel_name(), res, 1, count,
+                      samples, frames);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            twh_framebuffer_release(framebuffers[i]);
+            twh_window_release(windows[i]);
+        }
+    }
+}
+
+/* XIDs of one client share their high bits and count up */
+static unsigned long dispatch_handle(int index)
+{
+    return 0x2a00001ul + (unsigned long)index;
+}
+
+/* the handles of a frame's events, in runs per window picked at random */
+static void fill_dispatch_events(unsigned long *events, int count, int windows)
+{
+    unsigned int state = 1;
+
+    for (int i = 0; i < count; i += DISPATCH_RUN)
+    {
+        state = state * 1103515245u + 12345u;
+        for (int r = 0; r < DISPATCH_RUN && i + r < count; r++)
+        {
+            events[i + r] = dispatch_handle((int)((state >> 16) % (unsigned int)windows));
+        }
+    }
+}
+
+static void bench_dispatch_registry(double *samples, int frames, const unsigned long *events, int windows)
+{
+    int count = DISPATCH_LOOKUPS * windows;
+    twh_registry_t registry = {0};
+    char *targets = (char *)malloc(windows);
+    long found = 0;
+
+    for (int i = 0; i < windows; i++)
+    {
+        twh_registry_add(&registry, dispatch_handle(i), (twh_window_t *)&targets[i]);
+    }
+    for (int f = -WARMUP_FRAMES; f < frames; f++)
+    {
+        double start = get_time();
+        for (int i = 0; i < count; i++)
+        {
+            found += twh_registry_find(&registry, events[i]) != NULL;
+        }
+        if (f >= 0)
+        {
+            samples[f] = get_time() - start;
+        }
+    }
+    if (found != (long)count * (frames + WARMUP_FRAMES))
+    {
+        fprintf(stderr, "dispatch: a registered window was not found\n");
+    }
+    print_row("dispatch", "registry", &g_dispatch_resolution, 1, windows, samples, frames);
+
+    twh_registry_clear(&registry);
+    free(targets);
+}
+
+#ifdef TWH_BENCH_XLIB
+/* what Xlib programs commonly use, the same lookups through the display's context table */
+static void bench_dispatch_context(double *samples, int frames, const unsigned long *events, int windows,
+                                   Display *display)
+{
+    int count = DISPATCH_LOOKUPS * windows;
+    XContext context = XUniqueContext();
+    char *targets = (char *)malloc(windows);
+    long found = 0;
+
+    for (int i = 0; i < windows; i++)
+    {
+        XSaveContext(display, dispatch_handle(i), context, (XPointer)&targets[i]);
+    }
+    for (int f = -WARMUP_FRAMES; f < frames; f++)
+    {
+        double start = get_time();
+        for (int i = 0; i < count; i++)
+        {
+            XPointer data;
+            found += XFindContext(display, events[i], context, &data) == 0 && data != NULL;
+        }
+        if (f >= 0)
+        {
+            samples[f] = get_time() - start;
+        }
+    }
+    if (found != (long)count * (frames + WARMUP_FRAMES))
+    {
+        fprintf(stderr, "dispatch: a saved context was not found\n");
+    }
+    print_row("dispatch", "XFindContext", &g_dispatch_resolution, 1, windows, samples, frames);
+
+    for (int i = 0; i < windows; i++)
+    {
+        XDeleteContext(display, dispatch_handle(i), context);
+    }
+    free(targets);
+}
+#endif
+
+/* finding the window of every event, compared with XFindContext when built for Xlib and a display is there */
+static void bench_dispatch(double *samples, int frames)
+{
+#ifdef TWH_BENCH_XLIB
+    Display *display = XOpenDisplay(NULL);
+#endif
+
+    for (int d = 0; d < DISPATCH_COUNT; d++)
+    {
+        int windows = g_dispatch_windows[d];
+        unsigned long *events = (unsigned long *)malloc((size_t)DISPATCH_LOOKUPS * windows * sizeof(unsigned long));
+
+        fill_dispatch_events(events, DISPATCH_LOOKUPS * windows, windows);
+        bench_dispatch_registry(samples, frames, events, windows);
+#ifdef TWH_BENCH_XLIB
+        if (display != NULL)
+        {
+            bench_dispatch_context(samples, frames, events, windows, display);
+        }
+#endif
+        free(events);
+    }
+
+#ifdef TWH_BENCH_XLIB
+    if (display != NULL)
+    {
+        XCloseDisplay(display);
+    }
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : DEFAULT_FRAMES;
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+
+    if (frames <= 0 || threads < 0)
+    {
+        fprintf(stderr, "usage: %s [frames [blit_threads]]\n", argv[0]);
+        return 1;
+    }
+
+    twh_init_hint(TWH_HINT_BLIT_THREADS, threads);
+    twh_init();
+
+    double *samples = (double *)malloc((size_t)frames * sizeof(double));
+    print_header();
+    bench_blit(samples, frames);
+    bench_render(samples, frames);
+    bench_present(samples, frames);
+    bench_batch(samples, frames);
+    bench_dispatch(samples, frames);
+    free(samples);
+
+    twh_terminate();
+    return 0;
+}
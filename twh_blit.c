@@ -0,0 +1,605 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "twh_internal.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BLIT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BLIT_TARGET(x)
+#else
+#include <cpuid.h>
+#define BLIT_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+/*
+ * A row kernel converts `count` RGBX pixels of the framebuffer into the
+ * BGRX layout of the window surface, the padding byte is copied as is.
+ */
+typedef void (*convert_row_func_t)(unsigned char *dst, const unsigned char *src, int count);
+
+/* like a row kernel, but every pixel is written `scale` times */
+typedef void (*scale_row_func_t)(unsigned char *dst, const unsigned char *src, int count, int scale);
+
+/* the vector scale kernels precompute one shuffle per output vector */
+#define BLIT_MAX_SIMD_SCALE 16
+
+/* a blit split into row bands for the worker pool */
+struct blit_job
+{
+    const twh_framebuffer_t *fb;
+    unsigned char *dst;
+    int scale;
+    twh_rect_t rect;
+    int band_h;
+};
+
+enum blit_feature
+{
+    BLIT_FEATURE_NONE,
+    BLIT_FEATURE_SSE2,
+    BLIT_FEATURE_SSSE3,
+    BLIT_FEATURE_AVX2,
+};
+
+struct blit_kernel
+{
+    const char *name;
+    enum blit_feature feature; /* what the CPU needs to run it */
+    convert_row_func_t convert_row;
+    scale_row_func_t scale_row;
+    scale_row_func_t replicate_row; /* scale_row for framebuffers in the surface layout */
+};
+
+static void convert_row_scalar(unsigned char *dst, const unsigned char *src, int count);
+static void scale_row_scalar(unsigned char *dst, const unsigned char *src, int count, int scale);
+static convert_row_func_t g_convert_row = convert_row_scalar;
+static scale_row_func_t g_scale_row = scale_row_scalar;
+static void replicate_row_scalar(unsigned char *dst, const unsigned char *src, int count, int scale);
+static scale_row_func_t g_replicate_row = replicate_row_scalar;
+static const char *g_kernel_name = "scalar";
+
+static int g_blit_threads = 0;
+static int g_blit_min_pixels = 256 * 256;
+
+static void convert_rect(const twh_framebuffer_t *fb, unsigned char *dst, int scale, const twh_rect_t *rect);
+static void run_blit_job(void *arg, int index);
+static void copy_row(unsigned char *dst, const unsigned char *src, int count);
+
+#ifdef BLIT_X86
+static void convert_row_sse2(unsigned char *dst, const unsigned char *src, int count);
+static void convert_row_ssse3(unsigned char *dst, const unsigned char *src, int count);
+static void convert_row_avx2(unsigned char *dst, const unsigned char *src, int count);
+static void scale_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale);
+static void scale_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale);
+static void replicate_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale);
+static void replicate_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale);
+static void shuffle_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale, int swap);
+static void permute_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale, int swap);
+static void query_cpu_features(int *has_sse2, int *has_ssse3, int *has_avx2);
+#endif
+static int kernel_supported(const struct blit_kernel *kernel);
+
+/* fastest first, twh_blit_init picks the first one the CPU supports */
+static const struct blit_kernel g_kernels[] = {
+#ifdef BLIT_X86
+    {"avx2", BLIT_FEATURE_AVX2, convert_row_avx2, scale_row_avx2, replicate_row_avx2},
+    {"ssse3", BLIT_FEATURE_SSSE3, convert_row_ssse3, scale_row_ssse3, replicate_row_ssse3},
+    {"sse2", BLIT_FEATURE_SSE2, convert_row_sse2, scale_row_scalar, replicate_row_scalar},
+#endif
+    {"scalar", BLIT_FEATURE_NONE, convert_row_scalar, scale_row_scalar, replicate_row_scalar},
+};
+#define BLIT_KERNEL_COUNT ((int)(sizeof(g_kernels) / sizeof(g_kernels[0])))
+
+/* implementations */
+
+void twh_init_hint(TWH_INIT_HINT hint, int value)
+{
+    switch (hint)
+    {
+    case TWH_HINT_BLIT_THREADS:
+        g_blit_threads = value;
+        break;
+    case TWH_HINT_BLIT_MIN_PIXELS:
+        g_blit_min_pixels = value;
+        break;
+    case TWH_HINT_HUGE_PAGES:
+        twh_pixels_hint_huge_pages(value);
+        break;
+    case TWH_HINT_FRAME_STATS:
+        twh_stats_enable(value);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void twh_blit_init(void)
+{
+    int i;
+
+    twh_pool_create(g_blit_threads);
+
+    for (i = 0; i < BLIT_KERNEL_COUNT; i++)
+    {
+        if (twh_blit_select_kernel(g_kernels[i].name))
+        {
+            break;
+        }
+    }
+}
+
+void twh_blit_terminate(void)
+{
+    twh_pool_destroy();
+}
+
+const char *twh_blit_kernel_name(void)
+{
+    return g_kernel_name;
+}
+
+/* the kernels built in, NULL past the last one */
+const char *twh_blit_kernel_at(int index)
+{
+    return index >= 0 && index < BLIT_KERNEL_COUNT ? g_kernels[index].name : NULL;
+}
+
+/* returns 0 and keeps the current kernel when this CPU can't run the named one */
+int twh_blit_select_kernel(const char *name)
+{
+    int i;
+
+    for (i = 0; i < BLIT_KERNEL_COUNT; i++)
+    {
+        if (strcmp(g_kernels[i].name, name) == 0 && kernel_supported(&g_kernels[i]))
+        {
+            g_convert_row = g_kernels[i].convert_row;
+            g_scale_row = g_kernels[i].scale_row;
+            g_replicate_row = g_kernels[i].replicate_row;
+            g_kernel_name = g_kernels[i].name;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The largest integer scale up to `max_scale` at which a width x height
+ * image fits the window, at least 1, and the offset centring it there.
+ */
+int twh_blit_fit(int width, int height, int window_w, int window_h, int max_scale, int *out_x, int *out_y)
+{
+    int scale_x = window_w / width;
+    int scale_y = window_h / height;
+    int scale = scale_x < scale_y ? scale_x : scale_y;
+
+    if (scale > max_scale)
+    {
+        scale = max_scale;
+    }
+    if (scale < 1)
+    {
+        scale = 1;
+    }
+    *out_x = (window_w - width * scale) / 2;
+    *out_y = (window_h - height * scale) / 2;
+    if (*out_x < 0)
+    {
+        *out_x = 0;
+    }
+    if (*out_y < 0)
+    {
+        *out_y = 0;
+    }
+    return scale;
+}
+
+/* swaps red and blue of `count` pixels, the other way round works the same */
+void twh_blit_swap_row(unsigned char *dst, const unsigned char *src, int count)
+{
+    g_convert_row(dst, src, count);
+}
+
+void twh_blit_bgr(const twh_framebuffer_t *fb, unsigned char *dst, int scale)
+{
+    twh_rect_t rect = {0, 0, fb->width, fb->height};
+    twh_blit_bgr_rect(fb, dst, scale, &rect);
+}
+
+/*
+ * `rect` is in framebuffer coordinates, it lands in `dst` as top-down BGRX,
+ * which is `scale` times the framebuffer in both directions.
+ */
+void twh_blit_bgr_rect(const twh_framebuffer_t *fb, unsigned char *dst, int scale, const twh_rect_t *rect)
+{
+    int workers = twh_pool_thread_count();
+    struct blit_job job;
+    int band_count;
+
+    assert(rect->x >= 0 && rect->y >= 0 && scale >= 1);
+    assert(rect->x + rect->w <= fb->width && rect->y + rect->h <= fb->height);
+
+    if (workers == 0 || (long)rect->w * rect->h * scale * scale < g_blit_min_pixels)
+    {
+        convert_rect(fb, dst, scale, rect);
+        return;
+    }
+
+    /* one band per worker plus one for the caller */
+    band_count = workers + 1 < rect->h ? workers + 1 : rect->h;
+    job.fb = fb;
+    job.dst = dst;
+    job.scale = scale;
+    job.rect = *rect;
+    job.band_h = (rect->h + band_count - 1) / band_count;
+    twh_pool_run(run_blit_job, &job, band_count);
+}
+
+/* from framebuffer rows to the top-down rows of the surface */
+void twh_flip_rect(twh_rect_t *rect, const twh_framebuffer_t *fb)
+{
+    if (fb->origin == TWH_ORIGIN_BOTTOM_LEFT)
+    {
+        rect->y = fb->height - rect->y - rect->h;
+    }
+}
+
+void twh_scale_rect(twh_rect_t *rect, int scale)
+{
+    rect->x *= scale;
+    rect->y *= scale;
+    rect->w *= scale;
+    rect->h *= scale;
+}
+
+/* private functions */
+
+static void convert_rect(const twh_framebuffer_t *fb, unsigned char *dst, int scale, const twh_rect_t *rect)
+{
+    int r, s;
+    const unsigned char *src = fb->buffer;
+    size_t stride = (size_t)fb->width * TWH_CHANNELS;
+    size_t offset = (size_t)rect->x * TWH_CHANNELS;
+    size_t dst_stride = stride * scale;
+    size_t dst_row_size = (size_t)rect->w * scale * TWH_CHANNELS;
+    int flip = fb->origin == TWH_ORIGIN_BOTTOM_LEFT;
+    int swap = fb->format != TWH_PIXEL_FORMAT_BGRX;
+    convert_row_func_t convert_row = swap ? g_convert_row : copy_row;
+    scale_row_func_t scale_row = swap ? g_scale_row : g_replicate_row;
+
+    if (scale == 1)
+    {
+        if (!flip && !swap && rect->w == fb->width)
+        {
+            /* the layouts match, whole rows are one run of bytes */
+            memcpy(&dst[rect->y * stride], &src[rect->y * stride], stride * rect->h);
+            return;
+        }
+        for (r = rect->y; r < rect->y + rect->h; r++)
+        {
+            int dst_r = flip ? fb->height - 1 - r : r;
+            convert_row(&dst[dst_r * stride + offset], &src[r * stride + offset], rect->w);
+        }
+        return;
+    }
+
+    for (r = rect->y; r < rect->y + rect->h; r++)
+    {
+        int dst_r = flip ? fb->height - 1 - r : r;
+        unsigned char *dst_row = &dst[(size_t)dst_r * scale * dst_stride + offset * scale];
+        scale_row(dst_row, &src[r * stride + offset], rect->w, scale);
+        /* the remaining rows of a scaled pixel row are plain copies */
+        for (s = 1; s < scale; s++)
+        {
+            memcpy(dst_row + s * dst_stride, dst_row, dst_row_size);
+        }
+    }
+}
+
+static void run_blit_job(void *arg, int index)
+{
+    struct blit_job *job = (struct blit_job *)arg;
+    twh_rect_t band = job->rect;
+
+    band.y = job->rect.y + index * job->band_h;
+    band.h = job->band_h;
+    if (band.y + band.h > job->rect.y + job->rect.h)
+    {
+        band.h = job->rect.y + job->rect.h - band.y;
+    }
+    if (band.h > 0)
+    {
+        convert_rect(job->fb, job->dst, job->scale, &band);
+    }
+}
+
+/* the row kernel of framebuffers already in the surface layout */
+static void copy_row(unsigned char *dst, const unsigned char *src, int count)
+{
+    memcpy(dst, src, (size_t)count * TWH_CHANNELS);
+}
+
+static void replicate_row_scalar(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    int c, s;
+    for (c = 0; c < count; c++)
+    {
+        uint32_t pixel;
+        memcpy(&pixel, &src[c * TWH_CHANNELS], TWH_CHANNELS);
+        for (s = 0; s < scale; s++)
+        {
+            memcpy(&dst[(c * scale + s) * TWH_CHANNELS], &pixel, TWH_CHANNELS);
+        }
+    }
+}
+
+static int kernel_supported(const struct blit_kernel *kernel)
+{
+#ifdef BLIT_X86
+    int has_sse2, has_ssse3, has_avx2;
+    query_cpu_features(&has_sse2, &has_ssse3, &has_avx2);
+
+    switch (kernel->feature)
+    {
+    case BLIT_FEATURE_SSE2:
+        return has_sse2;
+    case BLIT_FEATURE_SSSE3:
+        return has_ssse3;
+    case BLIT_FEATURE_AVX2:
+        return has_avx2;
+    default:
+        break;
+    }
+#endif
+    return kernel->feature == BLIT_FEATURE_NONE;
+}
+
+/* reference implementation, every other kernel must produce the same bytes */
+static void convert_row_scalar(unsigned char *dst, const unsigned char *src, int count)
+{
+    int c;
+    for (c = 0; c < count; c++)
+    {
+        const unsigned char *src_pixel = &src[c * TWH_CHANNELS];
+        unsigned char *dst_pixel = &dst[c * TWH_CHANNELS];
+        dst_pixel[0] = src_pixel[2]; /* blue */
+        dst_pixel[1] = src_pixel[1]; /* green */
+        dst_pixel[2] = src_pixel[0]; /* red */
+        dst_pixel[3] = src_pixel[3];
+    }
+}
+
+static void scale_row_scalar(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    int c, s;
+    for (c = 0; c < count; c++)
+    {
+        unsigned char *dst_pixel = &dst[c * scale * TWH_CHANNELS];
+        convert_row_scalar(dst_pixel, &src[c * TWH_CHANNELS], 1);
+        for (s = 1; s < scale; s++)
+        {
+            memcpy(&dst_pixel[s * TWH_CHANNELS], dst_pixel, TWH_CHANNELS);
+        }
+    }
+}
+
+#ifdef BLIT_X86
+
+BLIT_TARGET("sse2")
+static void convert_row_sse2(unsigned char *dst, const unsigned char *src, int count)
+{
+    const __m128i mask_ga = _mm_set1_epi32((int)0xff00ff00);
+    int c = 0;
+
+    for (; c + 4 <= count; c += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)&src[c * TWH_CHANNELS]);
+        __m128i ga = _mm_and_si128(pixels, mask_ga);
+        __m128i rb = _mm_andnot_si128(mask_ga, pixels);
+        /* swap the red and blue bytes by rotating each pixel by 16 bits */
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i *)&dst[c * TWH_CHANNELS], _mm_or_si128(ga, rb));
+    }
+    convert_row_scalar(&dst[c * TWH_CHANNELS], &src[c * TWH_CHANNELS], count - c);
+}
+
+BLIT_TARGET("ssse3")
+static void convert_row_ssse3(unsigned char *dst, const unsigned char *src, int count)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+    int c = 0;
+
+    for (; c + 8 <= count; c += 8)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)&src[c * TWH_CHANNELS]);
+        __m128i hi = _mm_loadu_si128((const __m128i *)&src[(c + 4) * TWH_CHANNELS]);
+        _mm_storeu_si128((__m128i *)&dst[c * TWH_CHANNELS], _mm_shuffle_epi8(lo, shuffle));
+        _mm_storeu_si128((__m128i *)&dst[(c + 4) * TWH_CHANNELS], _mm_shuffle_epi8(hi, shuffle));
+    }
+    convert_row_scalar(&dst[c * TWH_CHANNELS], &src[c * TWH_CHANNELS], count - c);
+}
+
+BLIT_TARGET("avx2")
+static void convert_row_avx2(unsigned char *dst, const unsigned char *src, int count)
+{
+    /* vpshufb shuffles within each 128-bit lane, so the mask is repeated */
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                             10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7,
+                                             10, 9, 8, 11, 14, 13, 12, 15);
+    int c = 0;
+
+    for (; c + 16 <= count; c += 16)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)&src[c * TWH_CHANNELS]);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)&src[(c + 8) * TWH_CHANNELS]);
+        _mm256_storeu_si256((__m256i *)&dst[c * TWH_CHANNELS], _mm256_shuffle_epi8(lo, shuffle));
+        _mm256_storeu_si256((__m256i *)&dst[(c + 8) * TWH_CHANNELS], _mm256_shuffle_epi8(hi, shuffle));
+    }
+    convert_row_scalar(&dst[c * TWH_CHANNELS], &src[c * TWH_CHANNELS], count - c);
+}
+
+BLIT_TARGET("ssse3")
+static void scale_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    shuffle_row_ssse3(dst, src, count, scale, 1);
+}
+
+BLIT_TARGET("avx2")
+static void scale_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    permute_row_avx2(dst, src, count, scale, 1);
+}
+
+BLIT_TARGET("ssse3")
+static void replicate_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    shuffle_row_ssse3(dst, src, count, scale, 0);
+}
+
+BLIT_TARGET("avx2")
+static void replicate_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale)
+{
+    permute_row_avx2(dst, src, count, scale, 0);
+}
+
+BLIT_TARGET("ssse3")
+static void shuffle_row_ssse3(unsigned char *dst, const unsigned char *src, int count, int scale, int swap)
+{
+    scale_row_func_t tail = swap ? scale_row_scalar : replicate_row_scalar;
+    int red = swap ? 2 : 0;
+    __m128i shuffles[BLIT_MAX_SIMD_SCALE];
+    int c = 0;
+    int j, k;
+
+    if (scale > BLIT_MAX_SIMD_SCALE)
+    {
+        tail(dst, src, count, scale);
+        return;
+    }
+
+    /* 4 source pixels make `scale` vectors, vector j holds pixels (4j + k) / scale */
+    for (j = 0; j < scale; j++)
+    {
+        unsigned char bytes[16];
+        for (k = 0; k < 4; k++)
+        {
+            int pixel = (4 * j + k) / scale;
+            bytes[k * 4 + 0] = (unsigned char)(pixel * 4 + red);
+            bytes[k * 4 + 1] = (unsigned char)(pixel * 4 + 1);
+            bytes[k * 4 + 2] = (unsigned char)(pixel * 4 + 2 - red);
+            bytes[k * 4 + 3] = (unsigned char)(pixel * 4 + 3);
+        }
+        shuffles[j] = _mm_loadu_si128((const __m128i *)bytes);
+    }
+
+    for (; c + 4 <= count; c += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)&src[c * TWH_CHANNELS]);
+        unsigned char *out = &dst[c * scale * TWH_CHANNELS];
+        for (j = 0; j < scale; j++)
+        {
+            _mm_storeu_si128((__m128i *)&out[j * 16], _mm_shuffle_epi8(pixels, shuffles[j]));
+        }
+    }
+    tail(&dst[c * scale * TWH_CHANNELS], &src[c * TWH_CHANNELS], count - c, scale);
+}
+
+BLIT_TARGET("avx2")
+static void permute_row_avx2(unsigned char *dst, const unsigned char *src, int count, int scale, int swap)
+{
+    const __m256i swap_mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                               10, 9, 8, 11, 14, 13, 12, 15,
+                                               2, 1, 0, 3, 6, 5, 4, 7,
+                                               10, 9, 8, 11, 14, 13, 12, 15);
+    scale_row_func_t tail = swap ? scale_row_scalar : replicate_row_scalar;
+    __m256i indices[BLIT_MAX_SIMD_SCALE];
+    int c = 0;
+    int j, k;
+
+    if (scale > BLIT_MAX_SIMD_SCALE)
+    {
+        tail(dst, src, count, scale);
+        return;
+    }
+
+    /* vpermd crosses lanes, so 8 source pixels make `scale` vectors */
+    for (j = 0; j < scale; j++)
+    {
+        int lanes[8];
+        for (k = 0; k < 8; k++)
+        {
+            lanes[k] = (8 * j + k) / scale;
+        }
+        indices[j] = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+
+    for (; c + 8 <= count; c += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)&src[c * TWH_CHANNELS]);
+        unsigned char *out = &dst[c * scale * TWH_CHANNELS];
+        if (swap)
+        {
+            pixels = _mm256_shuffle_epi8(pixels, swap_mask);
+        }
+        for (j = 0; j < scale; j++)
+        {
+            _mm256_storeu_si256((__m256i *)&out[j * 32], _mm256_permutevar8x32_epi32(pixels, indices[j]));
+        }
+    }
+    tail(&dst[c * scale * TWH_CHANNELS], &src[c * TWH_CHANNELS], count - c, scale);
+}
+
+static void query_cpu_features(int *has_sse2, int *has_ssse3, int *has_avx2)
+{
+    unsigned int leaf1_ecx, leaf1_edx, leaf7_ebx;
+    unsigned int xcr0 = 0;
+
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    leaf1_ecx = (unsigned int)regs[2];
+    leaf1_edx = (unsigned int)regs[3];
+    leaf7_ebx = 0;
+    if (max_leaf >= 7)
+    {
+        __cpuidex(regs, 7, 0);
+        leaf7_ebx = (unsigned int)regs[1];
+    }
+    if (leaf1_ecx & (1u << 27))
+    {
+        xcr0 = (unsigned int)_xgetbv(0);
+    }
+#else
+    unsigned int eax, ebx, ecx, edx;
+    leaf1_ecx = 0;
+    leaf1_edx = 0;
+    leaf7_ebx = 0;
+    if (__get_cpuid(1, &eax, &ebx, &leaf1_ecx, &leaf1_edx) && __get_cpuid_max(0, NULL) >= 7)
+    {
+        __cpuid_count(7, 0, eax, leaf7_ebx, ecx, edx);
+    }
+    if (leaf1_ecx & (1u << 27))
+    {
+        __asm__ __volatile__("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+    }
+#endif
+
+    *has_sse2 = (leaf1_edx & (1u << 26)) != 0;
+    *has_ssse3 = (leaf1_ecx & (1u << 9)) != 0;
+
+    /* AVX2 also needs the OS to save the ymm registers (OSXSAVE and XCR0) */
+    *has_avx2 = (leaf1_ecx & (1u << 27)) && (leaf1_ecx & (1u << 28)) &&
+                (xcr0 & 0x6) == 0x6 && (leaf7_ebx & (1u << 5));
+}
+
+#endif /* BLIT_X86 */
@@ -0,0 +1,144 @@
+#include <stddef.h>
+#include <assert.h>
+
+#include "twh_internal.h"
+
+#if defined(_MSC_VER)
+#include <windows.h>
+typedef volatile LONG ring_index_t;
+#else
+#include <stdatomic.h>
+typedef atomic_uint ring_index_t;
+#endif
+
+#define EVENT_RING_SIZE 1024 /* power of two */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Single producer (the thread polling events), single consumer (the one
+ * calling twh_next_event). Each side only writes its own index, and the
+ * two indices live on separate cache lines so the sides don't contend.
+ */
+struct event_ring
+{
+    ring_index_t head; /* next event to read, written by the consumer */
+    char head_pad[CACHE_LINE_SIZE - sizeof(ring_index_t)];
+    ring_index_t tail; /* next slot to fill, written by the producer */
+    char tail_pad[CACHE_LINE_SIZE - sizeof(ring_index_t)];
+    twh_event_t events[EVENT_RING_SIZE];
+};
+
+static struct event_ring g_ring;
+static float g_event_time = 0;
+
+/* the window system clock unwrapped, and how far behind ours it runs */
+static int g_clock_synced = 0;
+static uint32_t g_clock_last_ms;
+static double g_clock_seconds;
+static double g_clock_offset;
+
+/* declarations */
+static unsigned int load_acquire(ring_index_t *index);
+static void store_release(ring_index_t *index, unsigned int value);
+
+/* implementations */
+
+int twh_next_event(twh_event_t *out_event)
+{
+    unsigned int head = load_acquire(&g_ring.head);
+    unsigned int tail = load_acquire(&g_ring.tail);
+
+    if (head == tail)
+    {
+        return 0;
+    }
+    *out_event = g_ring.events[head & (EVENT_RING_SIZE - 1)];
+    store_release(&g_ring.head, head + 1);
+    return 1;
+}
+
+float twh_get_event_time(void)
+{
+    return g_event_time;
+}
+
+/*
+ * Maps a millisecond timestamp of the window system, which wraps every 49
+ * days, onto our clock. Events can't arrive before they happened, so the
+ * smallest gap between the two clocks seen so far is the best offset.
+ */
+double twh_event_time_from_ms(uint32_t ms)
+{
+    double now = twh_stats_now();
+
+    if (!g_clock_synced)
+    {
+        g_clock_seconds = ms / 1000.0;
+        g_clock_offset = now - g_clock_seconds;
+        g_clock_synced = 1;
+    }
+    else
+    {
+        g_clock_seconds += (int32_t)(ms - g_clock_last_ms) / 1000.0;
+    }
+    g_clock_last_ms = ms;
+
+    if (now - g_clock_seconds < g_clock_offset)
+    {
+        g_clock_offset = now - g_clock_seconds;
+    }
+    return g_clock_seconds + g_clock_offset;
+}
+
+/* returns 0 and drops the event when the consumer has fallen a full ring behind */
+int twh_push_event(const twh_event_t *event, double time)
+{
+    unsigned int tail = load_acquire(&g_ring.tail);
+    unsigned int head = load_acquire(&g_ring.head);
+    twh_event_t *slot;
+
+    assert(event->window != NULL);
+    g_event_time = twh_get_timef() - (float)(twh_stats_now() - time);
+    if (event->type != TWH_EVENT_CLOSE)
+    {
+        twh_stats_input(event->window, time);
+    }
+
+    if (tail - head == EVENT_RING_SIZE)
+    {
+        return 0;
+    }
+    slot = &g_ring.events[tail & (EVENT_RING_SIZE - 1)];
+    *slot = *event;
+    slot->time = g_event_time;
+    store_release(&g_ring.tail, tail + 1);
+    return 1;
+}
+
+/* private functions */
+
+#if defined(_MSC_VER)
+
+static unsigned int load_acquire(ring_index_t *index)
+{
+    return (unsigned int)InterlockedCompareExchange(index, 0, 0);
+}
+
+static void store_release(ring_index_t *index, unsigned int value)
+{
+    InterlockedExchange(index, (LONG)value);
+}
+
+#else
+
+static unsigned int load_acquire(ring_index_t *index)
+{
+    return atomic_load_explicit(index, memory_order_acquire);
+}
+
+static void store_release(ring_index_t *index, unsigned int value)
+{
+    atomic_store_explicit(index, value, memory_order_release);
+}
+
+#endif
@@ -8,6 +8,7 @@
 
 #define WND_W 800
 #define WND_H 600
+#define TARGET_FPS 60
 
 static void key_callback(twh_window_t *wnd, TWH_KEY_CODE keycode, int pressed)
 {
@@ -51,13 +52,22 @@ static void scroll_callback(twh_window_t *wnd, float offset)
 int main(void)
 {
     twh_init();
+    twh_set_target_fps(TARGET_FPS);
 
     twh_window_t *wnd = twh_window_create("Example", WND_W, WND_H);
+    twh_framebuffer_t *fb = twh_framebuffer_create(WND_W, WND_H);
+    if (wnd == NULL || fb == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        twh_framebuffer_release(fb);
+        twh_window_release(wnd);
+        twh_terminate();
+        return 1;
+    }
     twh_set_key_callback(wnd, key_callback);
     twh_set_mouse_callback(wnd, mouse_callback);
     twh_set_scroll_callback(wnd, scroll_callback);
 
-    twh_framebuffer_t *fb = twh_framebuffer_create(WND_W, WND_H);
     for (int r = 0; r < WND_H; r++)
     {
         for (int c = 0; c < WND_W; c++)
@@ -68,9 +78,13 @@ int main(void)
 
     while (!twh_window_should_close(wnd))
     {
+        twh_frame_begin();
+
         twh_framebuffer_render(wnd, fb);
 
         twh_poll_events();
+
+        twh_frame_end();
     }
 
     twh_framebuffer_release(fb);
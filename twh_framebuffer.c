@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+
+#include "twh_internal.h"
+
+/* damaged rects closer than this are presented as one */
+#define DAMAGE_MERGE_DISTANCE 16
+
+/* declarations */
+static void reset_damage(twh_damage_t *damage);
+static void add_damage(twh_damage_t *damage, twh_rect_t rect);
+static int is_rect_near(const twh_rect_t *a, const twh_rect_t *b);
+static twh_rect_t union_rect(const twh_rect_t *a, const twh_rect_t *b);
+static long rect_area(const twh_rect_t *rect);
+static int clip_rect(const twh_framebuffer_t *fb, twh_rect_t *rect);
+static int clip_span(int *dst_pos, int dst_size, int *src_pos, int src_size, int *length);
+static void make_pixel(const twh_framebuffer_t *fb, uint32_t rgb, unsigned char *out_pixel);
+static void fill_pixels(unsigned char *dst, const unsigned char *pixel, size_t count);
+
+/* implementations */
+
+twh_framebuffer_t *twh_framebuffer_create(int width, int height)
+{
+    twh_framebuffer_t *framebuffer = (twh_framebuffer_t *)malloc(sizeof(twh_framebuffer_t));
+    memset(framebuffer, 0, sizeof(twh_framebuffer_t));
+    framebuffer->width = width;
+    framebuffer->height = height;
+    framebuffer->format = TWH_PIXEL_FORMAT_RGBX;
+    framebuffer->origin = TWH_ORIGIN_BOTTOM_LEFT;
+    reset_damage(&framebuffer->damage);
+    framebuffer->damage.full = 1;
+    size_t sz = (size_t)width * height * sizeof(unsigned char) * TWH_CHANNELS;
+    framebuffer->buffer = (unsigned char *)twh_pixels_alloc(sz);
+    if (framebuffer->buffer == NULL)
+    {
+        free(framebuffer);
+        return NULL;
+    }
+    return framebuffer;
+}
+
+void twh_framebuffer_release(twh_framebuffer_t *fb)
+{
+    if (fb != NULL)
+    {
+        /* the window framebuffer is owned by its window */
+        assert(fb->window == NULL);
+        if (fb->buffer != NULL)
+        {
+            twh_pixels_free(fb->buffer, (size_t)fb->width * fb->height * TWH_CHANNELS);
+            fb->buffer = NULL;
+        }
+        free(fb);
+        fb = NULL;
+    }
+}
+
+void twh_framebuffer_set_layout(twh_framebuffer_t *fb, TWH_PIXEL_FORMAT format, TWH_ORIGIN origin)
+{
+    /* the window framebuffer is the surface, its layout is the window's */
+    assert(fb->window == NULL);
+    fb->format = format;
+    fb->origin = origin;
+    fb->damage.full = 1;
+}
+
+void twh_framebuffer_set_color_u8(twh_framebuffer_t *fb, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+{
+    int index = (y * fb->width + x) * TWH_CHANNELS;
+    int swap = fb->format == TWH_PIXEL_FORMAT_BGRX ? 2 : 0;
+    fb->buffer[index + swap] = r;
+    fb->buffer[index + 1] = g;
+    fb->buffer[index + 2 - swap] = b;
+
+    twh_damage_t *damage = &fb->damage;
+    if (x < damage->x0)
+        damage->x0 = x;
+    if (x >= damage->x1)
+        damage->x1 = x + 1;
+    if (y < damage->y0)
+        damage->y0 = y;
+    if (y >= damage->y1)
+        damage->y1 = y + 1;
+}
+
+void twh_framebuffer_set_color_u32(twh_framebuffer_t *fb, int x, int y, uint32_t rgb)
+{
+    twh_framebuffer_set_color_u8(fb, x, y, (rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff);
+}
+
+void twh_framebuffer_clear(twh_framebuffer_t *fb, uint32_t rgb)
+{
+    twh_framebuffer_fill_rect(fb, 0, 0, fb->width, fb->height, rgb);
+}
+
+void twh_framebuffer_fill_rect(twh_framebuffer_t *fb, int x, int y, int w, int h, uint32_t rgb)
+{
+    unsigned char pixel[TWH_CHANNELS];
+    twh_rect_t rect = {x, y, w, h};
+    size_t stride = (size_t)fb->width * TWH_CHANNELS;
+    unsigned char *row;
+    int r;
+
+    if (!clip_rect(fb, &rect))
+    {
+        return;
+    }
+    make_pixel(fb, rgb, pixel);
+    row = &fb->buffer[rect.y * stride + (size_t)rect.x * TWH_CHANNELS];
+
+    if (rect.w == fb->width)
+    {
+        /* whole rows are one run of pixels */
+        fill_pixels(row, pixel, (size_t)rect.w * rect.h);
+    }
+    else
+    {
+        fill_pixels(row, pixel, rect.w);
+        for (r = 1; r < rect.h; r++)
+        {
+            memcpy(row + r * stride, row, (size_t)rect.w * TWH_CHANNELS);
+        }
+    }
+    twh_framebuffer_mark_dirty(fb, rect.x, rect.y, rect.w, rect.h);
+}
+
+void twh_framebuffer_hspan(twh_framebuffer_t *fb, int x, int y, int w, uint32_t rgb)
+{
+    twh_framebuffer_fill_rect(fb, x, y, w, 1, rgb);
+}
+
+void twh_framebuffer_vspan(twh_framebuffer_t *fb, int x, int y, int h, uint32_t rgb)
+{
+    twh_framebuffer_fill_rect(fb, x, y, 1, h, rgb);
+}
+
+void twh_framebuffer_copy_rect(twh_framebuffer_t *dst, int dst_x, int dst_y,
+                               const twh_framebuffer_t *src, int src_x, int src_y, int w, int h)
+{
+    size_t dst_stride = (size_t)dst->width * TWH_CHANNELS;
+    size_t src_stride = (size_t)src->width * TWH_CHANNELS;
+    int flip = dst->origin != src->origin;
+    int r, first, last, step;
+
+    /* rows count from opposite edges, clip as if the source counted like dst */
+    if (flip)
+    {
+        src_y = src->height - src_y - h;
+    }
+    if (!clip_span(&dst_x, dst->width, &src_x, src->width, &w) ||
+        !clip_span(&dst_y, dst->height, &src_y, src->height, &h))
+    {
+        return;
+    }
+    if (flip)
+    {
+        src_y = src->height - src_y - h;
+    }
+
+    /* within one buffer, copy rows in the order that doesn't overwrite the source */
+    first = 0;
+    last = h;
+    step = 1;
+    if (dst == src && dst_y > src_y)
+    {
+        first = h - 1;
+        last = -1;
+        step = -1;
+    }
+    for (r = first; r != last; r += step)
+    {
+        unsigned char *dst_row = &dst->buffer[(dst_y + r) * dst_stride + (size_t)dst_x * TWH_CHANNELS];
+        /* and copy them upside down, so the image stays upright */
+        int src_r = flip ? h - 1 - r : r;
+        const unsigned char *src_row = &src->buffer[(src_y + src_r) * src_stride + (size_t)src_x * TWH_CHANNELS];
+        if (dst->format == src->format)
+        {
+            memmove(dst_row, src_row, (size_t)w * TWH_CHANNELS);
+        }
+        else
+        {
+            twh_blit_swap_row(dst_row, src_row, w);
+        }
+    }
+    twh_framebuffer_mark_dirty(dst, dst_x, dst_y, w, h);
+}
+
+void twh_framebuffer_blit(twh_framebuffer_t *dst, int x, int y, const twh_framebuffer_t *src)
+{
+    twh_framebuffer_copy_rect(dst, x, y, src, 0, 0, src->width, src->height);
+}
+
+void twh_framebuffer_mark_dirty(twh_framebuffer_t *fb, int x, int y, int w, int h)
+{
+    twh_rect_t rect;
+    rect.x = x < 0 ? 0 : x;
+    rect.y = y < 0 ? 0 : y;
+    rect.w = (x + w > fb->width ? fb->width : x + w) - rect.x;
+    rect.h = (y + h > fb->height ? fb->height : y + h) - rect.y;
+    if (rect.w <= 0 || rect.h <= 0)
+    {
+        return;
+    }
+
+    if (rect.w == fb->width && rect.h == fb->height)
+    {
+        fb->damage.full = 1;
+    }
+    add_damage(&fb->damage, rect);
+}
+
+/* the images of a swapchain, all of them or none when out of memory */
+int twh_framebuffer_create_images(twh_framebuffer_t **images, int count, int width, int height)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        images[i] = twh_framebuffer_create(width, height);
+        if (images[i] == NULL)
+        {
+            twh_framebuffer_release_images(images, i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void twh_framebuffer_release_images(twh_framebuffer_t **images, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        twh_framebuffer_release(images[i]);
+        images[i] = NULL;
+    }
+}
+
+void twh_framebuffer_init_window(twh_framebuffer_t *fb, twh_window_t *wnd, unsigned char *surface, int width, int height)
+{
+    memset(fb, 0, sizeof(twh_framebuffer_t));
+    fb->width = width;
+    fb->height = height;
+    fb->buffer = surface;
+    fb->format = TWH_PIXEL_FORMAT_BGRX;
+    fb->origin = TWH_ORIGIN_TOP_LEFT;
+    fb->window = wnd;
+    reset_damage(&fb->damage);
+    fb->damage.full = 1;
+}
+
+/*
+ * Returns the rects damaged since the last call (at most TWH_DAMAGE_RECTS)
+ * and starts tracking the next frame.
+ */
+int twh_framebuffer_take_damage(twh_framebuffer_t *fb, twh_rect_t *out_rects)
+{
+    twh_damage_t *damage = &fb->damage;
+    int count;
+
+    if (damage->x0 < damage->x1)
+    {
+        twh_rect_t painted;
+        painted.x = damage->x0;
+        painted.y = damage->y0;
+        painted.w = damage->x1 - damage->x0;
+        painted.h = damage->y1 - damage->y0;
+        add_damage(damage, painted);
+    }
+
+    if (damage->full)
+    {
+        out_rects[0].x = 0;
+        out_rects[0].y = 0;
+        out_rects[0].w = fb->width;
+        out_rects[0].h = fb->height;
+        count = 1;
+    }
+    else
+    {
+        count = damage->count;
+        memcpy(out_rects, damage->rects, count * sizeof(twh_rect_t));
+    }
+
+    reset_damage(damage);
+    return count;
+}
+
+/* private functions */
+
+static void reset_damage(twh_damage_t *damage)
+{
+    damage->full = 0;
+    damage->count = 0;
+    damage->x0 = INT_MAX;
+    damage->y0 = INT_MAX;
+    damage->x1 = INT_MIN;
+    damage->y1 = INT_MIN;
+}
+
+static void add_damage(twh_damage_t *damage, twh_rect_t rect)
+{
+    int i;
+
+    if (damage->full)
+    {
+        return;
+    }
+
+    /* fold every nearby rect in, the grown rect may now reach others */
+    for (i = 0; i < damage->count; i++)
+    {
+        if (is_rect_near(&damage->rects[i], &rect))
+        {
+            rect = union_rect(&damage->rects[i], &rect);
+            damage->rects[i] = damage->rects[--damage->count];
+            i = -1;
+        }
+    }
+
+    if (damage->count < TWH_DAMAGE_RECTS)
+    {
+        damage->rects[damage->count++] = rect;
+        return;
+    }
+
+    /* out of slots, grow the rect that wastes the fewest pixels */
+    int best = 0;
+    long best_growth = LONG_MAX;
+    for (i = 0; i < damage->count; i++)
+    {
+        twh_rect_t merged = union_rect(&damage->rects[i], &rect);
+        long growth = rect_area(&merged) - rect_area(&damage->rects[i]);
+        if (growth < best_growth)
+        {
+            best = i;
+            best_growth = growth;
+        }
+    }
+    damage->rects[best] = union_rect(&damage->rects[best], &rect);
+}
+
+static int is_rect_near(const twh_rect_t *a, const twh_rect_t *b)
+{
+    return a->x <= b->x + b->w + DAMAGE_MERGE_DISTANCE &&
+           b->x <= a->x + a->w + DAMAGE_MERGE_DISTANCE &&
+           a->y <= b->y + b->h + DAMAGE_MERGE_DISTANCE &&
+           b->y <= a->y + a->h + DAMAGE_MERGE_DISTANCE;
+}
+
+static twh_rect_t union_rect(const twh_rect_t *a, const twh_rect_t *b)
+{
+    twh_rect_t rect;
+    int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+    int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+    rect.x = a->x < b->x ? a->x : b->x;
+    rect.y = a->y < b->y ? a->y : b->y;
+    rect.w = x1 - rect.x;
+    rect.h = y1 - rect.y;
+    return rect;
+}
+
+static long rect_area(const twh_rect_t *rect)
+{
+    return (long)rect->w * rect->h;
+}
+
+static int clip_rect(const twh_framebuffer_t *fb, twh_rect_t *rect)
+{
+    int x1 = rect->x + rect->w > fb->width ? fb->width : rect->x + rect->w;
+    int y1 = rect->y + rect->h > fb->height ? fb->height : rect->y + rect->h;
+    rect->x = rect->x < 0 ? 0 : rect->x;
+    rect->y = rect->y < 0 ? 0 : rect->y;
+    rect->w = x1 - rect->x;
+    rect->h = y1 - rect->y;
+    return rect->w > 0 && rect->h > 0;
+}
+
+/* clips one axis of a copy so both the source and destination stay in bounds */
+static int clip_span(int *dst_pos, int dst_size, int *src_pos, int src_size, int *length)
+{
+    if (*src_pos < 0)
+    {
+        *dst_pos -= *src_pos;
+        *length += *src_pos;
+        *src_pos = 0;
+    }
+    if (*dst_pos < 0)
+    {
+        *src_pos -= *dst_pos;
+        *length += *dst_pos;
+        *dst_pos = 0;
+    }
+    if (*length > src_size - *src_pos)
+    {
+        *length = src_size - *src_pos;
+    }
+    if (*length > dst_size - *dst_pos)
+    {
+        *length = dst_size - *dst_pos;
+    }
+    return *length > 0;
+}
+
+static void make_pixel(const twh_framebuffer_t *fb, uint32_t rgb, unsigned char *out_pixel)
+{
+    int swap = fb->format == TWH_PIXEL_FORMAT_BGRX ? 2 : 0;
+    out_pixel[swap] = (rgb >> 16) & 0xff;
+    out_pixel[1] = (rgb >> 8) & 0xff;
+    out_pixel[2 - swap] = rgb & 0xff;
+    out_pixel[3] = 0;
+}
+
+/*
+ * Writes one pixel, then keeps doubling the filled part with memcpy, so
+ * the bulk of the work runs in the C library's vectorized copy.
+ */
+static void fill_pixels(unsigned char *dst, const unsigned char *pixel, size_t count)
+{
+    size_t filled = 1;
+
+    if (pixel[0] == pixel[1] && pixel[1] == pixel[2] && pixel[2] == pixel[3])
+    {
+        memset(dst, pixel[0], count * TWH_CHANNELS);
+        return;
+    }
+
+    memcpy(dst, pixel, TWH_CHANNELS);
+    while (filled < count)
+    {
+        size_t n = filled < count - filled ? filled : count - filled;
+        memcpy(&dst[filled * TWH_CHANNELS], dst, n * TWH_CHANNELS);
+        filled += n;
+    }
+}
@@ -0,0 +1,572 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "twh.h"
+#include "twh_headless.h"
+#include "twh_internal.h"
+
+#define SURFACE_CHANNELS TWH_CHANNELS
+#define SWAPCHAIN_MAX_IMAGES 3
+#define INJECT_QUEUE_SIZE 256
+
+struct twh_window
+{
+    int window_w;
+    int window_h;
+    int surface_w; /* the presented framebuffer times its scale */
+    int surface_h;
+    int surface_x; /* where the surface sits in the window */
+    int surface_y;
+    unsigned char *surface;
+    twh_framebuffer_t framebuffer;
+    twh_framebuffer_t *presented_fb; /* whose pixels the surface holds */
+
+    int should_close;
+    void *userdata;
+    float cursor_x;
+    float cursor_y;
+    twh_input_state_t input;
+
+    twh_key_callback_func_t key_callback;
+    twh_mouse_callback_func_t mouse_callback;
+    twh_scroll_callback_func_t scroll_callback;
+    twh_motion_callback_func_t motion_callback;
+};
+
+/* presenting is a memory write, so the swapchain renders synchronously */
+struct twh_swapchain
+{
+    twh_window_t *window;
+    int image_count;
+    twh_framebuffer_t *images[SWAPCHAIN_MAX_IMAGES];
+    int next_acquire;
+};
+
+static int g_initialized = 0;
+static twh_event_t g_injected[INJECT_QUEUE_SIZE];
+static double g_injected_times[INJECT_QUEUE_SIZE]; /* when they were injected */
+static int g_injected_count = 0;
+static double g_frame_period = 0;
+static double g_frame_start = 0;
+static double g_frame_deadline = 0;
+static double g_frame_stats_start = 0;
+
+/* declarations */
+static double get_native_time(void);
+static void sleep_until(double deadline);
+
+static int resize_surface(twh_window_t *wnd, int width, int height);
+static void place_surface(twh_window_t *wnd, int x, int y);
+static int inject_event(const twh_event_t *event);
+static void process_event(const twh_event_t *event, double time);
+
+/* implementations */
+
+void twh_init(void)
+{
+    assert(g_initialized == 0);
+    twh_blit_init();
+    g_initialized = 1;
+}
+
+void twh_terminate(void)
+{
+    assert(g_initialized == 1);
+    twh_blit_terminate();
+    twh_pixels_trim();
+    g_injected_count = 0;
+    g_initialized = 0;
+}
+
+float twh_get_timef(void)
+{
+    static double initial = -1;
+    if (initial < 0)
+    {
+        initial = get_native_time();
+    }
+    return (float)(get_native_time() - initial);
+}
+
+void twh_set_target_fps(double fps)
+{
+    g_frame_period = fps > 0 ? 1.0 / fps : 0;
+    g_frame_deadline = 0;
+}
+
+void twh_frame_begin(void)
+{
+    g_frame_start = get_native_time();
+    g_frame_stats_start = twh_stats_begin();
+}
+
+void twh_frame_end(void)
+{
+    twh_stats_end(TWH_STAGE_FRAME, g_frame_stats_start);
+    if (g_frame_period <= 0)
+    {
+        return;
+    }
+
+    /* keep a steady cadence, but don't rush frames to catch up a stall */
+    if (g_frame_deadline <= 0 || get_native_time() - g_frame_deadline > g_frame_period)
+    {
+        g_frame_deadline = g_frame_start + g_frame_period;
+    }
+    else
+    {
+        g_frame_deadline += g_frame_period;
+    }
+    sleep_until(g_frame_deadline);
+}
+
+twh_window_t *twh_window_create(const char *title, int width, int height)
+{
+    twh_window_t *window;
+
+    assert(g_initialized && width > 0 && height > 0);
+    (void)title;
+
+    window = (twh_window_t *)malloc(sizeof(twh_window_t));
+    memset(window, 0, sizeof(twh_window_t));
+    window->window_w = width;
+    window->window_h = height;
+    window->surface_w = width;
+    window->surface_h = height;
+    window->surface = (unsigned char *)twh_pixels_alloc((size_t)width * height * SURFACE_CHANNELS);
+    if (window->surface == NULL)
+    {
+        free(window);
+        return NULL;
+    }
+    twh_framebuffer_init_window(&window->framebuffer, window, window->surface, width, height);
+    return window;
+}
+
+void twh_window_release(twh_window_t *wnd)
+{
+    int i, kept = 0;
+
+    if (wnd == NULL)
+        return;
+
+    /* forget injected events nobody is left to receive */
+    for (i = 0; i < g_injected_count; i++)
+    {
+        if (g_injected[i].window != wnd)
+        {
+            g_injected_times[kept] = g_injected_times[i];
+            g_injected[kept++] = g_injected[i];
+        }
+    }
+    g_injected_count = kept;
+
+    twh_pixels_free(wnd->surface, (size_t)wnd->surface_w * wnd->surface_h * SURFACE_CHANNELS);
+    twh_stats_forget(wnd);
+    free(wnd);
+    wnd = NULL;
+}
+
+void twh_set_user_data(twh_window_t *wnd, void *userdata)
+{
+    wnd->userdata = userdata;
+}
+
+void *twh_get_user_data(twh_window_t *wnd)
+{
+    return wnd->userdata;
+}
+
+int twh_window_should_close(twh_window_t *wnd)
+{
+    return wnd->should_close;
+}
+
+void twh_window_close(twh_window_t *wnd)
+{
+    wnd->should_close = 1;
+}
+
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height)
+{
+    *width = wnd->window_w;
+    *height = wnd->window_h;
+}
+
+void twh_poll_events()
+{
+    double start = twh_stats_begin();
+    unsigned int count = 0;
+    int i;
+
+    twh_input_begin_poll();
+    for (i = 0; i < g_injected_count; i++)
+    {
+        const twh_event_t *event = &g_injected[i];
+
+        /* like the X backend, a run of motions only reports the last one */
+        if (event->type == TWH_EVENT_MOTION && i + 1 < g_injected_count &&
+            g_injected[i + 1].type == TWH_EVENT_MOTION && g_injected[i + 1].window == event->window)
+        {
+            continue;
+        }
+        process_event(event, g_injected_times[i]);
+        count++;
+    }
+    g_injected_count = 0;
+    twh_stats_count_events(count);
+    twh_stats_end(TWH_STAGE_EVENTS, start);
+}
+
+/* nothing arrives on its own, the timeout is only slept when nothing was injected */
+void twh_wait_events(double timeout)
+{
+    if (g_injected_count == 0 && timeout > 0)
+    {
+        sleep_until(get_native_time() + timeout);
+    }
+    twh_poll_events();
+}
+
+void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback)
+{
+    wnd->key_callback = key_callback;
+}
+
+void twh_set_mouse_callback(twh_window_t *wnd, twh_mouse_callback_func_t mouse_callback)
+{
+    wnd->mouse_callback = mouse_callback;
+}
+
+void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scroll_callback)
+{
+    wnd->scroll_callback = scroll_callback;
+}
+
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback)
+{
+    wnd->motion_callback = motion_callback;
+}
+
+void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
+{
+    *xpos = wnd->cursor_x;
+    *ypos = wnd->cursor_y;
+}
+
+void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
+{
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count, i, scale, x, y;
+    double start;
+
+    count = twh_framebuffer_take_damage(fb, rects);
+
+    if (fb == &wnd->framebuffer)
+    {
+        if (wnd->surface == NULL)
+        {
+            return;
+        }
+        /* the surface is the framebuffer, there is nothing to copy */
+        twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, 1, &x, &y);
+        place_surface(wnd, x, y);
+        wnd->presented_fb = fb;
+        twh_stats_rendered(wnd);
+        return;
+    }
+
+    scale = twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, INT_MAX, &x, &y);
+    if ((fb->width * scale != wnd->surface_w || fb->height * scale != wnd->surface_h) &&
+        !resize_surface(wnd, fb->width * scale, fb->height * scale))
+    {
+        return;
+    }
+    place_surface(wnd, x, y);
+
+    if (fb != wnd->presented_fb)
+    {
+        /* the surface holds another framebuffer's pixels */
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].w = fb->width;
+        rects[0].h = fb->height;
+        count = 1;
+        wnd->presented_fb = fb;
+    }
+    if (count == 0)
+    {
+        return;
+    }
+
+    start = twh_stats_begin();
+    for (i = 0; i < count; i++)
+    {
+        twh_blit_bgr_rect(fb, wnd->surface, scale, &rects[i]);
+    }
+    twh_stats_end(TWH_STAGE_BLIT, start);
+    twh_stats_rendered(wnd);
+}
+
+/* there is nothing to flush, a batch is a loop */
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        twh_framebuffer_render(windows[i], framebuffers[i]);
+    }
+}
+
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd)
+{
+    /* follow the window size, unless it is minimized */
+    if (wnd->window_w > 0 && wnd->window_h > 0 &&
+        (wnd->surface_w != wnd->window_w || wnd->surface_h != wnd->window_h))
+    {
+        resize_surface(wnd, wnd->window_w, wnd->window_h);
+    }
+    return &wnd->framebuffer;
+}
+
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd)
+{
+    return twh_input_current(&wnd->input);
+}
+
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count)
+{
+    twh_swapchain_t *swapchain;
+
+    assert(image_count >= 2 && image_count <= SWAPCHAIN_MAX_IMAGES);
+
+    swapchain = (twh_swapchain_t *)malloc(sizeof(twh_swapchain_t));
+    memset(swapchain, 0, sizeof(twh_swapchain_t));
+    swapchain->window = wnd;
+    if (!twh_framebuffer_create_images(swapchain->images, image_count, wnd->window_w, wnd->window_h))
+    {
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->image_count = image_count;
+    return swapchain;
+}
+
+void twh_swapchain_release(twh_swapchain_t *swapchain)
+{
+    if (swapchain == NULL)
+        return;
+
+    twh_framebuffer_release_images(swapchain->images, swapchain->image_count);
+    free(swapchain);
+}
+
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain)
+{
+    twh_framebuffer_t *fb = swapchain->images[swapchain->next_acquire];
+    swapchain->next_acquire = (swapchain->next_acquire + 1) % swapchain->image_count;
+    return fb;
+}
+
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb)
+{
+    twh_framebuffer_render(swapchain->window, fb);
+}
+
+int twh_headless_inject_key(twh_window_t *wnd, TWH_KEY_CODE key, int pressed)
+{
+    twh_event_t event;
+    assert(key >= 0 && key < TWH_KEY_NUM);
+    event.type = TWH_EVENT_KEY;
+    event.window = wnd;
+    event.key.code = key;
+    event.key.pressed = pressed;
+    return inject_event(&event);
+}
+
+int twh_headless_inject_mouse_button(twh_window_t *wnd, TWH_MOUSE_BUTTON mb, int pressed)
+{
+    twh_event_t event;
+    assert(mb >= 0 && mb < TWH_MOUSE_BUTTON_NUM);
+    event.type = TWH_EVENT_MOUSE_BUTTON;
+    event.window = wnd;
+    event.mouse.button = mb;
+    event.mouse.pressed = pressed;
+    return inject_event(&event);
+}
+
+int twh_headless_inject_scroll(twh_window_t *wnd, float offset)
+{
+    twh_event_t event;
+    event.type = TWH_EVENT_SCROLL;
+    event.window = wnd;
+    event.scroll.offset = offset;
+    return inject_event(&event);
+}
+
+int twh_headless_inject_motion(twh_window_t *wnd, float x, float y)
+{
+    twh_event_t event;
+    event.type = TWH_EVENT_MOTION;
+    event.window = wnd;
+    event.motion.x = x;
+    event.motion.y = y;
+    return inject_event(&event);
+}
+
+int twh_headless_inject_close(twh_window_t *wnd)
+{
+    twh_event_t event;
+    event.type = TWH_EVENT_CLOSE;
+    event.window = wnd;
+    return inject_event(&event);
+}
+
+void twh_headless_resize(twh_window_t *wnd, int width, int height)
+{
+    assert(width >= 0 && height >= 0);
+    wnd->window_w = width;
+    wnd->window_h = height;
+}
+
+const unsigned char *twh_headless_get_surface(twh_window_t *wnd, twh_rect_t *out_rect)
+{
+    out_rect->x = wnd->surface_x;
+    out_rect->y = wnd->surface_y;
+    out_rect->w = wnd->surface_w;
+    out_rect->h = wnd->surface_h;
+    return wnd->surface;
+}
+
+/* private functions */
+
+static double get_native_time(void)
+{
+#ifdef _WIN32
+    static double period = -1;
+    LARGE_INTEGER counter;
+    if (period < 0)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        period = 1.0 / (double)frequency.QuadPart;
+    }
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart * period;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* no spin tail, nothing is presented on a deadline here */
+static void sleep_until(double deadline)
+{
+#ifdef _WIN32
+    double remaining;
+
+    /* Sleep counts in scheduler ticks and may wake early, sleep again for what is left */
+    while ((remaining = deadline - get_native_time()) > 0)
+    {
+        double ms = remaining * 1000.0 + 1.0;
+        Sleep(ms < (double)(INFINITE - 1) ? (DWORD)ms : INFINITE - 1);
+    }
+#else
+    struct timespec ts;
+
+    if (get_native_time() >= deadline)
+    {
+        return;
+    }
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+        /* interrupted by a signal, the deadline is absolute */
+    }
+#endif
+}
+
+/*
+ * The old surface goes away, so does whatever the window framebuffer held.
+ * Out of memory the window is left without a surface, 0 x 0 until a later
+ * resize succeeds, and returns 0.
+ */
+static int resize_surface(twh_window_t *wnd, int width, int height)
+{
+    twh_pixels_free(wnd->surface, (size_t)wnd->surface_w * wnd->surface_h * SURFACE_CHANNELS);
+    wnd->surface = (unsigned char *)twh_pixels_alloc((size_t)width * height * SURFACE_CHANNELS);
+    wnd->surface_w = wnd->surface != NULL ? width : 0;
+    wnd->surface_h = wnd->surface != NULL ? height : 0;
+    twh_framebuffer_init_window(&wnd->framebuffer, wnd, wnd->surface, wnd->surface_w, wnd->surface_h);
+    wnd->presented_fb = NULL;
+    return wnd->surface != NULL;
+}
+
+static void place_surface(twh_window_t *wnd, int x, int y)
+{
+    wnd->surface_x = x;
+    wnd->surface_y = y;
+}
+
+static int inject_event(const twh_event_t *event)
+{
+    assert(event->window != NULL);
+    if (g_injected_count == INJECT_QUEUE_SIZE)
+    {
+        return 0;
+    }
+    g_injected_times[g_injected_count] = twh_stats_now();
+    g_injected[g_injected_count++] = *event;
+    return 1;
+}
+
+static void process_event(const twh_event_t *event, double time)
+{
+    twh_window_t *wnd = event->window;
+
+    if (event->type == TWH_EVENT_KEY)
+    {
+        twh_input_update_key(&wnd->input, event->key.code, event->key.pressed);
+    }
+    else if (event->type == TWH_EVENT_MOUSE_BUTTON)
+    {
+        twh_input_update_button(&wnd->input, event->mouse.button, event->mouse.pressed);
+    }
+    else if (event->type == TWH_EVENT_MOTION)
+    {
+        wnd->cursor_x = event->motion.x;
+        wnd->cursor_y = event->motion.y;
+    }
+    else if (event->type == TWH_EVENT_CLOSE)
+    {
+        wnd->should_close = 1;
+    }
+    twh_push_event(event, time);
+
+    if (event->type == TWH_EVENT_KEY && wnd->key_callback)
+    {
+        wnd->key_callback(wnd, event->key.code, event->key.pressed);
+    }
+    else if (event->type == TWH_EVENT_MOUSE_BUTTON && wnd->mouse_callback)
+    {
+        wnd->mouse_callback(wnd, event->mouse.button, event->mouse.pressed);
+    }
+    else if (event->type == TWH_EVENT_SCROLL && wnd->scroll_callback)
+    {
+        wnd->scroll_callback(wnd, event->scroll.offset);
+    }
+    else if (event->type == TWH_EVENT_MOTION && wnd->motion_callback)
+    {
+        wnd->motion_callback(wnd, event->motion.x, event->motion.y);
+    }
+}
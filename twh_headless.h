@@ -0,0 +1,28 @@
+#ifndef TWH_HEADLESS_H
+#define TWH_HEADLESS_H
+
+/*
+ * Extras of the headless backend (built with TWH_HEADLESS). Windows are
+ * in-memory surfaces, input is injected here and delivered by the next
+ * twh_poll_events like events of a real window system.
+ */
+
+#include "twh.h"
+
+/* return 0 when the injection queue is full and the event was dropped */
+int twh_headless_inject_key(twh_window_t *wnd, TWH_KEY_CODE key, int pressed);
+int twh_headless_inject_mouse_button(twh_window_t *wnd, TWH_MOUSE_BUTTON mb, int pressed);
+int twh_headless_inject_scroll(twh_window_t *wnd, float offset);
+int twh_headless_inject_motion(twh_window_t *wnd, float x, float y);
+int twh_headless_inject_close(twh_window_t *wnd);
+
+/* takes effect at once, like the user resizing the window */
+void twh_headless_resize(twh_window_t *wnd, int width, int height);
+
+/*
+ * The presented pixels: top-down BGRX rows of out_rect->w pixels, placed
+ * at out_rect->x, out_rect->y in the window. The rest of the window is black.
+ */
+const unsigned char *twh_headless_get_surface(twh_window_t *wnd, twh_rect_t *out_rect);
+
+#endif /* TWH_HEADLESS_H */
@@ -0,0 +1,140 @@
+#include <string.h>
+#include <assert.h>
+
+#include "twh_internal.h"
+
+#define WORD_BITS 64
+
+/* bumped by every twh_poll_events, edges of older polls are stale */
+static unsigned int g_input_poll = 1;
+
+/* declarations */
+static void sync_poll(twh_input_state_t *input);
+static int test_bit(const uint64_t *bits, int index);
+
+/* implementations */
+
+int twh_is_key_down(const twh_input_state_t *input, TWH_KEY_CODE key)
+{
+    assert(key >= 0 && key < TWH_KEY_NUM);
+    return test_bit(input->keys_down, key);
+}
+
+int twh_is_key_pressed(const twh_input_state_t *input, TWH_KEY_CODE key)
+{
+    assert(key >= 0 && key < TWH_KEY_NUM);
+    return test_bit(input->keys_pressed, key);
+}
+
+int twh_is_key_released(const twh_input_state_t *input, TWH_KEY_CODE key)
+{
+    assert(key >= 0 && key < TWH_KEY_NUM);
+    return test_bit(input->keys_released, key);
+}
+
+int twh_is_button_down(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb)
+{
+    assert(mb >= 0 && mb < TWH_MOUSE_BUTTON_NUM);
+    return (input->buttons_down >> mb) & 1;
+}
+
+int twh_is_button_pressed(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb)
+{
+    assert(mb >= 0 && mb < TWH_MOUSE_BUTTON_NUM);
+    return (input->buttons_pressed >> mb) & 1;
+}
+
+int twh_is_button_released(const twh_input_state_t *input, TWH_MOUSE_BUTTON mb)
+{
+    assert(mb >= 0 && mb < TWH_MOUSE_BUTTON_NUM);
+    return (input->buttons_released >> mb) & 1;
+}
+
+void twh_input_begin_poll(void)
+{
+    g_input_poll++;
+}
+
+const twh_input_state_t *twh_input_current(twh_input_state_t *input)
+{
+    sync_poll(input);
+    return input;
+}
+
+void twh_input_update_key(twh_input_state_t *input, TWH_KEY_CODE key, int pressed)
+{
+    uint64_t bit = (uint64_t)1 << (key % WORD_BITS);
+    int word = key / WORD_BITS;
+
+    assert(key >= 0 && key < TWH_KEY_NUM);
+    sync_poll(input);
+    if (pressed)
+    {
+        /* auto repeat presses a key that is already down */
+        if (!(input->keys_down[word] & bit))
+        {
+            input->keys_pressed[word] |= bit;
+        }
+        input->keys_down[word] |= bit;
+    }
+    else if (input->keys_down[word] & bit)
+    {
+        input->keys_released[word] |= bit;
+        input->keys_down[word] &= ~bit;
+    }
+}
+
+void twh_input_update_button(twh_input_state_t *input, TWH_MOUSE_BUTTON mb, int pressed)
+{
+    uint32_t bit = (uint32_t)1 << mb;
+
+    assert(mb >= 0 && mb < TWH_MOUSE_BUTTON_NUM);
+    sync_poll(input);
+    if (pressed)
+    {
+        if (!(input->buttons_down & bit))
+        {
+            input->buttons_pressed |= bit;
+        }
+        input->buttons_down |= bit;
+    }
+    else if (input->buttons_down & bit)
+    {
+        input->buttons_released |= bit;
+        input->buttons_down &= ~bit;
+    }
+}
+
+/* the window lost focus, its releases will go elsewhere */
+void twh_input_release_all(twh_input_state_t *input)
+{
+    int i;
+
+    sync_poll(input);
+    for (i = 0; i < TWH_KEY_WORDS; i++)
+    {
+        input->keys_released[i] |= input->keys_down[i];
+        input->keys_down[i] = 0;
+    }
+    input->buttons_released |= input->buttons_down;
+    input->buttons_down = 0;
+}
+
+/* private functions */
+
+static void sync_poll(twh_input_state_t *input)
+{
+    if (input->poll != g_input_poll)
+    {
+        memset(input->keys_pressed, 0, sizeof(input->keys_pressed));
+        memset(input->keys_released, 0, sizeof(input->keys_released));
+        input->buttons_pressed = 0;
+        input->buttons_released = 0;
+        input->poll = g_input_poll;
+    }
+}
+
+static int test_bit(const uint64_t *bits, int index)
+{
+    return (bits[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+}
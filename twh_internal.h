@@ -0,0 +1,81 @@
+#ifndef TWH_INTERNAL_H
+#define TWH_INTERNAL_H
+
+/*
+ * Declarations shared by the platform backends, not part of the public api.
+ */
+
+#include <stddef.h>
+
+#include "twh.h"
+
+#define TWH_CHANNELS 4
+
+/* twh_framebuffer.c */
+void twh_framebuffer_init_window(twh_framebuffer_t *fb, twh_window_t *wnd, unsigned char *surface, int width, int height);
+int twh_framebuffer_create_images(twh_framebuffer_t **images, int count, int width, int height);
+void twh_framebuffer_release_images(twh_framebuffer_t **images, int count);
+int twh_framebuffer_take_damage(twh_framebuffer_t *fb, twh_rect_t *out_rects);
+
+/* twh_event.c, called only from the thread polling events, times are twh_stats_now seconds */
+double twh_event_time_from_ms(uint32_t ms);
+int twh_push_event(const twh_event_t *event, double time);
+
+/* twh_input.c */
+void twh_input_begin_poll(void);
+const twh_input_state_t *twh_input_current(twh_input_state_t *input);
+void twh_input_update_key(twh_input_state_t *input, TWH_KEY_CODE key, int pressed);
+void twh_input_update_button(twh_input_state_t *input, TWH_MOUSE_BUTTON mb, int pressed);
+void twh_input_release_all(twh_input_state_t *input);
+
+/* twh_memory.c */
+void twh_pixels_hint_huge_pages(int enabled);
+void *twh_pixels_alloc(size_t size);
+void twh_pixels_free(void *pixels, size_t size);
+void twh_pixels_trim(void);
+
+/* twh_stats.c, a start of 0 means stats are disabled and nothing is recorded */
+void twh_stats_enable(int enabled);
+double twh_stats_begin(void);
+void twh_stats_end(TWH_STAGE stage, double start);
+void twh_stats_count_events(unsigned int count);
+double twh_stats_now(void);
+void twh_stats_input(twh_window_t *wnd, double time);
+void twh_stats_rendered(twh_window_t *wnd);
+void twh_stats_forget(twh_window_t *wnd);
+
+/* twh_pool.c */
+typedef void (*twh_pool_job_func_t)(void *arg, int index);
+void twh_pool_create(int thread_count);
+void twh_pool_destroy(void);
+int twh_pool_thread_count(void);
+void twh_pool_run(twh_pool_job_func_t job, void *arg, int job_count);
+
+/* twh_registry.c, finds the window an event is for, a zeroed registry is empty and handle 0 is never added */
+typedef struct twh_registry
+{
+    struct twh_registry_slot *slots;
+    int capacity; /* power of two, kept at most half full */
+    int count;
+    unsigned long last_handle; /* events tend to come in runs per window */
+    twh_window_t *last_window;
+} twh_registry_t;
+void twh_registry_add(twh_registry_t *registry, unsigned long handle, twh_window_t *wnd);
+void twh_registry_remove(twh_registry_t *registry, unsigned long handle);
+twh_window_t *twh_registry_find(twh_registry_t *registry, unsigned long handle);
+void twh_registry_clear(twh_registry_t *registry);
+
+/* twh_blit.c */
+void twh_blit_init(void);
+void twh_blit_terminate(void);
+const char *twh_blit_kernel_name(void);
+const char *twh_blit_kernel_at(int index);
+int twh_blit_select_kernel(const char *name);
+int twh_blit_fit(int width, int height, int window_w, int window_h, int max_scale, int *out_x, int *out_y);
+void twh_blit_swap_row(unsigned char *dst, const unsigned char *src, int count);
+void twh_blit_bgr(const twh_framebuffer_t *fb, unsigned char *dst, int scale);
+void twh_blit_bgr_rect(const twh_framebuffer_t *fb, unsigned char *dst, int scale, const twh_rect_t *rect);
+void twh_flip_rect(twh_rect_t *rect, const twh_framebuffer_t *fb);
+void twh_scale_rect(twh_rect_t *rect, int scale);
+
+#endif /* TWH_INTERNAL_H */
@@ -3,51 +3,275 @@
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 
 #include "twh.h"
+#include "twh_internal.h"
 
-#define SURFACE_CHANNELS 4
+#define SURFACE_CHANNELS TWH_CHANNELS
+#define PACING_SPIN_TAIL 0.0005 /* seconds busy-waited after sleeping */
+#define UNUSED_PARAM(x) ((void)x)
+#define RENDER_BATCH_CHUNK 64
 
 struct twh_window
 {
     Window handle;
     XImage *ximage;
+    XShmSegmentInfo shm_info;
+    int shm_pending; /* XShmPutImage requests without completion event */
 
-    int surface_w;
+    int window_w;
+    int window_h;
+    int surface_w; /* the presented framebuffer times its scale */
     int surface_h;
+    int surface_x; /* where the surface sits in the window */
+    int surface_y;
     unsigned char *surface;
+    twh_framebuffer_t framebuffer;
+    twh_framebuffer_t *presented_fb; /* whose pixels the surface holds */
 
     int should_close;
     void *userdata;
+    float cursor_x;
+    float cursor_y;
+    twh_input_state_t input;
 
     twh_key_callback_func_t key_callback;
     twh_mouse_callback_func_t mouse_callback;
     twh_scroll_callback_func_t scroll_callback;
+    twh_motion_callback_func_t motion_callback;
+};
+
+#define SWAPCHAIN_MAX_IMAGES 3
+
+enum IMAGE_STATE
+{
+    IMAGE_FREE,
+    IMAGE_ACQUIRED,
+    IMAGE_QUEUED,
+};
+
+/*
+ * Images are acquired and presented round robin. The present thread has a
+ * display connection and surface of its own, so it never touches anything
+ * the caller's thread uses.
+ */
+struct twh_swapchain
+{
+    twh_window_t *window;
+
+    Display *display;
+    GC gc;
+    XImage *ximage;
+    XShmSegmentInfo shm_info;
+    unsigned char *surface;
+    int window_w;
+    int window_h;
+    int surface_w;
+    int surface_h;
+    int surface_x;
+    int surface_y;
+    int presented;
+    int exposed;
+    int wake_pipe[2]; /* written when the present thread has work, it sleeps on this and the display */
+
+    int image_count;
+    twh_framebuffer_t *images[SWAPCHAIN_MAX_IMAGES];
+    int states[SWAPCHAIN_MAX_IMAGES];
+    int next_acquire;
+    int next_present;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
 };
 
 static Display *g_display = NULL;
-static XContext g_context;
-static int g_key_code_table[0xffff] = {0};
+static twh_registry_t g_windows; /* by handle, for dispatching events */
+static int g_shm_available = 0;
+static int g_shm_completion = 0; /* 0 without the extension, no event has that type */
+
+/* the error handler is global, the swapchain threads attach surfaces too */
+static pthread_mutex_t g_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Display *g_shm_attaching = NULL;
+static int g_shm_error = 0;
+static int g_shm_broken = 0; /* an attach failed, the server cannot map our memory */
+static int (*g_shm_old_handler)(Display *, XErrorEvent *) = NULL;
+static unsigned char g_keycode_cache[256]; /* X keycode -> TWH_KEY_CODE */
+
+/* keysym -> TWH_KEY_CODE, sorted by keysym for the binary search in get_key_code */
+static const struct key_mapping
+{
+    unsigned short keysym;
+    unsigned char key;
+} g_key_mappings[] = {
+    {XK_space,        TWH_KEY_SPACE},
+    {XK_apostrophe,   TWH_KEY_APOSTROPHE},
+    {XK_comma,        TWH_KEY_COMMA},
+    {XK_minus,        TWH_KEY_MINUS},
+    {XK_period,       TWH_KEY_PERIOD},
+    {XK_slash,        TWH_KEY_SLASH},
+    {XK_0,            TWH_KEY_0},
+    {XK_1,            TWH_KEY_1},
+    {XK_2,            TWH_KEY_2},
+    {XK_3,            TWH_KEY_3},
+    {XK_4,            TWH_KEY_4},
+    {XK_5,            TWH_KEY_5},
+    {XK_6,            TWH_KEY_6},
+    {XK_7,            TWH_KEY_7},
+    {XK_8,            TWH_KEY_8},
+    {XK_9,            TWH_KEY_9},
+    {XK_semicolon,    TWH_KEY_SEMICOLON},
+    {XK_equal,        TWH_KEY_EQUAL},
+    {XK_bracketleft,  TWH_KEY_LEFT_BRACKET},
+    {XK_backslash,    TWH_KEY_BACKSLASH},
+    {XK_bracketright, TWH_KEY_RIGHT_BRACKET},
+    {XK_grave,        TWH_KEY_GRAVE_ACCENT},
+    {XK_a,            TWH_KEY_A},
+    {XK_b,            TWH_KEY_B},
+    {XK_c,            TWH_KEY_C},
+    {XK_d,            TWH_KEY_D},
+    {XK_e,            TWH_KEY_E},
+    {XK_f,            TWH_KEY_F},
+    {XK_g,            TWH_KEY_G},
+    {XK_h,            TWH_KEY_H},
+    {XK_i,            TWH_KEY_I},
+    {XK_j,            TWH_KEY_J},
+    {XK_k,            TWH_KEY_K},
+    {XK_l,            TWH_KEY_L},
+    {XK_m,            TWH_KEY_M},
+    {XK_n,            TWH_KEY_N},
+    {XK_o,            TWH_KEY_O},
+    {XK_p,            TWH_KEY_P},
+    {XK_q,            TWH_KEY_Q},
+    {XK_r,            TWH_KEY_R},
+    {XK_s,            TWH_KEY_S},
+    {XK_t,            TWH_KEY_T},
+    {XK_u,            TWH_KEY_U},
+    {XK_v,            TWH_KEY_V},
+    {XK_w,            TWH_KEY_W},
+    {XK_x,            TWH_KEY_X},
+    {XK_y,            TWH_KEY_Y},
+    {XK_z,            TWH_KEY_Z},
+    {XK_BackSpace,    TWH_KEY_BACKSPACE},
+    {XK_Tab,          TWH_KEY_TAB},
+    {XK_Return,       TWH_KEY_ENTER},
+    {XK_Pause,        TWH_KEY_PAUSE},
+    {XK_Scroll_Lock,  TWH_KEY_SCROLL_LOCK},
+    {XK_Escape,       TWH_KEY_ESCAPE},
+    {XK_Home,         TWH_KEY_HOME},
+    {XK_Left,         TWH_KEY_LEFT},
+    {XK_Up,           TWH_KEY_UP},
+    {XK_Right,        TWH_KEY_RIGHT},
+    {XK_Down,         TWH_KEY_DOWN},
+    {XK_Page_Up,      TWH_KEY_PAGE_UP},
+    {XK_Page_Down,    TWH_KEY_PAGE_DOWN},
+    {XK_End,          TWH_KEY_END},
+    {XK_Print,        TWH_KEY_PRINT_SCREEN},
+    {XK_Insert,       TWH_KEY_INSERT},
+    {XK_Num_Lock,     TWH_KEY_NUM_LOCK},
+    {XK_KP_Enter,     TWH_KEY_NUMPAD_ENTER},
+    {XK_KP_Multiply,  TWH_KEY_NUMPAD_MULTIPLY},
+    {XK_KP_Add,       TWH_KEY_NUMPAD_ADD},
+    {XK_KP_Subtract,  TWH_KEY_NUMPAD_SUBTRACT},
+    {XK_KP_Decimal,   TWH_KEY_NUMPAD_DECIMAL},
+    {XK_KP_Divide,    TWH_KEY_NUMPAD_DIVIDE},
+    {XK_KP_0,         TWH_KEY_NUMPAD_0},
+    {XK_KP_1,         TWH_KEY_NUMPAD_1},
+    {XK_KP_2,         TWH_KEY_NUMPAD_2},
+    {XK_KP_3,         TWH_KEY_NUMPAD_3},
+    {XK_KP_4,         TWH_KEY_NUMPAD_4},
+    {XK_KP_5,         TWH_KEY_NUMPAD_5},
+    {XK_KP_6,         TWH_KEY_NUMPAD_6},
+    {XK_KP_7,         TWH_KEY_NUMPAD_7},
+    {XK_KP_8,         TWH_KEY_NUMPAD_8},
+    {XK_KP_9,         TWH_KEY_NUMPAD_9},
+    {XK_KP_Equal,     TWH_KEY_NUMPAD_EQUAL},
+    {XK_F1,           TWH_KEY_F1},
+    {XK_F2,           TWH_KEY_F2},
+    {XK_F3,           TWH_KEY_F3},
+    {XK_F4,           TWH_KEY_F4},
+    {XK_F5,           TWH_KEY_F5},
+    {XK_F6,           TWH_KEY_F6},
+    {XK_F7,           TWH_KEY_F7},
+    {XK_F8,           TWH_KEY_F8},
+    {XK_F9,           TWH_KEY_F9},
+    {XK_F10,          TWH_KEY_F10},
+    {XK_F11,          TWH_KEY_F11},
+    {XK_F12,          TWH_KEY_F12},
+    {XK_F13,          TWH_KEY_F13},
+    {XK_F14,          TWH_KEY_F14},
+    {XK_F15,          TWH_KEY_F15},
+    {XK_F16,          TWH_KEY_F16},
+    {XK_F17,          TWH_KEY_F17},
+    {XK_F18,          TWH_KEY_F18},
+    {XK_F19,          TWH_KEY_F19},
+    {XK_F20,          TWH_KEY_F20},
+    {XK_F21,          TWH_KEY_F21},
+    {XK_F22,          TWH_KEY_F22},
+    {XK_F23,          TWH_KEY_F23},
+    {XK_F24,          TWH_KEY_F24},
+    {XK_F25,          TWH_KEY_F25},
+    {XK_Shift_L,      TWH_KEY_SHIFT},
+    {XK_Shift_R,      TWH_KEY_SHIFT},
+    {XK_Control_L,    TWH_KEY_CONTROL},
+    {XK_Control_R,    TWH_KEY_CONTROL},
+    {XK_Caps_Lock,    TWH_KEY_CAPS_LOCK},
+    {XK_Alt_L,        TWH_KEY_ALT},
+    {XK_Alt_R,        TWH_KEY_ALT},
+    {XK_Delete,       TWH_KEY_DELETE},
+};
+static double g_frame_period = 0;
+static double g_frame_start = 0;
+static double g_frame_deadline = 0;
+static double g_frame_stats_start = 0;
 
 /* declarations */
 static void open_display();
 static void close_display();
 static double get_native_time();
+static void sleep_until(double deadline);
 
 static Window create_linux_window(const char *titile, int width, int height);
-static void create_key_code_table();
-static void create_surface(int width, int height, unsigned char **out_surface, XImage **out_ximage);
-
-static void present_surface(twh_window_t *wnd);
-static void blit_bgr(unsigned char *src, int src_w, int src_h, unsigned char *dst, int dst_w, int dst_h);
-
-static TWH_KEY_CODE get_key_code(int virtual_key);
-static void handle_key_event(twh_window_t *wnd, int virtual_key, char pressed);
-static void handle_mouse_event(twh_window_t *wnd, int xbutton, char pressed);
+static void update_keycode_cache(void);
+static int create_surface(Display *display, int width, int height, unsigned char **out_surface, XImage **out_ximage, XShmSegmentInfo *out_shm_info);
+static int create_shm_surface(Display *display, int width, int height, unsigned char **out_surface, XImage **out_ximage, XShmSegmentInfo *out_shm_info);
+static void destroy_surface(Display *display, unsigned char *surface, XImage *ximage, XShmSegmentInfo *shm_info);
+static int handle_shm_error(Display *display, XErrorEvent *event);
+static Bool is_shm_completion(Display *display, XEvent *event, XPointer arg);
+static Bool is_any_shm_completion(Display *display, XEvent *event, XPointer arg);
+static void *swapchain_main(void *param);
+static void create_swapchain_surface(twh_swapchain_t *swapchain, int width, int height);
+static void present_swapchain_surface(twh_swapchain_t *swapchain, int x, int y);
+static void process_swapchain_event(twh_swapchain_t *swapchain, const XEvent *event);
+static int create_wake_pipe(int fds[2]);
+static void wake_swapchain(twh_swapchain_t *swapchain);
+static void wait_swapchain(twh_swapchain_t *swapchain);
+
+static void wait_surface(twh_window_t *wnd);
+static void take_completions(void);
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush);
+static int resize_surface(twh_window_t *wnd, int width, int height);
+static int place_surface(twh_window_t *wnd, int x, int y);
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count);
+
+static TWH_KEY_CODE get_key_code(KeySym keysym);
+static void handle_key_event(twh_window_t *wnd, int virtual_key, char pressed, Time time);
+static void handle_mouse_event(twh_window_t *wnd, int xbutton, char pressed, Time time);
+static void handle_motion_event(twh_window_t *wnd, XMotionEvent *event);
 static void handle_client_event(twh_window_t *wnd, XClientMessageEvent *event);
 static void process_event(XEvent *event);
 
@@ -56,13 +280,19 @@ static void process_event(XEvent *event);
 void twh_init(void)
 {
     assert(g_display == NULL);
+    /* the swapchain presents from a thread with its own connection */
+    XInitThreads();
     open_display();
+    update_keycode_cache();
+    twh_blit_init();
 }
 
 void twh_terminate(void)
 {
     assert(g_display != NULL);
+    twh_blit_terminate();
     close_display();
+    twh_pixels_trim();
 }
 
 float twh_get_timef(void)
@@ -75,28 +305,75 @@ float twh_get_timef(void)
     return (float)(get_native_time() - initial);
 }
 
+void twh_set_target_fps(double fps)
+{
+    g_frame_period = fps > 0 ? 1.0 / fps : 0;
+    g_frame_deadline = 0;
+}
+
+void twh_frame_begin(void)
+{
+    g_frame_start = get_native_time();
+    g_frame_stats_start = twh_stats_begin();
+}
+
+void twh_frame_end(void)
+{
+    twh_stats_end(TWH_STAGE_FRAME, g_frame_stats_start);
+    if (g_frame_period <= 0)
+    {
+        return;
+    }
+
+    /* keep a steady cadence, but don't rush frames to catch up a stall */
+    if (g_frame_deadline <= 0 || get_native_time() - g_frame_deadline > g_frame_period)
+    {
+        g_frame_deadline = g_frame_start + g_frame_period;
+    }
+    else
+    {
+        g_frame_deadline += g_frame_period;
+    }
+    sleep_until(g_frame_deadline);
+}
+
 twh_window_t *twh_window_create(const char *title, int width, int height)
 {
     twh_window_t *window = NULL;
     Window handle;
-    unsigned char *surface = NULL;
-    XImage *ximage = NULL;
 
     assert(g_display && width > 0 && height > 0);
 
     handle = create_linux_window(title, width, height);
-    create_key_code_table();
-    create_surface(width, height, &surface, &ximage);
 
     window = (twh_window_t *)malloc(sizeof(twh_window_t));
     memset(window, 0, sizeof(twh_window_t));
     window->handle = handle;
-    window->ximage = ximage;
+    /* the shared image keeps a pointer to its segment info, it must not be a copy */
+    if (!create_surface(g_display, width, height, &window->surface, &window->ximage, &window->shm_info))
+    {
+        XDestroyWindow(g_display, handle);
+        free(window);
+        return NULL;
+    }
+    window->window_w = width;
+    window->window_h = height;
     window->surface_w = width;
     window->surface_h = height;
-    window->surface = surface;
+    twh_framebuffer_init_window(&window->framebuffer, window, window->surface, width, height);
 
-    XSaveContext(g_display, handle, g_context, (XPointer)window);
+    /* the only pointer query, MotionNotify keeps the position from here on */
+    {
+        Window root, child;
+        int root_x, root_y, window_x, window_y;
+        unsigned int mask;
+        XQueryPointer(g_display, handle, &root, &child,
+                      &root_x, &root_y, &window_x, &window_y, &mask);
+        window->cursor_x = (float)window_x;
+        window->cursor_y = (float)window_y;
+    }
+
+    twh_registry_add(&g_windows, handle, window);
     XMapWindow(g_display, handle);
     XFlush(g_display);
     return window;
@@ -107,16 +384,14 @@ void twh_window_release(twh_window_t *wnd)
     if (wnd == NULL)
         return;
 
+    wait_surface(wnd);
+    destroy_surface(g_display, wnd->surface, wnd->ximage, &wnd->shm_info);
     XUnmapWindow(g_display, wnd->handle);
-    XDeleteContext(g_display, wnd->handle, g_context);
-
-    wnd->ximage->data = NULL;
-    XDestroyImage(wnd->ximage);
+    twh_registry_remove(&g_windows, wnd->handle);
     XDestroyWindow(g_display, wnd->handle);
     XFlush(g_display);
+    twh_stats_forget(wnd);
 
-    if (wnd->surface != NULL)
-        free(wnd->surface);
     free(wnd);
     wnd = NULL;
 }
@@ -143,14 +418,38 @@ void twh_window_close(twh_window_t *wnd)
 
 void twh_poll_events()
 {
+    double start = twh_stats_begin();
+    unsigned int count = 0;
+
+    twh_input_begin_poll();
     XPending(g_display);
     while (XQLength(g_display))
     {
         XEvent event;
         XNextEvent(g_display, &event);
         process_event(&event);
+        count++;
     }
     XFlush(g_display);
+    twh_stats_count_events(count);
+    twh_stats_end(TWH_STAGE_EVENTS, start);
+}
+
+void twh_wait_events(double timeout)
+{
+    /* XPending flushes our requests and reads whatever already arrived */
+    if (XPending(g_display) == 0)
+    {
+        struct pollfd fd;
+        double ms = timeout * 1000 + 0.5;
+        /* poll takes an int, a longer timeout waits as long as it can */
+        int timeout_ms = timeout < 0 ? -1 : ms < (double)INT_MAX ? (int)ms : INT_MAX;
+        fd.fd = ConnectionNumber(g_display);
+        fd.events = POLLIN;
+        fd.revents = 0;
+        poll(&fd, 1, timeout_ms);
+    }
+    twh_poll_events();
 }
 
 void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback)
@@ -168,62 +467,195 @@ void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scrol
     wnd->scroll_callback = scroll_callback;
 }
 
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback)
+{
+    wnd->motion_callback = motion_callback;
+}
+
 void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
 {
-    Window root, child;
-    int root_x, root_y, window_x, window_y;
-    unsigned int mask;
-    XQueryPointer(g_display, wnd->handle, &root, &child,
-                  &root_x, &root_y, &window_x, &window_y, &mask);
-    *xpos = (float)window_x;
-    *ypos = (float)window_y;
+    *xpos = wnd->cursor_x;
+    *ypos = wnd->cursor_y;
 }
 
-twh_framebuffer_t *twh_framebuffer_create(int width, int height)
+void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
 {
-    twh_framebuffer_t *framebuffer = (twh_framebuffer_t *)malloc(sizeof(twh_framebuffer_t));
-    framebuffer->width = width;
-    framebuffer->height = height;
-    size_t sz = width * height * sizeof(unsigned char) * SURFACE_CHANNELS;
-    framebuffer->buffer = (unsigned char *)malloc(sz);
-    memset(framebuffer->buffer, 0, sz);
-    return framebuffer;
+    if (render_surface(wnd, fb, 1))
+    {
+        twh_stats_rendered(wnd);
+    }
 }
 
-void twh_framebuffer_release(twh_framebuffer_t *fb)
+/* every upload is queued first, then one flush sends them together */
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count)
 {
-    if (fb != NULL)
+    unsigned char presented[RENDER_BATCH_CHUNK];
+    double start;
+    int base, i, n;
+
+    /* chunks only bound the bookkeeping, most batches fit in one */
+    for (base = 0; base < count; base += RENDER_BATCH_CHUNK)
     {
-        if (fb->buffer != NULL)
+        n = count - base < RENDER_BATCH_CHUNK ? count - base : RENDER_BATCH_CHUNK;
+        take_completions();
+        for (i = 0; i < n; i++)
         {
-            free(fb->buffer);
-            fb->buffer = NULL;
+            presented[i] = (unsigned char)render_surface(windows[base + i], framebuffers[base + i], 0);
+        }
+
+        start = twh_stats_begin();
+        XFlush(g_display);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+
+        for (i = 0; i < n; i++)
+        {
+            twh_window_t *wnd = windows[base + i];
+            if (framebuffers[base + i] == &wnd->framebuffer)
+            {
+                /* the caller writes the surface right after, don't race the server */
+                start = twh_stats_begin();
+                wait_surface(wnd);
+                twh_stats_end(TWH_STAGE_FLUSH, start);
+            }
+            if (presented[i])
+            {
+                twh_stats_rendered(wnd);
+            }
         }
-        free(fb);
-        fb = NULL;
     }
 }
 
-void twh_framebuffer_set_color_u8(twh_framebuffer_t *fb, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd)
 {
-    int index = (y * fb->width + x) * SURFACE_CHANNELS;
-    fb->buffer[index + 0] = r;
-    fb->buffer[index + 1] = g;
-    fb->buffer[index + 2] = b;
+    /* follow the window size, unless it is minimized */
+    if (wnd->window_w > 0 && wnd->window_h > 0 &&
+        (wnd->surface_w != wnd->window_w || wnd->surface_h != wnd->window_h))
+    {
+        resize_surface(wnd, wnd->window_w, wnd->window_h);
+    }
+    /* an Expose during the last poll may still be uploading the surface */
+    wait_surface(wnd);
+    return &wnd->framebuffer;
 }
 
-void twh_framebuffer_set_color_u32(twh_framebuffer_t *fb, int x, int y, uint32_t rgb)
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height)
 {
-    int index = (y * fb->width + x) * SURFACE_CHANNELS;
-    fb->buffer[index + 0] = (rgb >> 16) & 0xff;
-    fb->buffer[index + 1] = (rgb >> 8) & 0xff;
-    fb->buffer[index + 2] = rgb & 0xff;
+    *width = wnd->window_w;
+    *height = wnd->window_h;
 }
 
-void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd)
+{
+    return twh_input_current(&wnd->input);
+}
+
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count)
+{
+    twh_swapchain_t *swapchain;
+    int i, error;
+
+    assert(image_count >= 2 && image_count <= SWAPCHAIN_MAX_IMAGES);
+
+    swapchain = (twh_swapchain_t *)malloc(sizeof(twh_swapchain_t));
+    memset(swapchain, 0, sizeof(twh_swapchain_t));
+    swapchain->window = wnd;
+    if (!twh_framebuffer_create_images(swapchain->images, image_count, wnd->window_w, wnd->window_h))
+    {
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->image_count = image_count;
+    swapchain->display = XOpenDisplay(DisplayString(g_display));
+    if (swapchain->display == NULL || !create_wake_pipe(swapchain->wake_pipe))
+    {
+        /* out of connections or descriptors, there is no swapchain just as out of memory */
+        if (swapchain->display != NULL)
+        {
+            XCloseDisplay(swapchain->display);
+        }
+        twh_framebuffer_release_images(swapchain->images, image_count);
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->gc = XCreateGC(swapchain->display, wnd->handle, 0, NULL);
+    /* our own connection sees the resizes and exposures, the present thread handles them from there */
+    XSelectInput(swapchain->display, wnd->handle, StructureNotifyMask | ExposureMask);
+    swapchain->window_w = wnd->window_w;
+    swapchain->window_h = wnd->window_h;
+    create_swapchain_surface(swapchain, wnd->window_w, wnd->window_h);
+
+    for (i = 0; i < image_count; i++)
+    {
+        swapchain->states[i] = IMAGE_FREE;
+    }
+
+    pthread_mutex_init(&swapchain->mutex, NULL);
+    pthread_cond_init(&swapchain->cond, NULL);
+    error = pthread_create(&swapchain->thread, NULL, swapchain_main, swapchain);
+    assert(error == 0);
+    UNUSED_PARAM(error);
+    return swapchain;
+}
+
+void twh_swapchain_release(twh_swapchain_t *swapchain)
+{
+    if (swapchain == NULL)
+        return;
+
+    /* queued images are still presented before the thread quits */
+    pthread_mutex_lock(&swapchain->mutex);
+    swapchain->quit = 1;
+    pthread_mutex_unlock(&swapchain->mutex);
+    wake_swapchain(swapchain);
+    pthread_join(swapchain->thread, NULL);
+    pthread_cond_destroy(&swapchain->cond);
+    pthread_mutex_destroy(&swapchain->mutex);
+
+    twh_framebuffer_release_images(swapchain->images, swapchain->image_count);
+    destroy_surface(swapchain->display, swapchain->surface, swapchain->ximage, &swapchain->shm_info);
+    XFreeGC(swapchain->display, swapchain->gc);
+    XCloseDisplay(swapchain->display);
+    close(swapchain->wake_pipe[0]);
+    close(swapchain->wake_pipe[1]);
+    free(swapchain);
+}
+
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain)
+{
+    int index;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    index = swapchain->next_acquire;
+    while (swapchain->states[index] != IMAGE_FREE)
+    {
+        pthread_cond_wait(&swapchain->cond, &swapchain->mutex);
+    }
+    swapchain->states[index] = IMAGE_ACQUIRED;
+    swapchain->next_acquire = (index + 1) % swapchain->image_count;
+    pthread_mutex_unlock(&swapchain->mutex);
+
+    return swapchain->images[index];
+}
+
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb)
 {
-    blit_bgr(fb->buffer, fb->width, fb->height, wnd->surface, wnd->surface_w, wnd->surface_h);
-    present_surface(wnd);
+    int index;
+
+    for (index = 0; index < swapchain->image_count; index++)
+    {
+        if (swapchain->images[index] == fb)
+            break;
+    }
+    assert(index < swapchain->image_count);
+
+    /* the window surface no longer matches what is on screen, the present thread restores it now */
+    swapchain->window->presented_fb = NULL;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    assert(swapchain->states[index] == IMAGE_ACQUIRED);
+    swapchain->states[index] = IMAGE_QUEUED;
+    pthread_mutex_unlock(&swapchain->mutex);
+    wake_swapchain(swapchain);
 }
 
 /* private functions */
@@ -231,11 +663,22 @@ static void open_display()
 {
     g_display = XOpenDisplay(NULL);
     assert(g_display != NULL);
-    g_context = XUniqueContext();
+
+    /* held keys repeat as presses only, without a release in between */
+    XkbSetDetectableAutoRepeat(g_display, True, NULL);
+
+    /* MIT-SHM only works when the server can map our memory, see create_shm_surface */
+    g_shm_available = XShmQueryExtension(g_display);
+    if (g_shm_available)
+    {
+        g_shm_completion = XShmGetEventBase(g_display) + ShmCompletion;
+    }
 }
 
 static void close_display()
 {
+    twh_registry_clear(&g_windows);
+
     XCloseDisplay(g_display);
     g_display = NULL;
 }
@@ -247,6 +690,25 @@ static double get_native_time()
     return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
 }
 
+/* sleeps on the same clock as get_native_time, then spins the last bit */
+static void sleep_until(double deadline)
+{
+    double wake = deadline - PACING_SPIN_TAIL;
+    if (get_native_time() < wake)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wake;
+        ts.tv_nsec = (long)((wake - (double)ts.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+            /* interrupted by a signal, the deadline is absolute */
+        }
+    }
+    while (get_native_time() < deadline)
+    {
+    }
+}
+
 static Window create_linux_window(const char *title, int width, int height)
 {
     int screen = XDefaultScreen(g_display);
@@ -262,13 +724,11 @@ static Window create_linux_window(const char *title, int width, int height)
     handle = XCreateSimpleWindow(g_display, root, 0, 0, width, height, 0,
                                  border, background);
 
-    /* not resizable */
+    /* resizable, but never down to nothing */
     size_hints = XAllocSizeHints();
-    size_hints->flags = PMinSize | PMaxSize;
-    size_hints->min_width = width;
-    size_hints->max_width = width;
-    size_hints->min_height = height;
-    size_hints->max_height = height;
+    size_hints->flags = PMinSize;
+    size_hints->min_width = 1;
+    size_hints->min_height = 1;
     XSetWMNormalHints(g_display, handle, size_hints);
     XFree(size_hints);
 
@@ -280,7 +740,7 @@ static Window create_linux_window(const char *title, int width, int height)
     XFree(class_hint);
 
     /* event subscription */
-    mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask;
+    mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | ExposureMask | FocusChangeMask | StructureNotifyMask;
     XSelectInput(g_display, handle, mask);
     delete_window = XInternAtom(g_display, "WM_DELETE_WINDOW", True);
     XSetWMProtocols(g_display, handle, &delete_window, 1);
@@ -288,207 +748,620 @@ static Window create_linux_window(const char *title, int width, int height)
     return handle;
 }
 
-/*
- * TODO: Some key codes are not working...
- */
-static void create_key_code_table()
-{
-    /* initialize */
-    memset(g_key_code_table, TWH_KEY_NUM, 0xffff * sizeof(int));
-
-    /* Number 1 ~ 9 */
-    g_key_code_table[XK_0] = TWH_KEY_0;
-    g_key_code_table[XK_1] = TWH_KEY_1;
-    g_key_code_table[XK_2] = TWH_KEY_2;
-    g_key_code_table[XK_3] = TWH_KEY_3;
-    g_key_code_table[XK_4] = TWH_KEY_4;
-    g_key_code_table[XK_5] = TWH_KEY_5;
-    g_key_code_table[XK_6] = TWH_KEY_6;
-    g_key_code_table[XK_7] = TWH_KEY_7;
-    g_key_code_table[XK_8] = TWH_KEY_8;
-    g_key_code_table[XK_9] = TWH_KEY_9;
-
-    /* Alphabet */
-    g_key_code_table[XK_a] = TWH_KEY_A;
-    g_key_code_table[XK_b] = TWH_KEY_B;
-    g_key_code_table[XK_c] = TWH_KEY_C;
-    g_key_code_table[XK_d] = TWH_KEY_D;
-    g_key_code_table[XK_e] = TWH_KEY_E;
-    g_key_code_table[XK_f] = TWH_KEY_F;
-    g_key_code_table[XK_g] = TWH_KEY_G;
-    g_key_code_table[XK_h] = TWH_KEY_H;
-    g_key_code_table[XK_i] = TWH_KEY_I;
-    g_key_code_table[XK_j] = TWH_KEY_J;
-    g_key_code_table[XK_k] = TWH_KEY_K;
-    g_key_code_table[XK_l] = TWH_KEY_L;
-    g_key_code_table[XK_m] = TWH_KEY_M;
-    g_key_code_table[XK_n] = TWH_KEY_N;
-    g_key_code_table[XK_o] = TWH_KEY_O;
-    g_key_code_table[XK_p] = TWH_KEY_P;
-    g_key_code_table[XK_q] = TWH_KEY_Q;
-    g_key_code_table[XK_r] = TWH_KEY_R;
-    g_key_code_table[XK_s] = TWH_KEY_S;
-    g_key_code_table[XK_t] = TWH_KEY_T;
-    g_key_code_table[XK_u] = TWH_KEY_U;
-    g_key_code_table[XK_v] = TWH_KEY_V;
-    g_key_code_table[XK_w] = TWH_KEY_W;
-    g_key_code_table[XK_x] = TWH_KEY_X;
-    g_key_code_table[XK_y] = TWH_KEY_Y;
-    g_key_code_table[XK_z] = TWH_KEY_Z;
-
-    /* Num pad numbers */
-    g_key_code_table[XK_KP_0] = TWH_KEY_NUMPAD_0;
-    g_key_code_table[XK_KP_1] = TWH_KEY_NUMPAD_1;
-    g_key_code_table[XK_KP_2] = TWH_KEY_NUMPAD_2;
-    g_key_code_table[XK_KP_3] = TWH_KEY_NUMPAD_3;
-    g_key_code_table[XK_KP_4] = TWH_KEY_NUMPAD_4;
-    g_key_code_table[XK_KP_5] = TWH_KEY_NUMPAD_5;
-    g_key_code_table[XK_KP_6] = TWH_KEY_NUMPAD_6;
-    g_key_code_table[XK_KP_7] = TWH_KEY_NUMPAD_7;
-    g_key_code_table[XK_KP_8] = TWH_KEY_NUMPAD_8;
-    g_key_code_table[XK_KP_9] = TWH_KEY_NUMPAD_9;
-
-    /* F1 ~ F24 */
-    g_key_code_table[XK_F1] = TWH_KEY_F1;
-    g_key_code_table[XK_F2] = TWH_KEY_F2;
-    g_key_code_table[XK_F3] = TWH_KEY_F3;
-    g_key_code_table[XK_F4] = TWH_KEY_F4;
-    g_key_code_table[XK_F5] = TWH_KEY_F5;
-    g_key_code_table[XK_F6] = TWH_KEY_F6;
-    g_key_code_table[XK_F7] = TWH_KEY_F7;
-    g_key_code_table[XK_F8] = TWH_KEY_F8;
-    g_key_code_table[XK_F9] = TWH_KEY_F9;
-    g_key_code_table[XK_F10] = TWH_KEY_F10;
-    g_key_code_table[XK_F11] = TWH_KEY_F11;
-    g_key_code_table[XK_F12] = TWH_KEY_F12;
-    g_key_code_table[XK_F13] = TWH_KEY_F13;
-    g_key_code_table[XK_F14] = TWH_KEY_F14;
-    g_key_code_table[XK_F15] = TWH_KEY_F15;
-    g_key_code_table[XK_F16] = TWH_KEY_F16;
-    g_key_code_table[XK_F17] = TWH_KEY_F17;
-    g_key_code_table[XK_F18] = TWH_KEY_F18;
-    g_key_code_table[XK_F19] = TWH_KEY_F19;
-    g_key_code_table[XK_F20] = TWH_KEY_F20;
-    g_key_code_table[XK_F21] = TWH_KEY_F21;
-    g_key_code_table[XK_F22] = TWH_KEY_F22;
-    g_key_code_table[XK_F23] = TWH_KEY_F23;
-    g_key_code_table[XK_F24] = TWH_KEY_F24;
-
-    /* Functions */
-
-    g_key_code_table[XK_BackSpace] = TWH_KEY_BACKSPACE;
-    g_key_code_table[XK_Tab] = TWH_KEY_TAB;
-    g_key_code_table[XK_Return] = TWH_KEY_ENTER;
-    g_key_code_table[XK_Pause] = TWH_KEY_PAUSE;
-    g_key_code_table[XK_Scroll_Lock] = TWH_KEY_SCROLL_LOCK;
-    g_key_code_table[XK_Print] = TWH_KEY_PRINT_SCREEN;
-    g_key_code_table[XK_Caps_Lock] = TWH_KEY_CAPS_LOCK;
-    g_key_code_table[XK_Escape] = TWH_KEY_ESCAPE;
-    g_key_code_table[XK_space] = TWH_KEY_SPACE;
-    g_key_code_table[XK_Page_Up] = TWH_KEY_PAGE_UP;
-    g_key_code_table[XK_Page_Down] = TWH_KEY_PAGE_DOWN;
-    g_key_code_table[XK_End] = TWH_KEY_END;
-    g_key_code_table[XK_Home] = TWH_KEY_HOME;
-    g_key_code_table[XK_Insert] = TWH_KEY_INSERT;
-    g_key_code_table[XK_Delete] = TWH_KEY_DELETE;
-    g_key_code_table[XK_Up] = TWH_KEY_UP;
-    g_key_code_table[XK_Down] = TWH_KEY_DOWN;
-    g_key_code_table[XK_Left] = TWH_KEY_LEFT;
-    g_key_code_table[XK_Right] = TWH_KEY_RIGHT;
-    g_key_code_table[XK_Num_Lock] = TWH_KEY_NUM_LOCK;
-    g_key_code_table[XK_Control_L] = TWH_KEY_CONTROL; /* TODO: Not working */
-    g_key_code_table[XK_Control_R] = TWH_KEY_CONTROL;
-    g_key_code_table[XK_Shift_L] = TWH_KEY_SHIFT; /* TODO: Not working */
-    g_key_code_table[XK_Shift_R] = TWH_KEY_SHIFT;
-    g_key_code_table[XK_Alt_L] = TWH_KEY_ALT; /* TODO: Not working */
-    g_key_code_table[XK_Shift_L] = TWH_KEY_ALT;
-    g_key_code_table[XK_KP_Add] = TWH_KEY_NUMPAD_ADD;
-    g_key_code_table[XK_KP_Subtract] = TWH_KEY_NUMPAD_SUBTRACT;
-    g_key_code_table[XK_KP_Multiply] = TWH_KEY_NUMPAD_MULTIPLY;
-    g_key_code_table[XK_KP_Divide] = TWH_KEY_NUMPAD_DIVIDE;
-    g_key_code_table[XK_KP_Decimal] = TWH_KEY_NUMPAD_DECIMAL;
-    g_key_code_table[XK_semicolon] = TWH_KEY_SEMICOLON;
-    g_key_code_table[XK_slash] = TWH_KEY_SLASH;
-    g_key_code_table[XK_grave] = TWH_KEY_GRAVE_ACCENT;
-    g_key_code_table[XK_braceleft] = TWH_KEY_LEFT_BRACKET;
-    g_key_code_table[XK_backslash] = TWH_KEY_BACKSLASH;
-    g_key_code_table[XK_braceright] = TWH_KEY_RIGHT_BRACKET;
-    g_key_code_table[XK_apostrophe] = TWH_KEY_APOSTROPHE;
-    g_key_code_table[XK_comma] = TWH_KEY_COMMA;
-    g_key_code_table[XK_minus] = TWH_KEY_MINUS;
-    g_key_code_table[XK_period] = TWH_KEY_PERIOD;
-    g_key_code_table[XK_equal] = TWH_KEY_EQUAL;
-}
-
-static void create_surface(int width, int height, unsigned char **out_surface, XImage **out_ximage)
+/* returns 0 with no surface when out of memory */
+static int create_surface(Display *display, int width, int height, unsigned char **out_surface, XImage **out_ximage, XShmSegmentInfo *out_shm_info)
 {
-    int screen = XDefaultScreen(g_display);
-    int depth = XDefaultDepth(g_display, screen);
-    Visual *visual = XDefaultVisual(g_display, screen);
+    int screen = XDefaultScreen(display);
+    int depth = XDefaultDepth(display, screen);
+    Visual *visual = XDefaultVisual(display, screen);
     XImage *ximage;
 
     assert(depth == 24 || depth == 32);
-    unsigned char *surface = (unsigned char *)malloc(width * height * SURFACE_CHANNELS);
-    ximage = XCreateImage(g_display, visual, depth, ZPixmap, 0,
+    memset(out_shm_info, 0, sizeof(XShmSegmentInfo));
+    out_shm_info->shmid = -1;
+    *out_surface = NULL;
+    *out_ximage = NULL;
+    if (g_shm_available && create_shm_surface(display, width, height, out_surface, out_ximage, out_shm_info))
+    {
+        return 1;
+    }
+
+    /* fallback: the image is copied through the socket on every present */
+    unsigned char *surface = (unsigned char *)twh_pixels_alloc((size_t)width * height * SURFACE_CHANNELS);
+    if (surface == NULL)
+    {
+        return 0;
+    }
+    ximage = XCreateImage(display, visual, depth, ZPixmap, 0,
                           (char *)surface, width, height, 32, 0);
+    if (ximage == NULL)
+    {
+        twh_pixels_free(surface, (size_t)width * height * SURFACE_CHANNELS);
+        return 0;
+    }
 
     *out_surface = surface;
     *out_ximage = ximage;
+    return 1;
 }
 
-static void present_surface(twh_window_t *wnd)
+static int create_shm_surface(Display *display, int width, int height, unsigned char **out_surface, XImage **out_ximage, XShmSegmentInfo *out_shm_info)
 {
-    int screen = XDefaultScreen(g_display);
-    GC gc = XDefaultGC(g_display, screen);
-    XPutImage(g_display, wnd->handle, gc, wnd->ximage,
-              0, 0, 0, 0, wnd->surface_w, wnd->surface_h);
-    XFlush(g_display);
+    int screen = XDefaultScreen(display);
+    int depth = XDefaultDepth(display, screen);
+    Visual *visual = XDefaultVisual(display, screen);
+    XImage *ximage;
+    int broken;
+
+    pthread_mutex_lock(&g_shm_mutex);
+    broken = g_shm_broken;
+    pthread_mutex_unlock(&g_shm_mutex);
+    if (broken)
+    {
+        return 0;
+    }
+
+    ximage = XShmCreateImage(display, visual, depth, ZPixmap, NULL,
+                             out_shm_info, width, height);
+    if (ximage == NULL)
+    {
+        return 0;
+    }
+    assert(ximage->bytes_per_line == width * SURFACE_CHANNELS);
+
+    out_shm_info->shmid = shmget(IPC_PRIVATE, (size_t)ximage->bytes_per_line * height, IPC_CREAT | 0600);
+    if (out_shm_info->shmid < 0)
+    {
+        XDestroyImage(ximage);
+        return 0;
+    }
+    out_shm_info->shmaddr = (char *)shmat(out_shm_info->shmid, NULL, 0);
+    out_shm_info->readOnly = False;
+    if (out_shm_info->shmaddr == (char *)-1)
+    {
+        shmctl(out_shm_info->shmid, IPC_RMID, NULL);
+        out_shm_info->shmid = -1;
+        XDestroyImage(ximage);
+        return 0;
+    }
+    ximage->data = out_shm_info->shmaddr;
+
+    /* attaching fails on remote displays even if the extension is reported */
+    pthread_mutex_lock(&g_shm_mutex);
+    g_shm_attaching = display;
+    g_shm_error = 0;
+    g_shm_old_handler = XSetErrorHandler(handle_shm_error);
+    XShmAttach(display, out_shm_info);
+    XSync(display, False);
+    XSetErrorHandler(g_shm_old_handler);
+    g_shm_attaching = NULL;
+    broken = g_shm_error;
+    g_shm_broken |= broken;
+    pthread_mutex_unlock(&g_shm_mutex);
+
+    /* the segment goes away once both the server and we have detached */
+    shmctl(out_shm_info->shmid, IPC_RMID, NULL);
+    if (broken)
+    {
+        shmdt(out_shm_info->shmaddr);
+        out_shm_info->shmid = -1;
+        ximage->data = NULL;
+        XDestroyImage(ximage);
+        return 0;
+    }
+
+    *out_surface = (unsigned char *)out_shm_info->shmaddr;
+    *out_ximage = ximage;
+    return 1;
+}
+
+static void destroy_surface(Display *display, unsigned char *surface, XImage *ximage, XShmSegmentInfo *shm_info)
+{
+    size_t size;
+
+    if (ximage == NULL)
+    {
+        return;
+    }
+    size = (size_t)ximage->bytes_per_line * ximage->height;
+    ximage->data = NULL;
+    XDestroyImage(ximage);
+
+    if (shm_info->shmid >= 0)
+    {
+        XShmDetach(display, shm_info);
+        XSync(display, False);
+        shmdt(shm_info->shmaddr);
+    }
+    else if (surface != NULL)
+    {
+        twh_pixels_free(surface, size);
+    }
+}
+
+/* called with g_shm_mutex held, errors of the other threads' displays are not ours */
+static int handle_shm_error(Display *display, XErrorEvent *event)
+{
+    if (display != g_shm_attaching)
+    {
+        return g_shm_old_handler(display, event);
+    }
+    g_shm_error = 1;
+    return 0;
+}
+
+static Bool is_shm_completion(Display *display, XEvent *event, XPointer arg)
+{
+    Window *handle = (Window *)arg;
+    UNUSED_PARAM(display);
+    return event->type == g_shm_completion && event->xany.window == *handle;
+}
+
+static Bool is_any_shm_completion(Display *display, XEvent *event, XPointer arg)
+{
+    UNUSED_PARAM(display);
+    UNUSED_PARAM(arg);
+    return event->type == g_shm_completion;
+}
+
+static void *swapchain_main(void *param)
+{
+    twh_swapchain_t *swapchain = (twh_swapchain_t *)param;
+    twh_window_t *wnd = swapchain->window;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    for (;;)
+    {
+        int index = swapchain->next_present;
+        twh_framebuffer_t *fb = swapchain->images[index];
+        twh_rect_t rects[TWH_DAMAGE_RECTS];
+        int scale, x, y;
+        double start;
+        XEvent event;
+
+        while (!swapchain->quit && swapchain->states[index] != IMAGE_QUEUED)
+        {
+            pthread_mutex_unlock(&swapchain->mutex);
+            wait_swapchain(swapchain);
+            pthread_mutex_lock(&swapchain->mutex);
+        }
+        if (swapchain->states[index] != IMAGE_QUEUED)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&swapchain->mutex);
+
+        /* only this thread reads the display, nothing else needs to be kept */
+        while (XPending(swapchain->display))
+        {
+            XNextEvent(swapchain->display, &event);
+            process_swapchain_event(swapchain, &event);
+        }
+        scale = twh_blit_fit(fb->width, fb->height, swapchain->window_w, swapchain->window_h, INT_MAX, &x, &y);
+        if (fb->width * scale != swapchain->surface_w || fb->height * scale != swapchain->surface_h)
+        {
+            destroy_surface(swapchain->display, swapchain->surface, swapchain->ximage, &swapchain->shm_info);
+            create_swapchain_surface(swapchain, fb->width * scale, fb->height * scale);
+        }
+        if (x != swapchain->surface_x || y != swapchain->surface_y)
+        {
+            XClearWindow(swapchain->display, wnd->handle);
+            swapchain->surface_x = x;
+            swapchain->surface_y = y;
+        }
+
+        /* the surface held another image, damage is of no use here */
+        twh_framebuffer_take_damage(fb, rects);
+        if (swapchain->ximage != NULL)
+        {
+            start = twh_stats_begin();
+            twh_blit_bgr(fb, swapchain->surface, scale);
+            twh_stats_end(TWH_STAGE_BLIT, start);
+            /* the whole surface goes out, that covers any exposure so far */
+            swapchain->exposed = 0;
+            present_swapchain_surface(swapchain, x, y);
+            swapchain->presented = 1;
+            twh_stats_rendered(wnd);
+        }
+
+        pthread_mutex_lock(&swapchain->mutex);
+        swapchain->states[index] = IMAGE_FREE;
+        swapchain->next_present = (index + 1) % swapchain->image_count;
+        pthread_cond_broadcast(&swapchain->cond);
+    }
+    pthread_mutex_unlock(&swapchain->mutex);
+    return NULL;
+}
+
+/* out of memory the swapchain is left without a surface, images are dropped until one fits */
+static void create_swapchain_surface(twh_swapchain_t *swapchain, int width, int height)
+{
+    int created = create_surface(swapchain->display, width, height,
+                                 &swapchain->surface, &swapchain->ximage, &swapchain->shm_info);
+    swapchain->surface_w = created ? width : 0;
+    swapchain->surface_h = created ? height : 0;
+    swapchain->presented = 0;
+}
+
+static void present_swapchain_surface(twh_swapchain_t *swapchain, int x, int y)
+{
+    Window handle = swapchain->window->handle;
+    double start = twh_stats_begin();
+    XEvent event;
+
+    if (swapchain->shm_info.shmid >= 0)
+    {
+        XShmPutImage(swapchain->display, handle, swapchain->gc, swapchain->ximage, 0, 0,
+                     x, y, swapchain->surface_w, swapchain->surface_h, True);
+        XFlush(swapchain->display);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+        start = twh_stats_begin();
+        do
+        {
+            XNextEvent(swapchain->display, &event);
+            process_swapchain_event(swapchain, &event);
+        } while (!is_shm_completion(swapchain->display, &event, (XPointer)&handle));
+        twh_stats_end(TWH_STAGE_FLUSH, start);
+    }
+    else
+    {
+        XPutImage(swapchain->display, handle, swapchain->gc, swapchain->ximage, 0, 0,
+                  x, y, swapchain->surface_w, swapchain->surface_h);
+        XFlush(swapchain->display);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+    }
+}
+
+/* an exposure is only noted, the surface may be in use by the put that is waited for */
+static void process_swapchain_event(twh_swapchain_t *swapchain, const XEvent *event)
+{
+    if (event->type == ConfigureNotify)
+    {
+        swapchain->window_w = event->xconfigure.width;
+        swapchain->window_h = event->xconfigure.height;
+    }
+    else if (event->type == Expose && event->xexpose.count == 0)
+    {
+        swapchain->exposed = 1;
+    }
+}
+
+static int create_wake_pipe(int fds[2])
+{
+    int i;
+
+    if (pipe(fds) != 0)
+    {
+        return 0;
+    }
+    /* a full pipe already wakes the thread, a write never needs to block */
+    for (i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 1;
+}
+
+static void wake_swapchain(twh_swapchain_t *swapchain)
+{
+    char byte = 0;
+    ssize_t written;
+
+    do
+    {
+        written = write(swapchain->wake_pipe[1], &byte, 1);
+    } while (written < 0 && errno == EINTR);
+}
+
+/*
+ * Sleeps until the swapchain is woken or the window system sends events,
+ * then restores the window if it was exposed while no image was queued.
+ */
+static void wait_swapchain(twh_swapchain_t *swapchain)
+{
+    struct pollfd fds[2];
+    char buffer[64];
+    XEvent event;
+
+    fds[0].fd = ConnectionNumber(swapchain->display);
+    fds[0].events = POLLIN;
+    fds[1].fd = swapchain->wake_pipe[0];
+    fds[1].events = POLLIN;
+    if (!swapchain->exposed && XPending(swapchain->display) == 0)
+    {
+        poll(fds, 2, -1);
+    }
+    while (read(swapchain->wake_pipe[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+
+    while (XPending(swapchain->display))
+    {
+        XNextEvent(swapchain->display, &event);
+        process_swapchain_event(swapchain, &event);
+    }
+    if (swapchain->exposed && swapchain->presented)
+    {
+        swapchain->exposed = 0;
+        present_swapchain_surface(swapchain, swapchain->surface_x, swapchain->surface_y);
+    }
+}
+
+/*
+ * Converts and queues the uploads of one render, returns 0 when there was
+ * nothing to present. Unless `flush` is set, the caller flushes and waits,
+ * and a surface the server still reads is skipped rather than waited for.
+ */
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush)
+{
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count, i, scale, x, y, moved;
+    double start;
+
+    /* waiting would flush in the middle of the batch, the damage is kept for the next one */
+    if (!flush && wnd->shm_pending > 0)
+    {
+        return 0;
+    }
+
+    count = twh_framebuffer_take_damage(fb, rects);
+
+    if (fb == &wnd->framebuffer)
+    {
+        if (wnd->ximage == NULL)
+        {
+            return 0;
+        }
+        twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, 1, &x, &y);
+        if (place_surface(wnd, x, y))
+        {
+            rects[0].x = 0;
+            rects[0].y = 0;
+            rects[0].w = fb->width;
+            rects[0].h = fb->height;
+            count = 1;
+        }
+
+        wnd->presented_fb = fb;
+        start = twh_stats_begin();
+        present_surface(wnd, rects, count);
+        if (flush)
+        {
+            XFlush(g_display);
+        }
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+        if (flush)
+        {
+            /* the caller writes the surface right after, don't race the server */
+            start = twh_stats_begin();
+            wait_surface(wnd);
+            twh_stats_end(TWH_STAGE_FLUSH, start);
+        }
+        return count > 0;
+    }
+
+    scale = twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, INT_MAX, &x, &y);
+    if ((fb->width * scale != wnd->surface_w || fb->height * scale != wnd->surface_h) &&
+        !resize_surface(wnd, fb->width * scale, fb->height * scale))
+    {
+        return 0;
+    }
+    moved = place_surface(wnd, x, y);
+
+    if (fb != wnd->presented_fb || moved)
+    {
+        /* the surface holds another framebuffer's pixels */
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].w = fb->width;
+        rects[0].h = fb->height;
+        count = 1;
+        wnd->presented_fb = fb;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    start = twh_stats_begin();
+    wait_surface(wnd);
+    twh_stats_end(TWH_STAGE_FLUSH, start);
+
+    start = twh_stats_begin();
+    for (i = 0; i < count; i++)
+    {
+        twh_blit_bgr_rect(fb, wnd->surface, scale, &rects[i]);
+        twh_flip_rect(&rects[i], fb);
+        twh_scale_rect(&rects[i], scale);
+    }
+    twh_stats_end(TWH_STAGE_BLIT, start);
+
+    start = twh_stats_begin();
+    present_surface(wnd, rects, count);
+    if (flush)
+    {
+        XFlush(g_display);
+    }
+    twh_stats_end(TWH_STAGE_PRESENT, start);
+    return 1;
+}
+
+/*
+ * The old surface goes away, so does whatever the window framebuffer held.
+ * Out of memory the window is left without a surface, 0 x 0 until a later
+ * resize succeeds, and returns 0.
+ */
+static int resize_surface(twh_window_t *wnd, int width, int height)
+{
+    int created;
+
+    wait_surface(wnd);
+    destroy_surface(g_display, wnd->surface, wnd->ximage, &wnd->shm_info);
+    created = create_surface(g_display, width, height, &wnd->surface, &wnd->ximage, &wnd->shm_info);
+    wnd->surface_w = created ? width : 0;
+    wnd->surface_h = created ? height : 0;
+    twh_framebuffer_init_window(&wnd->framebuffer, wnd, wnd->surface, wnd->surface_w, wnd->surface_h);
+    wnd->presented_fb = NULL;
+    return created;
+}
+
+/* returns 1 when the surface moved, the window is cleared and needs a full present */
+static int place_surface(twh_window_t *wnd, int x, int y)
+{
+    if (x == wnd->surface_x && y == wnd->surface_y)
+    {
+        return 0;
+    }
+    /* the server paints the letterbox bars with the window background */
+    XClearWindow(g_display, wnd->handle);
+    wnd->surface_x = x;
+    wnd->surface_y = y;
+    return 1;
+}
+
+/*
+ * The server reads a shared surface asynchronously, it must not be written
+ * again before the completion event of the last XShmPutImage arrived.
+ */
+static void wait_surface(twh_window_t *wnd)
+{
+    while (wnd->shm_pending > 0)
+    {
+        XEvent event;
+        XIfEvent(g_display, &event, is_shm_completion, (XPointer)&wnd->handle);
+        wnd->shm_pending--;
+    }
+}
+
+/*
+ * Counts the completions that already arrived, for every window. A batch
+ * calls this before it queues requests, so the flush XCheckIfEvent does
+ * once no completion is left has nothing to send.
+ */
+static void take_completions(void)
+{
+    XEvent event;
+
+    if (g_shm_completion == 0)
+    {
+        return;
+    }
+    while (XCheckIfEvent(g_display, &event, is_any_shm_completion, NULL))
+    {
+        twh_window_t *window = twh_registry_find(&g_windows, event.xany.window);
+        if (window != NULL && window->shm_pending > 0)
+        {
+            window->shm_pending--;
+        }
+    }
 }
 
-static void blit_bgr(unsigned char *src, int src_w, int src_h, unsigned char *dst, int dst_w, int dst_h)
+/* `rects` are in surface coordinates, the requests wait for the next flush */
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count)
 {
-    assert(src_w == dst_w && src_h == dst_h);
+    int screen = XDefaultScreen(g_display);
+    GC gc = XDefaultGC(g_display, screen);
+    int i;
 
-    int r, c;
-    int width = dst_w;
-    int height = dst_h;
+    /* without a surface there is nothing to show, see resize_surface */
+    if (count == 0 || wnd->ximage == NULL)
+    {
+        return;
+    }
 
-    for (r = 0; r < height; r++)
+    for (i = 0; i < count; i++)
     {
-        for (c = 0; c < width; c++)
+        const twh_rect_t *rect = &rects[i];
+        if (wnd->shm_info.shmid >= 0)
+        {
+            /* requests run in order, only the last one needs to report back */
+            Bool send_event = i == count - 1;
+            XShmPutImage(g_display, wnd->handle, gc, wnd->ximage, rect->x, rect->y,
+                         wnd->surface_x + rect->x, wnd->surface_y + rect->y, rect->w, rect->h, send_event);
+        }
+        else
         {
-            int flipped_r = height - 1 - r;
-            int src_index = (r * width + c) * SURFACE_CHANNELS;
-            int dst_index = (flipped_r * width + c) * SURFACE_CHANNELS;
-            unsigned char *src_pixel = &src[src_index];
-            unsigned char *dst_pixel = &dst[dst_index];
-            dst_pixel[0] = src_pixel[2]; /* blue */
-            dst_pixel[1] = src_pixel[1]; /* green */
-            dst_pixel[2] = src_pixel[0]; /* red */
+            XPutImage(g_display, wnd->handle, gc, wnd->ximage, rect->x, rect->y,
+                      wnd->surface_x + rect->x, wnd->surface_y + rect->y, rect->w, rect->h);
         }
     }
+    if (wnd->shm_info.shmid >= 0)
+    {
+        wnd->shm_pending++;
+    }
 }
 
-static TWH_KEY_CODE get_key_code(int virtual_key)
+static TWH_KEY_CODE get_key_code(KeySym keysym)
 {
-    return g_key_code_table[virtual_key];
+    int low = 0;
+    int high = (int)(sizeof(g_key_mappings) / sizeof(g_key_mappings[0])) - 1;
+
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (g_key_mappings[middle].keysym < keysym)
+            low = middle + 1;
+        else if (g_key_mappings[middle].keysym > keysym)
+            high = middle - 1;
+        else
+            return (TWH_KEY_CODE)g_key_mappings[middle].key;
+    }
+    return TWH_KEY_NUM;
 }
 
-static void handle_key_event(twh_window_t *wnd, int virtual_key, char pressed)
+/*
+ * Key events carry keycodes, translate all of them up front with a single
+ * XGetKeyboardMapping instead of one round trip per key event.
+ */
+static void update_keycode_cache(void)
 {
+    int min_keycode, max_keycode, keysyms_per_keycode;
     KeySym *keysyms;
-    KeySym keysym;
-    TWH_KEY_CODE key;
-    int dummy;
+    int keycode;
+
+    memset(g_keycode_cache, TWH_KEY_NUM, sizeof(g_keycode_cache));
 
-    keysyms = XGetKeyboardMapping(g_display, virtual_key, 1, &dummy);
-    keysym = keysyms[0];
+    XDisplayKeycodes(g_display, &min_keycode, &max_keycode);
+    keysyms = XGetKeyboardMapping(g_display, min_keycode, max_keycode - min_keycode + 1,
+                                  &keysyms_per_keycode);
+    if (keysyms == NULL)
+    {
+        return;
+    }
+    for (keycode = min_keycode; keycode <= max_keycode; keycode++)
+    {
+        /* the first keysym the table knows, e.g. KP_7 behind KP_Home */
+        int level;
+        for (level = 0; level < keysyms_per_keycode; level++)
+        {
+            KeySym keysym = keysyms[(keycode - min_keycode) * keysyms_per_keycode + level];
+            TWH_KEY_CODE key = get_key_code(keysym);
+            if (key < TWH_KEY_NUM)
+            {
+                g_keycode_cache[keycode] = (unsigned char)key;
+                break;
+            }
+        }
+    }
     XFree(keysyms);
+}
 
-    key = get_key_code(keysym);
+static void handle_key_event(twh_window_t *wnd, int virtual_key, char pressed, Time time)
+{
+    TWH_KEY_CODE key = (TWH_KEY_CODE)g_keycode_cache[virtual_key & 0xff];
 
     if (key < TWH_KEY_NUM)
     {
+        twh_event_t event;
+        twh_input_update_key(&wnd->input, key, pressed);
+
+        event.type = TWH_EVENT_KEY;
+        event.window = wnd;
+        event.key.code = key;
+        event.key.pressed = pressed;
+        twh_push_event(&event, twh_event_time_from_ms((uint32_t)time));
+
         if (wnd->key_callback)
         {
             wnd->key_callback(wnd, key, pressed);
@@ -496,12 +1369,12 @@ static void handle_key_event(twh_window_t *wnd, int virtual_key, char pressed)
     }
 }
 
-static void handle_mouse_event(twh_window_t *wnd, int xbutton, char pressed)
+static void handle_mouse_event(twh_window_t *wnd, int xbutton, char pressed, Time time)
 {
     /* mouse button */
     if (xbutton == Button1 || xbutton == Button2 || xbutton == Button3)
     {
-        TWH_MOUSE_BUTTON button;
+        TWH_MOUSE_BUTTON button = TWH_MOUSE_BUTTON_NUM;
         switch (xbutton)
         {
         case Button1:
@@ -517,22 +1390,78 @@ static void handle_mouse_event(twh_window_t *wnd, int xbutton, char pressed)
             break;
         }
 
-        if (button < TWH_MOUSE_BUTTON_NUM && wnd->mouse_callback)
+        if (button < TWH_MOUSE_BUTTON_NUM)
         {
-            wnd->mouse_callback(wnd, button, pressed);
+            twh_event_t event;
+            twh_input_update_button(&wnd->input, button, pressed);
+
+            event.type = TWH_EVENT_MOUSE_BUTTON;
+            event.window = wnd;
+            event.mouse.button = button;
+            event.mouse.pressed = pressed;
+            twh_push_event(&event, twh_event_time_from_ms((uint32_t)time));
+
+            if (wnd->mouse_callback)
+            {
+                wnd->mouse_callback(wnd, button, pressed);
+            }
         }
     }
     /* mouse wheel */
     else if (xbutton == Button4 || xbutton == Button5)
     {
+        float offset = xbutton == Button4 ? 1 : -1;
+
+        twh_event_t event;
+        event.type = TWH_EVENT_SCROLL;
+        event.window = wnd;
+        event.scroll.offset = offset;
+        twh_push_event(&event, twh_event_time_from_ms((uint32_t)time));
+
         if (wnd->scroll_callback)
         {
-            float offset = xbutton == Button4 ? 1 : -1;
             wnd->scroll_callback(wnd, offset);
         }
     }
 }
 
+static void handle_motion_event(twh_window_t *wnd, XMotionEvent *event)
+{
+    twh_event_t motion_event;
+    int x = event->x;
+    int y = event->y;
+    Time time = event->time;
+    XEvent next;
+
+    /* only the last of a run of queued motions is reported */
+    while (XQLength(g_display) > 0)
+    {
+        XPeekEvent(g_display, &next);
+        if (next.type != MotionNotify || next.xmotion.window != event->window)
+        {
+            break;
+        }
+        XNextEvent(g_display, &next);
+        x = next.xmotion.x;
+        y = next.xmotion.y;
+        time = next.xmotion.time;
+    }
+
+    wnd->cursor_x = (float)x;
+    wnd->cursor_y = (float)y;
+
+    motion_event.type = TWH_EVENT_MOTION;
+    motion_event.window = wnd;
+    motion_event.motion.x = wnd->cursor_x;
+    motion_event.motion.y = wnd->cursor_y;
+    twh_push_event(&motion_event, twh_event_time_from_ms((uint32_t)time));
+
+    if (wnd->motion_callback)
+    {
+        wnd->motion_callback(wnd, wnd->cursor_x, wnd->cursor_y);
+    }
+}
+
 static void handle_client_event(twh_window_t *wnd, XClientMessageEvent *event)
 {
     static Atom protocols = None;
@@ -549,6 +1478,11 @@ static void handle_client_event(twh_window_t *wnd, XClientMessageEvent *event)
         Atom protocol = event->data.l[0];
         if (protocol == delete_window)
         {
+            twh_event_t close_event;
+            close_event.type = TWH_EVENT_CLOSE;
+            close_event.window = wnd;
+            twh_push_event(&close_event, twh_stats_now());
+
             wnd->should_close = 1;
         }
     }
@@ -556,35 +1490,74 @@ static void handle_client_event(twh_window_t *wnd, XClientMessageEvent *event)
 
 static void process_event(XEvent *event)
 {
-    Window handle;
     twh_window_t *window;
-    int error;
 
-    handle = event->xany.window;
-    error = XFindContext(g_display, handle, g_context, (XPointer *)&window);
-    if (error != 0)
+    /* not tied to a window, the keyboard layout changed */
+    if (event->type == MappingNotify)
     {
+        XRefreshKeyboardMapping(&event->xmapping);
+        if (event->xmapping.request == MappingKeyboard)
+        {
+            update_keycode_cache();
+        }
         return;
     }
 
-    if (event->type == ClientMessage)
+    window = twh_registry_find(&g_windows, event->xany.window);
+    if (window == NULL)
+    {
+        return;
+    }
+
+    if (event->type == g_shm_completion)
+    {
+        /* counted per surface, another surface failing to attach does not matter */
+        if (window->shm_pending > 0)
+        {
+            window->shm_pending--;
+        }
+    }
+    else if (event->type == Expose)
+    {
+        /* frames are only presented where they changed, restore the rest */
+        if (event->xexpose.count == 0 && window->presented_fb != NULL)
+        {
+            twh_rect_t rect = {0, 0, window->surface_w, window->surface_h};
+            present_surface(window, &rect, 1);
+        }
+    }
+    else if (event->type == ClientMessage)
     {
         handle_client_event(window, &event->xclient);
     }
     else if (event->type == KeyPress)
     {
-        handle_key_event(window, event->xkey.keycode, 1);
+        handle_key_event(window, event->xkey.keycode, 1, event->xkey.time);
     }
     else if (event->type == KeyRelease)
     {
-        handle_key_event(window, event->xkey.keycode, 0);
+        handle_key_event(window, event->xkey.keycode, 0, event->xkey.time);
     }
     else if (event->type == ButtonPress)
     {
-        handle_mouse_event(window, event->xbutton.button, 1);
+        handle_mouse_event(window, event->xbutton.button, 1, event->xbutton.time);
     }
     else if (event->type == ButtonRelease)
     {
-        handle_mouse_event(window, event->xbutton.button, 0);
+        handle_mouse_event(window, event->xbutton.button, 0, event->xbutton.time);
+    }
+    else if (event->type == MotionNotify)
+    {
+        handle_motion_event(window, &event->xmotion);
+    }
+    else if (event->type == FocusOut)
+    {
+        twh_input_release_all(&window->input);
+    }
+    else if (event->type == ConfigureNotify)
+    {
+        /* the surface follows on the next render */
+        window->window_w = event->xconfigure.width;
+        window->window_h = event->xconfigure.height;
     }
 }
\ No newline at end of file
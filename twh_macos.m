@@ -169,47 +169,6 @@ void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
     *ypos = (float)(rect.size.height - 1 - point.y); // flipped vertical
 }
 
-twh_framebuffer_t *twh_framebuffer_create(int width, int height)
-{
-    twh_framebuffer_t *framebuffer = (twh_framebuffer_t *)malloc(sizeof(twh_framebuffer_t));
-    framebuffer->width = width;
-    framebuffer->height = height;
-    size_t sz = width * height * sizeof(unsigned char) * BITMAP_CHANNELS;
-    framebuffer->buffer = (unsigned char *)malloc(sz);
-    memset(framebuffer->buffer, 0, sz);
-    return framebuffer;
-}
-
-void twh_framebuffer_release(twh_framebuffer_t *fb)
-{
-    if (fb != NULL)
-    {
-        if (fb->buffer != NULL)
-        {
-            free(fb->buffer);
-            fb->buffer = NULL;
-        }
-        free(fb);
-        fb = NULL;
-    }
-}
-
-void twh_framebuffer_set_color_u8(twh_framebuffer_t *fb, int x, int y, uint8_t r, uint8_t g, uint8_t b)
-{
-    int index = (y * fb->width + x) * BITMAP_CHANNELS;
-    fb->buffer[index + 0] = r;
-    fb->buffer[index + 1] = g;
-    fb->buffer[index + 2] = b;
-}
-
-void twh_framebuffer_set_color_u32(twh_framebuffer_t *fb, int x, int y, uint32_t rgb)
-{
-    int index = (y * fb->width + x) * BITMAP_CHANNELS;
-    fb->buffer[index + 0] = (rgb >> 16) & 0xff;
-    fb->buffer[index + 1] = (rgb >> 8) & 0xff;
-    fb->buffer[index + 2] = rgb & 0xff;
-}
-
 void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
 {
     blit_rgb(fb->buffer, fb->width, fb->height, wnd->bitmap, wnd->bitmap_w, wnd->bitmap_h);
@@ -563,23 +522,17 @@ static void blit_rgb(unsigned char *src, int src_w, int src_h, unsigned char *ds
 {
     assert(src_w == dst_w && src_h == dst_h);
 
-    int r, c;
+    int r;
     int width = dst_w;
     int height = dst_h;
 
+    /* same channel order, only the rows are flipped */
     for (r = 0; r < height; r++)
     {
-        for (c = 0; c < width; c++)
-        {
-            int flipped_r = height - 1 - r;
-            int src_index = (r * width + c) * BITMAP_CHANNELS;
-            int dst_index = (flipped_r * width + c) * BITMAP_CHANNELS;
-            unsigned char *src_pixel = &src[src_index];
-            unsigned char *dst_pixel = &dst[dst_index];
-            dst_pixel[0] = src_pixel[0]; /* red */
-            dst_pixel[1] = src_pixel[1]; /* green */
-            dst_pixel[2] = src_pixel[2]; /* blue */
-        }
+        int flipped_r = height - 1 - r;
+        memcpy(&dst[flipped_r * width * SURFACE_CHANNELS],
+               &src[r * width * SURFACE_CHANNELS],
+               width * SURFACE_CHANNELS);
     }
 }
 
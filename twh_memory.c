@@ -0,0 +1,257 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS and MADV_HUGEPAGE */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "twh_internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK lock_t;
+#define LOCK_INIT SRWLOCK_INIT
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+typedef pthread_mutex_t lock_t;
+#define LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#endif
+
+#define PIXELS_ALIGNMENT 64
+#define MAPPED_MIN_SIZE (256 * 1024)     /* from here on buffers are fresh page mappings */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) /* from here on they may use transparent huge pages */
+#define POOL_SLOTS 16
+#define POOL_MAX_BYTES (128 * 1024 * 1024)
+
+/* a released buffer kept for the next allocation of the same size class */
+struct pool_slot
+{
+    void *pixels;
+    size_t size; /* size class, what was actually allocated */
+};
+
+static lock_t g_lock = LOCK_INIT;
+static struct pool_slot g_slots[POOL_SLOTS];
+static int g_slot_count = 0;
+static size_t g_pooled_bytes = 0;
+static int g_huge_pages = 1;
+
+/* declarations */
+static size_t size_class(size_t size);
+static void *allocate(size_t size);
+static void deallocate(void *pixels, size_t size);
+static void lock(void);
+static void unlock(void);
+
+/* implementations */
+
+void twh_pixels_hint_huge_pages(int enabled)
+{
+    g_huge_pages = enabled;
+}
+
+/* zeroed and PIXELS_ALIGNMENT aligned, give back with twh_pixels_free, NULL when out of memory */
+void *twh_pixels_alloc(size_t size)
+{
+    size_t class_size = size_class(size);
+    void *pixels = NULL;
+    int i;
+
+    lock();
+    for (i = 0; i < g_slot_count; i++)
+    {
+        if (g_slots[i].size == class_size)
+        {
+            pixels = g_slots[i].pixels;
+            g_pooled_bytes -= class_size;
+            g_slots[i] = g_slots[--g_slot_count];
+            break;
+        }
+    }
+    unlock();
+
+    if (pixels != NULL)
+    {
+        /* the pages are already faulted in, clearing them is cheap */
+        memset(pixels, 0, size);
+        return pixels;
+    }
+
+    pixels = allocate(class_size);
+    if (pixels == NULL)
+    {
+        /* the pool may hold what the system is missing */
+        twh_pixels_trim();
+        pixels = allocate(class_size);
+    }
+    return pixels;
+}
+
+void twh_pixels_free(void *pixels, size_t size)
+{
+    size_t class_size = size_class(size);
+
+    if (pixels == NULL)
+    {
+        return;
+    }
+
+    lock();
+    if (g_slot_count < POOL_SLOTS && g_pooled_bytes + class_size <= POOL_MAX_BYTES)
+    {
+        g_slots[g_slot_count].pixels = pixels;
+        g_slots[g_slot_count].size = class_size;
+        g_slot_count++;
+        g_pooled_bytes += class_size;
+        pixels = NULL;
+    }
+    unlock();
+
+    if (pixels != NULL)
+    {
+        deallocate(pixels, class_size);
+    }
+}
+
+/* hands the pooled buffers back to the system */
+void twh_pixels_trim(void)
+{
+    lock();
+    while (g_slot_count > 0)
+    {
+        g_slot_count--;
+        deallocate(g_slots[g_slot_count].pixels, g_slots[g_slot_count].size);
+    }
+    g_pooled_bytes = 0;
+    unlock();
+}
+
+/* private functions */
+
+/*
+ * Four classes per power of two, so buffers of a window that is being
+ * resized still find each other in the pool, wasting at most a quarter.
+ */
+static size_t size_class(size_t size)
+{
+    size_t power = PIXELS_ALIGNMENT;
+    size_t step;
+
+    while (power * 2 < size)
+    {
+        power *= 2;
+    }
+    step = power / 4 > PIXELS_ALIGNMENT ? power / 4 : PIXELS_ALIGNMENT;
+    return (size + step - 1) / step * step;
+}
+
+#ifdef _WIN32
+
+static void *allocate(size_t size)
+{
+    void *pixels;
+
+    if (size >= MAPPED_MIN_SIZE)
+    {
+        /* committed pages read as zero until first written */
+        return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    }
+    pixels = _aligned_malloc(size, PIXELS_ALIGNMENT);
+    if (pixels != NULL)
+    {
+        memset(pixels, 0, size);
+    }
+    return pixels;
+}
+
+static void deallocate(void *pixels, size_t size)
+{
+    if (size >= MAPPED_MIN_SIZE)
+    {
+        VirtualFree(pixels, 0, MEM_RELEASE);
+    }
+    else
+    {
+        _aligned_free(pixels);
+    }
+}
+
+static void lock(void)
+{
+    AcquireSRWLockExclusive(&g_lock);
+}
+
+static void unlock(void)
+{
+    ReleaseSRWLockExclusive(&g_lock);
+}
+
+#else
+
+static void *allocate(size_t size)
+{
+    void *pixels = NULL;
+
+    if (size >= MAPPED_MIN_SIZE)
+    {
+        /* anonymous pages read as zero until first written, no memset needed */
+        int huge = g_huge_pages && size >= HUGE_PAGE_SIZE;
+        size_t mapped_size = huge ? size + HUGE_PAGE_SIZE : size;
+        unsigned char *mapping = (unsigned char *)mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (!huge)
+        {
+            return mapping;
+        }
+
+        /* huge pages only back 2MB aligned ranges, trim the mapping to one */
+        size_t head = (HUGE_PAGE_SIZE - (uintptr_t)mapping % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        if (head > 0)
+        {
+            munmap(mapping, head);
+        }
+        munmap(mapping + head + size, HUGE_PAGE_SIZE - head);
+        pixels = mapping + head;
+#ifdef MADV_HUGEPAGE
+        /* only a hint, fails quietly where transparent huge pages are off */
+        madvise(pixels, size, MADV_HUGEPAGE);
+#endif
+        return pixels;
+    }
+
+    if (posix_memalign(&pixels, PIXELS_ALIGNMENT, size) != 0)
+    {
+        return NULL;
+    }
+    memset(pixels, 0, size);
+    return pixels;
+}
+
+static void deallocate(void *pixels, size_t size)
+{
+    if (size >= MAPPED_MIN_SIZE)
+    {
+        munmap(pixels, size);
+    }
+    else
+    {
+        free(pixels);
+    }
+}
+
+static void lock(void)
+{
+    pthread_mutex_lock(&g_lock);
+}
+
+static void unlock(void)
+{
+    pthread_mutex_unlock(&g_lock);
+}
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "twh_internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#else
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#endif
+
+#define POOL_MAX_THREADS 64
+
+/*
+ * A fork-join pool: twh_pool_run hands out job indices to the workers and
+ * the calling thread, and returns once every job has finished.
+ */
+struct pool
+{
+    thread_t threads[POOL_MAX_THREADS];
+    int thread_count;
+
+    mutex_t mutex;
+    cond_t work_cond;
+    cond_t done_cond;
+
+    twh_pool_job_func_t job;
+    void *arg;
+    int job_count;
+    int next_job;
+    int unfinished;
+    unsigned int generation;
+    int busy;
+    int quit;
+};
+
+static struct pool g_pool;
+static int g_pool_created = 0;
+
+/* declarations */
+static void run_jobs(unsigned int generation);
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID param);
+#else
+static void *worker_main(void *param);
+#endif
+
+static void mutex_init(mutex_t *mutex);
+static void mutex_destroy(mutex_t *mutex);
+static void mutex_lock(mutex_t *mutex);
+static void mutex_unlock(mutex_t *mutex);
+static void cond_init(cond_t *cond);
+static void cond_destroy(cond_t *cond);
+static void cond_wait(cond_t *cond, mutex_t *mutex);
+static void cond_broadcast(cond_t *cond);
+
+/* implementations */
+
+void twh_pool_create(int thread_count)
+{
+    int i;
+
+    assert(!g_pool_created);
+    if (thread_count > POOL_MAX_THREADS)
+    {
+        thread_count = POOL_MAX_THREADS;
+    }
+    if (thread_count <= 0)
+    {
+        return;
+    }
+
+    memset(&g_pool, 0, sizeof(g_pool));
+    mutex_init(&g_pool.mutex);
+    cond_init(&g_pool.work_cond);
+    cond_init(&g_pool.done_cond);
+
+    for (i = 0; i < thread_count; i++)
+    {
+#ifdef _WIN32
+        g_pool.threads[i] = CreateThread(NULL, 0, worker_main, NULL, 0, NULL);
+        assert(g_pool.threads[i] != NULL);
+#else
+        int error = pthread_create(&g_pool.threads[i], NULL, worker_main, NULL);
+        assert(error == 0);
+        (void)error;
+#endif
+    }
+    g_pool.thread_count = thread_count;
+    g_pool_created = 1;
+}
+
+void twh_pool_destroy(void)
+{
+    int i;
+
+    if (!g_pool_created)
+    {
+        return;
+    }
+
+    mutex_lock(&g_pool.mutex);
+    g_pool.quit = 1;
+    cond_broadcast(&g_pool.work_cond);
+    mutex_unlock(&g_pool.mutex);
+
+    for (i = 0; i < g_pool.thread_count; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(g_pool.threads[i], INFINITE);
+        CloseHandle(g_pool.threads[i]);
+#else
+        pthread_join(g_pool.threads[i], NULL);
+#endif
+    }
+
+    cond_destroy(&g_pool.done_cond);
+    cond_destroy(&g_pool.work_cond);
+    mutex_destroy(&g_pool.mutex);
+    g_pool_created = 0;
+}
+
+int twh_pool_thread_count(void)
+{
+    return g_pool_created ? g_pool.thread_count : 0;
+}
+
+void twh_pool_run(twh_pool_job_func_t job, void *arg, int job_count)
+{
+    unsigned int generation;
+    int i;
+
+    if (!g_pool_created || job_count <= 1)
+    {
+        for (i = 0; i < job_count; i++)
+        {
+            job(arg, i);
+        }
+        return;
+    }
+
+    mutex_lock(&g_pool.mutex);
+    if (g_pool.busy)
+    {
+        /* another thread owns the workers right now */
+        mutex_unlock(&g_pool.mutex);
+        for (i = 0; i < job_count; i++)
+        {
+            job(arg, i);
+        }
+        return;
+    }
+    g_pool.busy = 1;
+    g_pool.job = job;
+    g_pool.arg = arg;
+    g_pool.job_count = job_count;
+    g_pool.next_job = 0;
+    g_pool.unfinished = job_count;
+    generation = ++g_pool.generation;
+    cond_broadcast(&g_pool.work_cond);
+    mutex_unlock(&g_pool.mutex);
+
+    /* the caller works too instead of sleeping on the join */
+    run_jobs(generation);
+
+    mutex_lock(&g_pool.mutex);
+    while (g_pool.unfinished > 0)
+    {
+        cond_wait(&g_pool.done_cond, &g_pool.mutex);
+    }
+    g_pool.busy = 0;
+    mutex_unlock(&g_pool.mutex);
+}
+
+/* private functions */
+
+static void run_jobs(unsigned int generation)
+{
+    mutex_lock(&g_pool.mutex);
+    while (g_pool.generation == generation && g_pool.next_job < g_pool.job_count)
+    {
+        int index = g_pool.next_job++;
+        mutex_unlock(&g_pool.mutex);
+
+        g_pool.job(g_pool.arg, index);
+
+        mutex_lock(&g_pool.mutex);
+        if (--g_pool.unfinished == 0)
+        {
+            cond_broadcast(&g_pool.done_cond);
+        }
+    }
+    mutex_unlock(&g_pool.mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID param)
+#else
+static void *worker_main(void *param)
+#endif
+{
+    unsigned int seen = 0;
+    (void)param;
+
+    for (;;)
+    {
+        mutex_lock(&g_pool.mutex);
+        while (!g_pool.quit && g_pool.generation == seen)
+        {
+            cond_wait(&g_pool.work_cond, &g_pool.mutex);
+        }
+        if (g_pool.quit)
+        {
+            mutex_unlock(&g_pool.mutex);
+            break;
+        }
+        seen = g_pool.generation;
+        mutex_unlock(&g_pool.mutex);
+
+        run_jobs(seen);
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+
+static void mutex_init(mutex_t *mutex)
+{
+    InitializeCriticalSection(mutex);
+}
+
+static void mutex_destroy(mutex_t *mutex)
+{
+    DeleteCriticalSection(mutex);
+}
+
+static void mutex_lock(mutex_t *mutex)
+{
+    EnterCriticalSection(mutex);
+}
+
+static void mutex_unlock(mutex_t *mutex)
+{
+    LeaveCriticalSection(mutex);
+}
+
+static void cond_init(cond_t *cond)
+{
+    InitializeConditionVariable(cond);
+}
+
+static void cond_destroy(cond_t *cond)
+{
+    (void)cond;
+}
+
+static void cond_wait(cond_t *cond, mutex_t *mutex)
+{
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+static void cond_broadcast(cond_t *cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+#else
+
+static void mutex_init(mutex_t *mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static void mutex_destroy(mutex_t *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static void mutex_lock(mutex_t *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static void mutex_unlock(mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static void cond_init(cond_t *cond)
+{
+    pthread_cond_init(cond, NULL);
+}
+
+static void cond_destroy(cond_t *cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+static void cond_wait(cond_t *cond, mutex_t *mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+static void cond_broadcast(cond_t *cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "twh_internal.h"
+
+#define REGISTRY_SLOTS_MIN 16
+
+/*
+ * Open addressing with linear probing. Removal shifts the rest of a probe
+ * run back instead of leaving tombstones, so lookups stop at the first
+ * empty slot however many windows came and went.
+ */
+struct twh_registry_slot
+{
+    unsigned long handle; /* 0 while the slot is empty */
+    twh_window_t *window;
+};
+
+/* declarations */
+static void insert_slot(twh_registry_t *registry, unsigned long handle, twh_window_t *wnd);
+static int slot_home(unsigned long handle, int capacity);
+
+/* implementations */
+
+void twh_registry_add(twh_registry_t *registry, unsigned long handle, twh_window_t *wnd)
+{
+    int i;
+
+    assert(handle != 0 && twh_registry_find(registry, handle) == NULL);
+
+    if ((registry->count + 1) * 2 > registry->capacity)
+    {
+        struct twh_registry_slot *old_slots = registry->slots;
+        int old_capacity = registry->capacity;
+        int capacity = old_capacity ? old_capacity * 2 : REGISTRY_SLOTS_MIN;
+
+        registry->slots = (struct twh_registry_slot *)calloc(capacity, sizeof(struct twh_registry_slot));
+        assert(registry->slots != NULL);
+        registry->capacity = capacity;
+        for (i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].handle != 0)
+            {
+                insert_slot(registry, old_slots[i].handle, old_slots[i].window);
+            }
+        }
+        free(old_slots);
+    }
+
+    insert_slot(registry, handle, wnd);
+    registry->count++;
+}
+
+void twh_registry_remove(twh_registry_t *registry, unsigned long handle)
+{
+    int i, j, mask;
+
+    if (registry->count == 0)
+    {
+        return;
+    }
+    if (registry->last_handle == handle)
+    {
+        registry->last_handle = 0;
+        registry->last_window = NULL;
+    }
+
+    mask = registry->capacity - 1;
+    i = slot_home(handle, registry->capacity);
+    while (registry->slots[i].handle != handle)
+    {
+        if (registry->slots[i].handle == 0)
+        {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    registry->slots[i].handle = 0;
+    registry->count--;
+
+    /* shift the rest of the probe run back so lookups need no tombstones */
+    j = i;
+    for (;;)
+    {
+        int home;
+
+        j = (j + 1) & mask;
+        if (registry->slots[j].handle == 0)
+        {
+            break;
+        }
+        home = slot_home(registry->slots[j].handle, registry->capacity);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+        {
+            continue;
+        }
+        registry->slots[i] = registry->slots[j];
+        registry->slots[j].handle = 0;
+        i = j;
+    }
+}
+
+twh_window_t *twh_registry_find(twh_registry_t *registry, unsigned long handle)
+{
+    int i, mask;
+
+    if (handle == registry->last_handle)
+    {
+        return registry->last_window;
+    }
+    if (registry->count == 0 || handle == 0)
+    {
+        return NULL;
+    }
+
+    mask = registry->capacity - 1;
+    i = slot_home(handle, registry->capacity);
+    while (registry->slots[i].handle != handle)
+    {
+        if (registry->slots[i].handle == 0)
+        {
+            return NULL;
+        }
+        i = (i + 1) & mask;
+    }
+    registry->last_handle = handle;
+    registry->last_window = registry->slots[i].window;
+    return registry->last_window;
+}
+
+void twh_registry_clear(twh_registry_t *registry)
+{
+    free(registry->slots);
+    memset(registry, 0, sizeof(twh_registry_t));
+}
+
+/* private functions */
+
+static void insert_slot(twh_registry_t *registry, unsigned long handle, twh_window_t *wnd)
+{
+    int mask = registry->capacity - 1;
+    int i = slot_home(handle, registry->capacity);
+
+    while (registry->slots[i].handle != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    registry->slots[i].handle = handle;
+    registry->slots[i].window = wnd;
+}
+
+/* XIDs of one client share their high bits and count up, so mix them first */
+static int slot_home(unsigned long handle, int capacity)
+{
+    unsigned long long h = (unsigned long long)handle * 0x9e3779b97f4a7c15ull;
+    return (int)(h >> 32) & (capacity - 1);
+}
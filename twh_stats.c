@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "twh_internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK lock_t;
+#define LOCK_INIT SRWLOCK_INIT
+#else
+#include <time.h>
+#include <pthread.h>
+typedef pthread_mutex_t lock_t;
+#define LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#endif
+
+#define STATS_WINDOW 128 /* samples min, avg and p99 roll over */
+#define STATS_PENDING_INPUTS 256
+
+/* an input event whose window has not been rendered since */
+struct pending_input
+{
+    twh_window_t *window;
+    double time;
+};
+
+/* swapchain threads record too, every access holds the lock */
+struct stage_record
+{
+    unsigned int count;
+    double last;
+    double samples[STATS_WINDOW]; /* ring, the newest at (count - 1) % STATS_WINDOW */
+    unsigned int histogram[TWH_STATS_BUCKETS];
+};
+
+static lock_t g_lock = LOCK_INIT;
+static int g_enabled = 0;
+static struct stage_record g_stages[TWH_STAGE_NUM];
+static unsigned int g_events_last = 0;
+static unsigned int g_events_total = 0;
+static struct pending_input g_pending[STATS_PENDING_INPUTS];
+static int g_pending_count = 0;
+
+/* declarations */
+static double get_time(void);
+static void record_sample(TWH_STAGE stage, double duration);
+static void drop_pending(twh_window_t *wnd, double now);
+static int histogram_bucket(double duration);
+static int compare_samples(const void *a, const void *b);
+static void lock(void);
+static void unlock(void);
+
+/* implementations */
+
+void twh_stats_enable(int enabled)
+{
+    g_enabled = enabled;
+}
+
+double twh_stats_begin(void)
+{
+    return g_enabled ? get_time() : 0;
+}
+
+void twh_stats_end(TWH_STAGE stage, double start)
+{
+    double duration;
+
+    assert(stage >= 0 && stage < TWH_STAGE_NUM);
+    if (start == 0)
+    {
+        return;
+    }
+    duration = get_time() - start;
+
+    lock();
+    record_sample(stage, duration);
+    unlock();
+}
+
+/* the clock of event times, read even while stats are disabled */
+double twh_stats_now(void)
+{
+    return get_time();
+}
+
+/* inputs beyond STATS_PENDING_INPUTS before a render go unmeasured */
+void twh_stats_input(twh_window_t *wnd, double time)
+{
+    if (!g_enabled)
+    {
+        return;
+    }
+    lock();
+    if (g_pending_count < STATS_PENDING_INPUTS)
+    {
+        g_pending[g_pending_count].window = wnd;
+        g_pending[g_pending_count].time = time;
+        g_pending_count++;
+    }
+    unlock();
+}
+
+/* called once a render presented the window, its pending inputs are now visible */
+void twh_stats_rendered(twh_window_t *wnd)
+{
+    if (!g_enabled)
+    {
+        return;
+    }
+    lock();
+    drop_pending(wnd, get_time());
+    unlock();
+}
+
+/* the window is going away, its pending inputs will never be shown */
+void twh_stats_forget(twh_window_t *wnd)
+{
+    lock();
+    drop_pending(wnd, 0);
+    unlock();
+}
+
+void twh_stats_count_events(unsigned int count)
+{
+    if (!g_enabled)
+    {
+        return;
+    }
+    lock();
+    g_events_last = count;
+    g_events_total += count;
+    unlock();
+}
+
+void twh_get_frame_stats(twh_frame_stats_t *out_stats)
+{
+    double window[STATS_WINDOW];
+    int stage, i;
+
+    memset(out_stats, 0, sizeof(twh_frame_stats_t));
+
+    lock();
+    for (stage = 0; stage < TWH_STAGE_NUM; stage++)
+    {
+        const struct stage_record *record = &g_stages[stage];
+        twh_stage_stats_t *stats = &out_stats->stages[stage];
+        int n = record->count < STATS_WINDOW ? (int)record->count : STATS_WINDOW;
+        double total = 0;
+
+        stats->count = record->count;
+        memcpy(stats->histogram, record->histogram, sizeof(stats->histogram));
+        if (n == 0)
+        {
+            continue;
+        }
+
+        memcpy(window, record->samples, n * sizeof(double));
+        qsort(window, n, sizeof(double), compare_samples);
+        for (i = 0; i < n; i++)
+        {
+            total += window[i];
+        }
+        stats->last = (float)record->last;
+        stats->min = (float)window[0];
+        stats->avg = (float)(total / n);
+        stats->p99 = (float)window[(99 * n + 99) / 100 - 1]; /* nearest rank */
+    }
+    out_stats->events_last = g_events_last;
+    out_stats->events_total = g_events_total;
+    unlock();
+}
+
+void twh_reset_frame_stats(void)
+{
+    lock();
+    memset(g_stages, 0, sizeof(g_stages));
+    g_events_last = 0;
+    g_events_total = 0;
+    g_pending_count = 0;
+    unlock();
+}
+
+/* private functions */
+
+/* the caller holds the lock */
+static void record_sample(TWH_STAGE stage, double duration)
+{
+    struct stage_record *record = &g_stages[stage];
+
+    record->last = duration;
+    record->samples[record->count % STATS_WINDOW] = duration;
+    record->count++;
+    record->histogram[histogram_bucket(duration)]++;
+}
+
+/* removes the inputs of `wnd`, recording their latency unless `now` is 0 */
+static void drop_pending(twh_window_t *wnd, double now)
+{
+    int i, kept = 0;
+
+    for (i = 0; i < g_pending_count; i++)
+    {
+        if (g_pending[i].window != wnd)
+        {
+            g_pending[kept++] = g_pending[i];
+        }
+        else if (now != 0)
+        {
+            record_sample(TWH_STAGE_LATENCY, now - g_pending[i].time);
+        }
+    }
+    g_pending_count = kept;
+}
+
+static int histogram_bucket(double duration)
+{
+    double limit = 1e-6;
+    int bucket = 0;
+
+    while (duration >= limit && bucket < TWH_STATS_BUCKETS - 1)
+    {
+        limit *= 2;
+        bucket++;
+    }
+    return bucket;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+#ifdef _WIN32
+
+static double get_time(void)
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+static void lock(void)
+{
+    AcquireSRWLockExclusive(&g_lock);
+}
+
+static void unlock(void)
+{
+    ReleaseSRWLockExclusive(&g_lock);
+}
+
+#else
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void lock(void)
+{
+    pthread_mutex_lock(&g_lock);
+}
+
+static void unlock(void)
+{
+    pthread_mutex_unlock(&g_lock);
+}
+
+#endif
@@ -0,0 +1,811 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "twh.h"
+#include "twh_headless.h"
+#include "twh_internal.h"
+
+/*
+ * Checks of the headless backend (built with TWH_HEADLESS), run by ctest.
+ * Framebuffers are rendered and the presented pixels read back, input is
+ * injected and read through the event queue and the input state.
+ *
+ *   twh-test [group]
+ */
+
+struct test_group
+{
+    const char *name;
+    void (*run)(void);
+};
+
+static int g_failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(int ok, const char *what, const char *file, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+        g_failures++;
+    }
+}
+
+/* a color that differs for every pixel of the small framebuffers used here */
+static uint32_t test_color(int x, int y)
+{
+    return (uint32_t)((x * 0x2a + 0x10) & 0xff) << 16 | (uint32_t)((y * 0x35 + 0x20) & 0xff) << 8 |
+           (uint32_t)(((x ^ y) + 0x30) & 0xff);
+}
+
+/* the presented pixel at window coordinates (top-down) as 0xRRGGBB, black outside the surface */
+static uint32_t window_pixel(twh_window_t *wnd, int x, int y)
+{
+    twh_rect_t rect;
+    const unsigned char *surface = twh_headless_get_surface(wnd, &rect);
+    const unsigned char *p;
+
+    if (x < rect.x || y < rect.y || x >= rect.x + rect.w || y >= rect.y + rect.h)
+    {
+        return 0;
+    }
+    p = surface + ((size_t)(y - rect.y) * rect.w + (x - rect.x)) * TWH_CHANNELS;
+    return (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static void fill_test_colors(twh_framebuffer_t *fb)
+{
+    for (int y = 0; y < fb->height; y++)
+    {
+        for (int x = 0; x < fb->width; x++)
+        {
+            twh_framebuffer_set_color_u32(fb, x, y, test_color(x, y));
+        }
+    }
+}
+
+/* both layouts land upright: bottom-left rows are flipped, RGBX is swapped */
+static void test_layouts(void)
+{
+    twh_window_t *wnd = twh_window_create("twh-test", 4, 3);
+    twh_framebuffer_t *fb = twh_framebuffer_create(4, 3);
+    twh_rect_t rect;
+
+    fill_test_colors(fb);
+    twh_framebuffer_render(wnd, fb);
+    twh_headless_get_surface(wnd, &rect);
+    CHECK(rect.x == 0 && rect.y == 0 && rect.w == 4 && rect.h == 3);
+    for (int y = 0; y < 3; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            CHECK(window_pixel(wnd, x, 2 - y) == test_color(x, y));
+        }
+    }
+
+    twh_framebuffer_set_layout(fb, TWH_PIXEL_FORMAT_BGRX, TWH_ORIGIN_TOP_LEFT);
+    fill_test_colors(fb);
+    twh_framebuffer_render(wnd, fb);
+    for (int y = 0; y < 3; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            CHECK(window_pixel(wnd, x, y) == test_color(x, y));
+        }
+    }
+
+    twh_framebuffer_release(fb);
+    twh_window_release(wnd);
+}
+
+/* only damaged pixels are converted, a write through buffer shows once it is marked */
+static void test_damage(void)
+{
+    twh_window_t *wnd = twh_window_create("twh-test", 8, 8);
+    twh_framebuffer_t *fb = twh_framebuffer_create(8, 8);
+    twh_framebuffer_t *other = twh_framebuffer_create(8, 8);
+    unsigned char *hidden;
+
+    twh_framebuffer_clear(fb, 0x000000);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(window_pixel(wnd, 1, 6) == 0x000000);
+
+    /* RGBX, bottom-left: pixel (1, 1) is shown in window row 6 */
+    hidden = fb->buffer + ((size_t)1 * fb->width + 1) * TWH_CHANNELS;
+    hidden[1] = 0xff;
+    twh_framebuffer_set_color_u32(fb, 6, 6, 0xff0000);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(window_pixel(wnd, 6, 1) == 0xff0000);
+    CHECK(window_pixel(wnd, 1, 6) == 0x000000);
+
+    twh_framebuffer_mark_dirty(fb, 1, 1, 1, 1);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(window_pixel(wnd, 1, 6) == 0x00ff00);
+
+    /* switching framebuffers presents the new one in full, damaged or not */
+    twh_framebuffer_clear(other, 0x0000ff);
+    twh_framebuffer_render(wnd, other);
+    CHECK(window_pixel(wnd, 6, 1) == 0x0000ff);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(window_pixel(wnd, 6, 1) == 0xff0000);
+    CHECK(window_pixel(wnd, 0, 0) == 0x000000);
+
+    twh_framebuffer_release(other);
+    twh_framebuffer_release(fb);
+    twh_window_release(wnd);
+}
+
+/* the largest integer scale that fits, centred between black bars */
+static void test_scale(void)
+{
+    twh_window_t *wnd = twh_window_create("twh-test", 35, 20);
+    twh_framebuffer_t *fb = twh_framebuffer_create(10, 5);
+    twh_rect_t rect;
+
+    fill_test_colors(fb);
+    twh_framebuffer_render(wnd, fb);
+    twh_headless_get_surface(wnd, &rect);
+    CHECK(rect.x == 2 && rect.y == 2 && rect.w == 30 && rect.h == 15);
+    for (int y = 0; y < 5; y++)
+    {
+        for (int x = 0; x < 10; x++)
+        {
+            for (int d = 0; d < 9; d++)
+            {
+                int wx = rect.x + x * 3 + d % 3;
+                int wy = rect.y + (4 - y) * 3 + d / 3;
+                CHECK(window_pixel(wnd, wx, wy) == test_color(x, y));
+            }
+        }
+    }
+    CHECK(window_pixel(wnd, 0, 0) == 0x000000);
+    CHECK(window_pixel(wnd, 34, 19) == 0x000000);
+
+    /* a smaller window lowers the scale, damage or not */
+    twh_headless_resize(wnd, 21, 11);
+    twh_framebuffer_render(wnd, fb);
+    twh_headless_get_surface(wnd, &rect);
+    CHECK(rect.x == 0 && rect.y == 0 && rect.w == 20 && rect.h == 10);
+    CHECK(window_pixel(wnd, 19, 0) == test_color(9, 4));
+
+    twh_framebuffer_release(fb);
+    twh_window_release(wnd);
+}
+
+/* the window framebuffer is the surface itself and follows the window size */
+static void test_window_framebuffer(void)
+{
+    twh_window_t *wnd = twh_window_create("twh-test", 6, 4);
+    twh_framebuffer_t *fb = twh_window_get_framebuffer(wnd);
+    twh_rect_t rect;
+
+    CHECK(fb->width == 6 && fb->height == 4);
+    CHECK(fb->format == TWH_PIXEL_FORMAT_BGRX && fb->origin == TWH_ORIGIN_TOP_LEFT);
+    fill_test_colors(fb);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(window_pixel(wnd, 0, 0) == test_color(0, 0));
+    CHECK(window_pixel(wnd, 5, 3) == test_color(5, 3));
+
+    twh_headless_resize(wnd, 9, 7);
+    fb = twh_window_get_framebuffer(wnd);
+    CHECK(fb->width == 9 && fb->height == 7);
+    twh_framebuffer_clear(fb, 0x123456);
+    twh_framebuffer_render(wnd, fb);
+    twh_headless_get_surface(wnd, &rect);
+    CHECK(rect.x == 0 && rect.y == 0 && rect.w == 9 && rect.h == 7);
+    CHECK(window_pixel(wnd, 8, 6) == 0x123456);
+
+    twh_window_release(wnd);
+}
+
+static const TWH_PIXEL_FORMAT g_formats[] = {TWH_PIXEL_FORMAT_RGBX, TWH_PIXEL_FORMAT_BGRX};
+static const TWH_ORIGIN g_origins[] = {TWH_ORIGIN_BOTTOM_LEFT, TWH_ORIGIN_TOP_LEFT};
+
+/* the pixel at buffer coordinates as 0xRRGGBB, whatever the format */
+static uint32_t buffer_pixel(const twh_framebuffer_t *fb, int x, int y)
+{
+    const unsigned char *p = fb->buffer + ((size_t)y * fb->width + x) * TWH_CHANNELS;
+    int swap = fb->format == TWH_PIXEL_FORMAT_BGRX ? 2 : 0;
+    return (uint32_t)p[swap] << 16 | (uint32_t)p[1] << 8 | p[2 - swap];
+}
+
+/* test colors in the given layout (index into g_formats / g_origins), no damage left */
+static twh_framebuffer_t *create_drawing_fb(int width, int height, int layout)
+{
+    twh_framebuffer_t *fb = twh_framebuffer_create(width, height);
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+
+    twh_framebuffer_set_layout(fb, g_formats[layout % 2], g_origins[layout / 2]);
+    fill_test_colors(fb);
+    twh_framebuffer_take_damage(fb, rects);
+    return fb;
+}
+
+/* the same pixels in the same layout, to read from or compare against */
+static twh_framebuffer_t *copy_drawing_fb(const twh_framebuffer_t *fb)
+{
+    twh_framebuffer_t *copy = twh_framebuffer_create(fb->width, fb->height);
+
+    twh_framebuffer_set_layout(copy, fb->format, fb->origin);
+    memcpy(copy->buffer, fb->buffer, (size_t)fb->width * fb->height * TWH_CHANNELS);
+    return copy;
+}
+
+/*
+ * The pixels of `fb` match the reference written with set_color_u32, and
+ * its damage is exactly the bounds of the pixels written there.
+ */
+static void check_drawing(twh_framebuffer_t *fb, const twh_framebuffer_t *reference,
+                          int x0, int y0, int x1, int y1, const char *what)
+{
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count = twh_framebuffer_take_damage(fb, rects);
+    int differ = 0;
+
+    for (int y = 0; y < fb->height; y++)
+    {
+        for (int x = 0; x < fb->width; x++)
+        {
+            differ += buffer_pixel(fb, x, y) != buffer_pixel(reference, x, y);
+        }
+    }
+    if (x0 >= x1)
+    {
+        differ += count != 0;
+    }
+    else
+    {
+        differ += count != 1 || rects[0].x != x0 || rects[0].y != y0 ||
+                  rects[0].w != x1 - x0 || rects[0].h != y1 - y0;
+    }
+    if (differ != 0)
+    {
+        fprintf(stderr, "%s: %s %s\n", what, fb->format == TWH_PIXEL_FORMAT_BGRX ? "BGRX" : "RGBX",
+                fb->origin == TWH_ORIGIN_TOP_LEFT ? "top-left" : "bottom-left");
+        CHECK(!"drawing differs from the set_color_u32 reference");
+    }
+}
+
+/* grows the bounds x0, y0, x1, y1 by one written pixel */
+static void add_bounds(int *bounds, int x, int y)
+{
+    bounds[0] = x < bounds[0] ? x : bounds[0];
+    bounds[1] = y < bounds[1] ? y : bounds[1];
+    bounds[2] = x + 1 > bounds[2] ? x + 1 : bounds[2];
+    bounds[3] = y + 1 > bounds[3] ? y + 1 : bounds[3];
+}
+
+/* fill_rect, hspan (h = 1) and vspan (w = 1) against one set_color_u32 per pixel in bounds */
+static void check_fill(int layout, const twh_rect_t *rect, uint32_t rgb)
+{
+    twh_framebuffer_t *fb = create_drawing_fb(13, 9, layout);
+    twh_framebuffer_t *reference = copy_drawing_fb(fb);
+    int bounds[4] = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    char what[64];
+
+    for (int y = rect->y; y < rect->y + rect->h; y++)
+    {
+        for (int x = rect->x; x < rect->x + rect->w; x++)
+        {
+            if (x >= 0 && y >= 0 && x < fb->width && y < fb->height)
+            {
+                twh_framebuffer_set_color_u32(reference, x, y, rgb);
+                add_bounds(bounds, x, y);
+            }
+        }
+    }
+
+    twh_framebuffer_fill_rect(fb, rect->x, rect->y, rect->w, rect->h, rgb);
+    snprintf(what, sizeof(what), "fill_rect %d %d %d %d %06x", rect->x, rect->y, rect->w, rect->h, (unsigned)rgb);
+    check_drawing(fb, reference, bounds[0], bounds[1], bounds[2], bounds[3], what);
+    if (rect->h == 1)
+    {
+        fill_test_colors(fb);
+        twh_framebuffer_take_damage(fb, rects);
+        twh_framebuffer_hspan(fb, rect->x, rect->y, rect->w, rgb);
+        snprintf(what, sizeof(what), "hspan %d %d %d %06x", rect->x, rect->y, rect->w, (unsigned)rgb);
+        check_drawing(fb, reference, bounds[0], bounds[1], bounds[2], bounds[3], what);
+    }
+    if (rect->w == 1)
+    {
+        fill_test_colors(fb);
+        twh_framebuffer_take_damage(fb, rects);
+        twh_framebuffer_vspan(fb, rect->x, rect->y, rect->h, rgb);
+        snprintf(what, sizeof(what), "vspan %d %d %d %06x", rect->x, rect->y, rect->h, (unsigned)rgb);
+        check_drawing(fb, reference, bounds[0], bounds[1], bounds[2], bounds[3], what);
+    }
+
+    twh_framebuffer_release(reference);
+    twh_framebuffer_release(fb);
+}
+
+/*
+ * copy_rect from `src` into `dst` (which may be the same framebuffer)
+ * against one set_color_u32 per pixel, read from an untouched copy of the
+ * source. Source rows run upside down when the origins differ.
+ */
+static void check_copy(twh_framebuffer_t *dst, const twh_framebuffer_t *src,
+                       int dst_x, int dst_y, int src_x, int src_y, int w, int h)
+{
+    twh_framebuffer_t *reference = copy_drawing_fb(dst);
+    twh_framebuffer_t *source = copy_drawing_fb(src);
+    int flip = dst->origin != src->origin;
+    int bounds[4] = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+    char what[64];
+
+    for (int r = 0; r < h; r++)
+    {
+        for (int c = 0; c < w; c++)
+        {
+            int sx = src_x + c, sy = flip ? src_y + h - 1 - r : src_y + r;
+            int dx = dst_x + c, dy = dst_y + r;
+            if (sx >= 0 && sy >= 0 && sx < src->width && sy < src->height &&
+                dx >= 0 && dy >= 0 && dx < dst->width && dy < dst->height)
+            {
+                twh_framebuffer_set_color_u32(reference, dx, dy, buffer_pixel(source, sx, sy));
+                add_bounds(bounds, dx, dy);
+            }
+        }
+    }
+
+    if (src_x == 0 && src_y == 0 && w == src->width && h == src->height)
+    {
+        twh_framebuffer_blit(dst, dst_x, dst_y, src);
+    }
+    else
+    {
+        twh_framebuffer_copy_rect(dst, dst_x, dst_y, src, src_x, src_y, w, h);
+    }
+    snprintf(what, sizeof(what), "copy_rect %d %d <- %s%d %d %d %d", dst_x, dst_y, dst == src ? "self " : "",
+             src_x, src_y, w, h);
+    check_drawing(dst, reference, bounds[0], bounds[1], bounds[2], bounds[3], what);
+
+    twh_framebuffer_release(source);
+    twh_framebuffer_release(reference);
+}
+
+/*
+ * The bulk writes clip negative and oversized rects, take the memset and
+ * whole-row shortcuts, copy overlapping rows in a safe order and convert
+ * between layouts, all as if every pixel were written with set_color_u32.
+ */
+static void test_drawing(void)
+{
+    static const twh_rect_t fills[] = {
+        {2, 3, 5, 4}, {-4, -2, 7, 5}, {10, 6, 20, 20}, {-5, 2, 40, 3}, {0, 0, 13, 1}, {-5, -5, 40, 40},
+        {3, 3, 0, 4}, {3, 3, -2, 4}, {20, 1, 3, 3}, {1, -9, 3, 3},
+        {-3, 4, 8, 1}, {5, 8, 100, 1}, {0, 9, 5, 1}, {2, -1, 5, 1},
+        {4, -3, 1, 8}, {12, 2, 1, 100}, {13, 0, 1, 5}, {-1, 2, 1, 5},
+    };
+    /* black is the color whose bytes are all equal */
+    static const uint32_t colors[] = {0x000000, 0xc0ffee};
+    static const int copies[][6] = {
+        {1, 2, 3, 1, 5, 4}, {-2, -1, 0, 0, 6, 5}, {2, 3, -3, -2, 6, 6}, {9, 6, 4, 2, 10, 10},
+        {-1, 4, 2, 5, 30, 30}, {3, 3, 8, 5, 0, 3}, {20, 0, 0, 0, 3, 3}, {0, 0, 0, 0, 11, 7},
+        {3, 4, 0, 0, 11, 7}, {-4, -3, 0, 0, 11, 7}, {10, 7, 0, 0, 11, 7},
+    };
+    /* within one 13 x 9 buffer, moving down, up, sideways and by whole rows */
+    static const int overlaps[][6] = {
+        {2, 3, 1, 1, 8, 5}, {1, 1, 3, 4, 8, 5}, {3, 2, 1, 2, 8, 4}, {1, 2, 3, 2, 8, 4},
+        {-2, -3, 0, 0, 13, 9}, {0, 1, 0, 0, 13, 9}, {0, 0, 0, 2, 13, 9},
+    };
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+
+    for (int layout = 0; layout < 4; layout++)
+    {
+        for (int i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); i++)
+        {
+            for (int c = 0; c < (int)(sizeof(colors) / sizeof(colors[0])); c++)
+            {
+                check_fill(layout, &fills[i], colors[c]);
+            }
+        }
+
+        for (int src_layout = 0; src_layout < 4; src_layout++)
+        {
+            for (int i = 0; i < (int)(sizeof(copies) / sizeof(copies[0])); i++)
+            {
+                const int *p = copies[i];
+                twh_framebuffer_t *dst = create_drawing_fb(13, 9, layout);
+                twh_framebuffer_t *src = create_drawing_fb(11, 7, src_layout);
+                /* a source that differs from the destination's own test colors */
+                for (int y = 0; y < src->height; y++)
+                {
+                    for (int x = 0; x < src->width; x++)
+                    {
+                        twh_framebuffer_set_color_u32(src, x, y, test_color(x + 5, y + 3) ^ 0x808080);
+                    }
+                }
+                twh_framebuffer_take_damage(src, rects);
+                check_copy(dst, src, p[0], p[1], p[2], p[3], p[4], p[5]);
+                twh_framebuffer_release(src);
+                twh_framebuffer_release(dst);
+            }
+        }
+
+        for (int i = 0; i < (int)(sizeof(overlaps) / sizeof(overlaps[0])); i++)
+        {
+            const int *p = overlaps[i];
+            twh_framebuffer_t *fb = create_drawing_fb(13, 9, layout);
+            check_copy(fb, fb, p[0], p[1], p[2], p[3], p[4], p[5]);
+            twh_framebuffer_release(fb);
+        }
+    }
+}
+
+/* a small generator, the same sequence on every platform */
+static unsigned int next_random(unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 16;
+}
+
+/* XIDs of one client count up from a shared base, a few handles lie far from it */
+static unsigned long registry_handle(unsigned long base, int index)
+{
+    return index % 64 == 63 ? (unsigned long)(index + 1) << 20 | 0x3f : base + (unsigned long)index;
+}
+
+/*
+ * Random adds, removes and lookups of `handles` handles against a plain
+ * array. The count swings between few and many windows, so the table
+ * grows and removals shift probe runs back across collisions and the
+ * wrap-around.
+ */
+static void check_registry(unsigned long base, int handles, int steps, int phase)
+{
+    twh_window_t **expected = (twh_window_t **)calloc(handles, sizeof(twh_window_t *));
+    char *windows = (char *)malloc(handles);
+    twh_registry_t registry;
+    unsigned int state = (unsigned int)(base + handles);
+    int count = 0, wrong = 0;
+
+    memset(&registry, 0, sizeof(registry));
+    CHECK(twh_registry_find(&registry, registry_handle(base, 0)) == NULL);
+
+    for (int step = 0; step < steps; step++)
+    {
+        int i = (int)(next_random(&state) % handles);
+        /* mostly adding in even phases, mostly removing in odd ones */
+        int adding = (int)(next_random(&state) % 4) != 0 ? (step / phase) % 2 == 0 : (step / phase) % 2 != 0;
+        int j = (int)(next_random(&state) % handles);
+
+        if (adding && expected[i] == NULL)
+        {
+            twh_registry_add(&registry, registry_handle(base, i), (twh_window_t *)&windows[i]);
+            expected[i] = (twh_window_t *)&windows[i];
+            count++;
+        }
+        else if (!adding)
+        {
+            /* removing a handle that is not there is allowed and changes nothing */
+            twh_registry_remove(&registry, registry_handle(base, i));
+            count -= expected[i] != NULL;
+            expected[i] = NULL;
+            /* the last lookup is cached, it must not outlive the removal */
+            wrong += twh_registry_find(&registry, registry_handle(base, i)) != NULL;
+        }
+        wrong += twh_registry_find(&registry, registry_handle(base, j)) != expected[j];
+
+        if (step % 64 == 0 || step == steps - 1)
+        {
+            for (int k = 0; k < handles; k++)
+            {
+                wrong += twh_registry_find(&registry, registry_handle(base, k)) != expected[k];
+            }
+            wrong += registry.count != count;
+            wrong += twh_registry_find(&registry, 0) != NULL;
+            wrong += twh_registry_find(&registry, base - 1) != NULL;
+        }
+    }
+    if (wrong != 0)
+    {
+        fprintf(stderr, "registry of %d handles from %#lx: %d wrong lookups\n", handles, base, wrong);
+        CHECK(!"registry lookups differ from the reference");
+    }
+
+    twh_registry_clear(&registry);
+    CHECK(registry.count == 0 && twh_registry_find(&registry, registry_handle(base, 1)) == NULL);
+    free(windows);
+    free(expected);
+}
+
+/*
+ * A few windows keep the table small, each base hashes them to other
+ * slots until some probe runs wrap around the end. Many make it grow.
+ */
+static void test_registry(void)
+{
+    for (unsigned long base = 0x2a00001ul; base < 0x2a00001ul + 256 * 16; base += 16)
+    {
+        check_registry(base, 12, 2000, 50);
+    }
+    check_registry(0x2a00001ul, 600, 40000, 3000);
+}
+
+/* the scale x scale surface pixels of framebuffer pixel (x, y) hold it as top-down BGRX */
+static void check_scalar_pixel(const twh_framebuffer_t *fb, const unsigned char *dst, int scale, int x, int y)
+{
+    int row = fb->origin == TWH_ORIGIN_BOTTOM_LEFT ? fb->height - 1 - y : y;
+    const unsigned char *src = fb->buffer + ((size_t)y * fb->width + x) * TWH_CHANNELS;
+    int swap = fb->format != TWH_PIXEL_FORMAT_BGRX;
+
+    for (int d = 0; d < scale * scale; d++)
+    {
+        size_t sx = (size_t)x * scale + d % scale;
+        size_t sy = (size_t)row * scale + d / scale;
+        const unsigned char *p = dst + (sy * fb->width * scale + sx) * TWH_CHANNELS;
+        CHECK(p[0] == src[swap ? 2 : 0] && p[1] == src[1] && p[2] == src[swap ? 0 : 2] && p[3] == src[3]);
+    }
+}
+
+/*
+ * Every kernel this CPU runs converts every layout, odd width, scale and
+ * sub-rectangle to the same bytes as the scalar one, which is checked
+ * against the pixels themselves. Bytes outside the rectangle are compared
+ * too, no kernel may write past it.
+ */
+static void check_kernels(void)
+{
+    static const int widths[] = {1, 3, 5, 7, 9, 15, 17, 31, 33, 63, 65};
+    static const int scales[] = {1, 2, 3, 4, 5, 17};
+    static const TWH_PIXEL_FORMAT formats[] = {TWH_PIXEL_FORMAT_RGBX, TWH_PIXEL_FORMAT_BGRX};
+    static const TWH_ORIGIN origins[] = {TWH_ORIGIN_BOTTOM_LEFT, TWH_ORIGIN_TOP_LEFT};
+    const int height = 7;
+    const char *selected = twh_blit_kernel_name();
+
+    for (int wi = 0; wi < (int)(sizeof(widths) / sizeof(widths[0])); wi++)
+    {
+        int width = widths[wi];
+        twh_framebuffer_t *fb = twh_framebuffer_create(width, height);
+        twh_rect_t rects[] = {
+            {0, 0, width, height},
+            {1, 2, width - 1, 3},
+            {width / 2, 1, width - width / 2, 1},
+        };
+
+        for (size_t i = 0; i < (size_t)width * height * TWH_CHANNELS; i++)
+        {
+            fb->buffer[i] = (unsigned char)(i * 37 + i / 7);
+        }
+
+        for (int si = 0; si < (int)(sizeof(scales) / sizeof(scales[0])); si++)
+        {
+            int scale = scales[si];
+            size_t size = (size_t)width * scale * height * scale * TWH_CHANNELS;
+            unsigned char *expected = malloc(size);
+            unsigned char *actual = malloc(size);
+
+            for (int f = 0; f < 4; f++)
+            {
+                /* the layout only changes how the bytes are read, they stay as filled */
+                fb->format = formats[f % 2];
+                fb->origin = origins[f / 2];
+
+                for (int ri = 0; ri < (int)(sizeof(rects) / sizeof(rects[0])); ri++)
+                {
+                    const twh_rect_t *rect = &rects[ri];
+
+                    if (rect->w <= 0)
+                    {
+                        continue;
+                    }
+                    CHECK(twh_blit_select_kernel("scalar"));
+                    memset(expected, 0xa5, size);
+                    twh_blit_bgr_rect(fb, expected, scale, rect);
+                    for (int y = rect->y; y < rect->y + rect->h; y++)
+                    {
+                        for (int x = rect->x; x < rect->x + rect->w; x++)
+                        {
+                            check_scalar_pixel(fb, expected, scale, x, y);
+                        }
+                    }
+
+                    for (int k = 0; twh_blit_kernel_at(k) != NULL; k++)
+                    {
+                        if (!twh_blit_select_kernel(twh_blit_kernel_at(k)))
+                        {
+                            continue;
+                        }
+                        memset(actual, 0xa5, size);
+                        twh_blit_bgr_rect(fb, actual, scale, rect);
+                        if (memcmp(actual, expected, size) != 0)
+                        {
+                            fprintf(stderr, "%s: width %d, scale %d, %s %s, rect %d %d %d %d\n",
+                                    twh_blit_kernel_at(k), width, scale,
+                                    fb->format == TWH_PIXEL_FORMAT_BGRX ? "BGRX" : "RGBX",
+                                    fb->origin == TWH_ORIGIN_TOP_LEFT ? "top-left" : "bottom-left",
+                                    rect->x, rect->y, rect->w, rect->h);
+                            CHECK(!"kernel output differs from the scalar one");
+                        }
+                    }
+                }
+            }
+            free(actual);
+            free(expected);
+        }
+        twh_framebuffer_release(fb);
+    }
+    twh_blit_select_kernel(selected);
+}
+
+static void test_kernels(void)
+{
+    check_kernels();
+}
+
+/* the same with the rows split between workers, however small the blit */
+static void test_kernels_pool(void)
+{
+    twh_terminate();
+    twh_init_hint(TWH_HINT_BLIT_THREADS, 3);
+    twh_init_hint(TWH_HINT_BLIT_MIN_PIXELS, 0);
+    twh_init();
+    CHECK(twh_pool_thread_count() == 3);
+
+    check_kernels();
+
+    twh_terminate();
+    twh_init_hint(TWH_HINT_BLIT_THREADS, 0);
+    twh_init();
+}
+
+#ifndef _WIN32
+/* with the address space capped, surfaces and framebuffers that don't fit come back as NULL */
+static void test_out_of_memory(void)
+{
+    const int huge = 16384; /* 1GB of pixels */
+    struct rlimit old_limit, limit;
+    twh_window_t *wnd;
+    twh_framebuffer_t *fb;
+    twh_rect_t rect;
+
+    getrlimit(RLIMIT_AS, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = (rlim_t)512 << 20;
+    CHECK(setrlimit(RLIMIT_AS, &limit) == 0);
+
+    CHECK(twh_window_create("twh-test", huge, huge) == NULL);
+    CHECK(twh_framebuffer_create(huge, huge) == NULL);
+
+    /* a window that can't follow its size keeps working without a surface */
+    wnd = twh_window_create("twh-test", 8, 8);
+    CHECK(wnd != NULL);
+    twh_headless_resize(wnd, huge, huge);
+    CHECK(twh_swapchain_create(wnd, 2) == NULL);
+    fb = twh_window_get_framebuffer(wnd);
+    CHECK(fb->width == 0 && fb->height == 0 && fb->buffer == NULL);
+    twh_framebuffer_render(wnd, fb);
+    CHECK(twh_headless_get_surface(wnd, &rect) == NULL && rect.w == 0 && rect.h == 0);
+
+    fb = twh_framebuffer_create(huge / 2, huge / 2);
+    if (fb != NULL)
+    {
+        /* the framebuffer fits, scaled up to the window it doesn't */
+        twh_framebuffer_clear(fb, 0x123456);
+        twh_framebuffer_render(wnd, fb);
+        CHECK(twh_headless_get_surface(wnd, &rect) == NULL);
+        twh_framebuffer_release(fb);
+    }
+
+    setrlimit(RLIMIT_AS, &old_limit);
+    twh_headless_resize(wnd, 8, 8);
+    fb = twh_window_get_framebuffer(wnd);
+    CHECK(fb->width == 8 && fb->height == 8 && fb->buffer != NULL);
+    twh_window_release(wnd);
+}
+#endif
+
+static void drain_events(void)
+{
+    twh_event_t event;
+    while (twh_next_event(&event))
+    {
+    }
+}
+
+/* injected input reaches the event queue, the input state and the cursor */
+static void test_input(void)
+{
+    twh_window_t *wnd = twh_window_create("twh-test", 16, 16);
+    const twh_input_state_t *input;
+    twh_event_t event;
+    float x, y;
+
+    drain_events();
+    CHECK(twh_headless_inject_key(wnd, TWH_KEY_A, 1));
+    CHECK(twh_headless_inject_mouse_button(wnd, TWH_MOUSE_LEFT_BUTTON, 1));
+    CHECK(twh_headless_inject_motion(wnd, 3, 4));
+    CHECK(twh_headless_inject_motion(wnd, 5, 6));
+    CHECK(twh_headless_inject_scroll(wnd, -1));
+    twh_poll_events();
+
+    CHECK(twh_next_event(&event) && event.type == TWH_EVENT_KEY && event.window == wnd);
+    CHECK(event.key.code == TWH_KEY_A && event.key.pressed == 1);
+    CHECK(twh_next_event(&event) && event.type == TWH_EVENT_MOUSE_BUTTON);
+    CHECK(event.mouse.button == TWH_MOUSE_LEFT_BUTTON && event.mouse.pressed == 1);
+    /* a run of motions only reports the last one */
+    CHECK(twh_next_event(&event) && event.type == TWH_EVENT_MOTION);
+    CHECK(event.motion.x == 5 && event.motion.y == 6);
+    CHECK(twh_next_event(&event) && event.type == TWH_EVENT_SCROLL && event.scroll.offset == -1);
+    CHECK(!twh_next_event(&event));
+
+    input = twh_window_get_input(wnd);
+    CHECK(twh_is_key_down(input, TWH_KEY_A) && twh_is_key_pressed(input, TWH_KEY_A));
+    CHECK(!twh_is_key_down(input, TWH_KEY_B));
+    CHECK(twh_is_button_down(input, TWH_MOUSE_LEFT_BUTTON));
+    CHECK(twh_is_button_pressed(input, TWH_MOUSE_LEFT_BUTTON));
+    twh_get_cursor_pos(wnd, &x, &y);
+    CHECK(x == 5 && y == 6);
+
+    /* edges last one poll, held keys stay down */
+    twh_poll_events();
+    input = twh_window_get_input(wnd);
+    CHECK(twh_is_key_down(input, TWH_KEY_A) && !twh_is_key_pressed(input, TWH_KEY_A));
+    CHECK(!twh_is_button_pressed(input, TWH_MOUSE_LEFT_BUTTON));
+
+    CHECK(twh_headless_inject_key(wnd, TWH_KEY_A, 0));
+    CHECK(twh_headless_inject_mouse_button(wnd, TWH_MOUSE_LEFT_BUTTON, 0));
+    twh_poll_events();
+    input = twh_window_get_input(wnd);
+    CHECK(!twh_is_key_down(input, TWH_KEY_A) && twh_is_key_released(input, TWH_KEY_A));
+    CHECK(!twh_is_button_down(input, TWH_MOUSE_LEFT_BUTTON));
+    CHECK(twh_is_button_released(input, TWH_MOUSE_LEFT_BUTTON));
+
+    CHECK(!twh_window_should_close(wnd));
+    CHECK(twh_headless_inject_close(wnd));
+    twh_poll_events();
+    CHECK(twh_window_should_close(wnd));
+    drain_events();
+
+    twh_window_release(wnd);
+}
+
+static const struct test_group g_groups[] = {
+    {"layouts", test_layouts},
+    {"damage", test_damage},
+    {"scale", test_scale},
+    {"window-framebuffer", test_window_framebuffer},
+    {"drawing", test_drawing},
+    {"registry", test_registry},
+    {"input", test_input},
+    {"kernels", test_kernels},
+    {"kernels-pool", test_kernels_pool},
+#ifndef _WIN32
+    {"out-of-memory", test_out_of_memory},
+#endif
+};
+#define GROUP_COUNT ((int)(sizeof(g_groups) / sizeof(g_groups[0])))
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : NULL;
+    int ran = 0;
+
+    twh_init();
+    for (int i = 0; i < GROUP_COUNT; i++)
+    {
+        if (only == NULL || strcmp(only, g_groups[i].name) == 0)
+        {
+            int failures = g_failures;
+            g_groups[i].run();
+            printf("%s: %s\n", g_groups[i].name, g_failures == failures ? "ok" : "FAILED");
+            ran++;
+        }
+    }
+    twh_terminate();
+
+    if (ran == 0)
+    {
+        fprintf(stderr, "usage: %s [group]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    return g_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
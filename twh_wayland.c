@@ -0,0 +1,1708 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <linux/input-event-codes.h>
+#include <wayland-client.h>
+
+#include "xdg-shell-client-protocol.h"
+#include "twh.h"
+#include "twh_internal.h"
+
+/*
+ * The Wayland backend, on wl_shm and xdg-shell. Every surface has a pool
+ * of two buffers, one is written while the compositor holds the other,
+ * and frame callbacks pace the commits. It runs on any compositor, a GPU
+ * is not needed, e.g. under weston's headless backend:
+ *
+ *   weston --backend=headless-backend.so --socket=wayland-twh &
+ *   WAYLAND_DISPLAY=wayland-twh twh-bench
+ *
+ * Keys are evdev codes mapped by their position on a US layout, there is
+ * no xkbcommon behind the keymap the compositor sends.
+ */
+
+#define SURFACE_CHANNELS TWH_CHANNELS
+#define SURFACE_BUFFERS 2
+#define PACING_SPIN_TAIL 0.0005 /* seconds busy-waited after sleeping */
+#define FRAME_CALLBACK_TIMEOUT 0.1 /* hidden surfaces get no frame callbacks, commit anyway */
+#define REPEAT_RATE_DEFAULT 25
+#define REPEAT_DELAY_DEFAULT 600
+#define UNUSED_PARAM(x) ((void)x)
+#define RENDER_BATCH_CHUNK 64
+
+struct shm_buffer
+{
+    struct wl_buffer *buffer;
+    unsigned char *pixels;
+    int busy; /* attached and not yet released by the compositor */
+};
+
+/* the buffers of a surface, side by side in one shared memory file */
+struct surface_pool
+{
+    int width;
+    int height;
+    unsigned char *memory;
+    size_t size;
+    struct shm_buffer buffers[SURFACE_BUFFERS];
+};
+
+struct twh_window
+{
+    struct wl_surface *surface;
+    struct xdg_surface *xdg_surface;
+    struct xdg_toplevel *xdg_toplevel;
+    struct wl_callback *frame_callback; /* the last commit is not on screen while set */
+    double frame_deadline; /* when the next commit stops waiting for it */
+    int configured;
+    int configure_w; /* the size of the toplevel configure being acked */
+    int configure_h;
+    twh_swapchain_t *swapchain;
+
+    struct surface_pool pool;
+    int back; /* the buffer written next, the other one is on screen */
+    twh_rect_t stale_rects[TWH_DAMAGE_RECTS]; /* presented from the front since the back was written */
+    int stale_count;
+
+    int window_w;
+    int window_h;
+    int surface_w; /* the presented framebuffer times its scale, the compositor sizes the window to it */
+    int surface_h;
+    twh_framebuffer_t framebuffer;
+    twh_framebuffer_t *presented_fb; /* whose pixels the surface holds */
+
+    int should_close;
+    void *userdata;
+    float cursor_x;
+    float cursor_y;
+    int motion_pending; /* a motion not yet reported, see flush_motion */
+    uint32_t motion_time;
+    twh_input_state_t input;
+
+    twh_key_callback_func_t key_callback;
+    twh_mouse_callback_func_t mouse_callback;
+    twh_scroll_callback_func_t scroll_callback;
+    twh_motion_callback_func_t motion_callback;
+};
+
+#define SWAPCHAIN_MAX_IMAGES 3
+
+enum IMAGE_STATE
+{
+    IMAGE_FREE,
+    IMAGE_ACQUIRED,
+    IMAGE_QUEUED,
+};
+
+/*
+ * Images are acquired and presented round robin. The present thread has
+ * an event queue and buffers of its own, so it never dispatches anything
+ * the caller's thread uses.
+ */
+struct twh_swapchain
+{
+    twh_window_t *window;
+
+    struct wl_event_queue *queue;
+    struct wl_shm *shm; /* wrappers creating their objects on `queue` */
+    struct wl_surface *surface;
+    struct wl_callback *frame_callback;
+    double frame_deadline;
+    struct surface_pool pool;
+    int back;
+    int window_w; /* written by the configure of the window, under `mutex` */
+    int window_h;
+
+    int image_count;
+    twh_framebuffer_t *images[SWAPCHAIN_MAX_IMAGES];
+    int states[SWAPCHAIN_MAX_IMAGES];
+    int next_acquire;
+    int next_present;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
+};
+
+static struct wl_display *g_display = NULL;
+static struct wl_registry *g_registry = NULL;
+static struct wl_compositor *g_compositor = NULL;
+static struct wl_shm *g_shm = NULL;
+static struct xdg_wm_base *g_wm_base = NULL;
+static struct wl_seat *g_seat = NULL;
+static struct wl_pointer *g_pointer = NULL;
+static struct wl_keyboard *g_keyboard = NULL;
+
+/*
+ * Surfaces and buffers live on g_surface_queue, which renders dispatch
+ * while they wait. Input lives on g_input_queue, which only
+ * twh_poll_events dispatches, so no key edge is reported outside a poll.
+ */
+static struct wl_event_queue *g_surface_queue = NULL;
+static struct wl_event_queue *g_input_queue = NULL;
+static struct wl_compositor *g_compositor_wrapper = NULL;
+static struct wl_shm *g_shm_wrapper = NULL;
+static struct xdg_wm_base *g_wm_base_wrapper = NULL;
+
+static twh_window_t *g_pointer_window = NULL;
+static twh_window_t *g_keyboard_window = NULL;
+static unsigned int g_event_count = 0;
+
+/* the compositor only reports the rate, repeats are generated by twh_poll_events */
+static int g_repeat_rate = REPEAT_RATE_DEFAULT;
+static int g_repeat_delay = REPEAT_DELAY_DEFAULT;
+static TWH_KEY_CODE g_repeat_key = TWH_KEY_NUM;
+static uint32_t g_repeat_code = 0;
+static double g_repeat_next = 0;
+
+static unsigned char g_keycode_cache[256]; /* evdev code -> TWH_KEY_CODE */
+
+/* evdev code -> TWH_KEY_CODE */
+static const struct key_mapping
+{
+    unsigned short code;
+    unsigned char key;
+} g_key_mappings[] = {
+    {KEY_SPACE,       TWH_KEY_SPACE},
+    {KEY_APOSTROPHE,  TWH_KEY_APOSTROPHE},
+    {KEY_COMMA,       TWH_KEY_COMMA},
+    {KEY_MINUS,       TWH_KEY_MINUS},
+    {KEY_DOT,         TWH_KEY_PERIOD},
+    {KEY_SLASH,       TWH_KEY_SLASH},
+    {KEY_0,           TWH_KEY_0},
+    {KEY_1,           TWH_KEY_1},
+    {KEY_2,           TWH_KEY_2},
+    {KEY_3,           TWH_KEY_3},
+    {KEY_4,           TWH_KEY_4},
+    {KEY_5,           TWH_KEY_5},
+    {KEY_6,           TWH_KEY_6},
+    {KEY_7,           TWH_KEY_7},
+    {KEY_8,           TWH_KEY_8},
+    {KEY_9,           TWH_KEY_9},
+    {KEY_SEMICOLON,   TWH_KEY_SEMICOLON},
+    {KEY_EQUAL,       TWH_KEY_EQUAL},
+    {KEY_LEFTBRACE,   TWH_KEY_LEFT_BRACKET},
+    {KEY_BACKSLASH,   TWH_KEY_BACKSLASH},
+    {KEY_RIGHTBRACE,  TWH_KEY_RIGHT_BRACKET},
+    {KEY_GRAVE,       TWH_KEY_GRAVE_ACCENT},
+    {KEY_A,           TWH_KEY_A},
+    {KEY_B,           TWH_KEY_B},
+    {KEY_C,           TWH_KEY_C},
+    {KEY_D,           TWH_KEY_D},
+    {KEY_E,           TWH_KEY_E},
+    {KEY_F,           TWH_KEY_F},
+    {KEY_G,           TWH_KEY_G},
+    {KEY_H,           TWH_KEY_H},
+    {KEY_I,           TWH_KEY_I},
+    {KEY_J,           TWH_KEY_J},
+    {KEY_K,           TWH_KEY_K},
+    {KEY_L,           TWH_KEY_L},
+    {KEY_M,           TWH_KEY_M},
+    {KEY_N,           TWH_KEY_N},
+    {KEY_O,           TWH_KEY_O},
+    {KEY_P,           TWH_KEY_P},
+    {KEY_Q,           TWH_KEY_Q},
+    {KEY_R,           TWH_KEY_R},
+    {KEY_S,           TWH_KEY_S},
+    {KEY_T,           TWH_KEY_T},
+    {KEY_U,           TWH_KEY_U},
+    {KEY_V,           TWH_KEY_V},
+    {KEY_W,           TWH_KEY_W},
+    {KEY_X,           TWH_KEY_X},
+    {KEY_Y,           TWH_KEY_Y},
+    {KEY_Z,           TWH_KEY_Z},
+    {KEY_BACKSPACE,   TWH_KEY_BACKSPACE},
+    {KEY_TAB,         TWH_KEY_TAB},
+    {KEY_ENTER,       TWH_KEY_ENTER},
+    {KEY_PAUSE,       TWH_KEY_PAUSE},
+    {KEY_SCROLLLOCK,  TWH_KEY_SCROLL_LOCK},
+    {KEY_ESC,         TWH_KEY_ESCAPE},
+    {KEY_HOME,        TWH_KEY_HOME},
+    {KEY_LEFT,        TWH_KEY_LEFT},
+    {KEY_UP,          TWH_KEY_UP},
+    {KEY_RIGHT,       TWH_KEY_RIGHT},
+    {KEY_DOWN,        TWH_KEY_DOWN},
+    {KEY_PAGEUP,      TWH_KEY_PAGE_UP},
+    {KEY_PAGEDOWN,    TWH_KEY_PAGE_DOWN},
+    {KEY_END,         TWH_KEY_END},
+    {KEY_SYSRQ,       TWH_KEY_PRINT_SCREEN},
+    {KEY_INSERT,      TWH_KEY_INSERT},
+    {KEY_NUMLOCK,     TWH_KEY_NUM_LOCK},
+    {KEY_KPENTER,     TWH_KEY_NUMPAD_ENTER},
+    {KEY_KPASTERISK,  TWH_KEY_NUMPAD_MULTIPLY},
+    {KEY_KPPLUS,      TWH_KEY_NUMPAD_ADD},
+    {KEY_KPMINUS,     TWH_KEY_NUMPAD_SUBTRACT},
+    {KEY_KPDOT,       TWH_KEY_NUMPAD_DECIMAL},
+    {KEY_KPSLASH,     TWH_KEY_NUMPAD_DIVIDE},
+    {KEY_KP0,         TWH_KEY_NUMPAD_0},
+    {KEY_KP1,         TWH_KEY_NUMPAD_1},
+    {KEY_KP2,         TWH_KEY_NUMPAD_2},
+    {KEY_KP3,         TWH_KEY_NUMPAD_3},
+    {KEY_KP4,         TWH_KEY_NUMPAD_4},
+    {KEY_KP5,         TWH_KEY_NUMPAD_5},
+    {KEY_KP6,         TWH_KEY_NUMPAD_6},
+    {KEY_KP7,         TWH_KEY_NUMPAD_7},
+    {KEY_KP8,         TWH_KEY_NUMPAD_8},
+    {KEY_KP9,         TWH_KEY_NUMPAD_9},
+    {KEY_KPEQUAL,     TWH_KEY_NUMPAD_EQUAL},
+    {KEY_F1,          TWH_KEY_F1},
+    {KEY_F2,          TWH_KEY_F2},
+    {KEY_F3,          TWH_KEY_F3},
+    {KEY_F4,          TWH_KEY_F4},
+    {KEY_F5,          TWH_KEY_F5},
+    {KEY_F6,          TWH_KEY_F6},
+    {KEY_F7,          TWH_KEY_F7},
+    {KEY_F8,          TWH_KEY_F8},
+    {KEY_F9,          TWH_KEY_F9},
+    {KEY_F10,         TWH_KEY_F10},
+    {KEY_F11,         TWH_KEY_F11},
+    {KEY_F12,         TWH_KEY_F12},
+    {KEY_F13,         TWH_KEY_F13},
+    {KEY_F14,         TWH_KEY_F14},
+    {KEY_F15,         TWH_KEY_F15},
+    {KEY_F16,         TWH_KEY_F16},
+    {KEY_F17,         TWH_KEY_F17},
+    {KEY_F18,         TWH_KEY_F18},
+    {KEY_F19,         TWH_KEY_F19},
+    {KEY_F20,         TWH_KEY_F20},
+    {KEY_F21,         TWH_KEY_F21},
+    {KEY_F22,         TWH_KEY_F22},
+    {KEY_F23,         TWH_KEY_F23},
+    {KEY_F24,         TWH_KEY_F24},
+    {KEY_LEFTSHIFT,   TWH_KEY_SHIFT},
+    {KEY_RIGHTSHIFT,  TWH_KEY_SHIFT},
+    {KEY_LEFTCTRL,    TWH_KEY_CONTROL},
+    {KEY_RIGHTCTRL,   TWH_KEY_CONTROL},
+    {KEY_CAPSLOCK,    TWH_KEY_CAPS_LOCK},
+    {KEY_LEFTALT,     TWH_KEY_ALT},
+    {KEY_RIGHTALT,    TWH_KEY_ALT},
+    {KEY_DELETE,      TWH_KEY_DELETE},
+};
+
+static double g_frame_period = 0;
+static double g_frame_start = 0;
+static double g_frame_deadline = 0;
+static double g_frame_stats_start = 0;
+
+/* declarations */
+static void open_display(void);
+static void close_display(void);
+static double get_native_time(void);
+static void sleep_until(double deadline);
+static int read_events(struct wl_event_queue *queue, double timeout);
+static int dispatch_queue(struct wl_event_queue *queue, double deadline);
+
+static void update_keycode_cache(void);
+static int create_pool(struct wl_shm *shm, struct surface_pool *pool, int width, int height);
+static void destroy_pool(struct surface_pool *pool);
+static void wait_buffer(struct wl_event_queue *queue, struct shm_buffer *buffer);
+static void wait_frame(struct wl_event_queue *queue, struct wl_callback **frame_callback, double deadline);
+static void commit_buffer(struct wl_surface *surface, struct wl_callback **frame_callback, struct shm_buffer *buffer,
+                          const twh_rect_t *rects, int count);
+static void *swapchain_main(void *param);
+
+static void wait_surface(twh_window_t *wnd);
+static int surface_ready(twh_window_t *wnd, twh_framebuffer_t *fb);
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush);
+static int resize_surface(twh_window_t *wnd, int width, int height);
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count, int flush);
+
+static void handle_key_event(twh_window_t *wnd, TWH_KEY_CODE key, char pressed, double time);
+static void handle_mouse_event(twh_window_t *wnd, uint32_t code, char pressed, uint32_t time);
+static void flush_motion(twh_window_t *wnd);
+static void repeat_keys(void);
+static int key_repeats(TWH_KEY_CODE key);
+
+static void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version);
+static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name);
+static void buffer_release(void *data, struct wl_buffer *buffer);
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time);
+static void wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial);
+static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial);
+static void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states);
+static void xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel);
+static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities);
+static void seat_name(void *data, struct wl_seat *seat, const char *name);
+static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y);
+static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial, struct wl_surface *surface);
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y);
+static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state);
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value);
+static void keyboard_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format, int32_t fd, uint32_t size);
+static void keyboard_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys);
+static void keyboard_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial, struct wl_surface *surface);
+static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state);
+static void keyboard_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group);
+static void keyboard_repeat_info(void *data, struct wl_keyboard *keyboard, int32_t rate, int32_t delay);
+
+static const struct wl_registry_listener g_registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+static const struct wl_buffer_listener g_buffer_listener = {
+    .release = buffer_release,
+};
+static const struct wl_callback_listener g_frame_listener = {
+    .done = frame_done,
+};
+static const struct xdg_wm_base_listener g_wm_base_listener = {
+    .ping = wm_base_ping,
+};
+static const struct xdg_surface_listener g_xdg_surface_listener = {
+    .configure = xdg_surface_configure,
+};
+static const struct xdg_toplevel_listener g_xdg_toplevel_listener = {
+    .configure = xdg_toplevel_configure,
+    .close = xdg_toplevel_close,
+};
+static const struct wl_seat_listener g_seat_listener = {
+    .capabilities = seat_capabilities,
+    .name = seat_name,
+};
+static const struct wl_pointer_listener g_pointer_listener = {
+    .enter = pointer_enter,
+    .leave = pointer_leave,
+    .motion = pointer_motion,
+    .button = pointer_button,
+    .axis = pointer_axis,
+};
+static const struct wl_keyboard_listener g_keyboard_listener = {
+    .keymap = keyboard_keymap,
+    .enter = keyboard_enter,
+    .leave = keyboard_leave,
+    .key = keyboard_key,
+    .modifiers = keyboard_modifiers,
+    .repeat_info = keyboard_repeat_info,
+};
+
+/* implementaions */
+
+void twh_init(void)
+{
+    assert(g_display == NULL);
+    open_display();
+    update_keycode_cache();
+    twh_blit_init();
+}
+
+void twh_terminate(void)
+{
+    assert(g_display != NULL);
+    twh_blit_terminate();
+    close_display();
+    twh_pixels_trim();
+}
+
+float twh_get_timef(void)
+{
+    static double initial = -1;
+    if (initial < 0)
+    {
+        initial = get_native_time();
+    }
+    return (float)(get_native_time() - initial);
+}
+
+void twh_set_target_fps(double fps)
+{
+    g_frame_period = fps > 0 ? 1.0 / fps : 0;
+    g_frame_deadline = 0;
+}
+
+void twh_frame_begin(void)
+{
+    g_frame_start = get_native_time();
+    g_frame_stats_start = twh_stats_begin();
+}
+
+void twh_frame_end(void)
+{
+    twh_stats_end(TWH_STAGE_FRAME, g_frame_stats_start);
+    if (g_frame_period <= 0)
+    {
+        return;
+    }
+
+    /* keep a steady cadence, but don't rush frames to catch up a stall */
+    if (g_frame_deadline <= 0 || get_native_time() - g_frame_deadline > g_frame_period)
+    {
+        g_frame_deadline = g_frame_start + g_frame_period;
+    }
+    else
+    {
+        g_frame_deadline += g_frame_period;
+    }
+    sleep_until(g_frame_deadline);
+}
+
+/* buffers may only be attached once the first configure is acked, so that one is waited for */
+twh_window_t *twh_window_create(const char *title, int width, int height)
+{
+    twh_window_t *window = NULL;
+
+    assert(g_display && width > 0 && height > 0);
+
+    window = (twh_window_t *)malloc(sizeof(twh_window_t));
+    memset(window, 0, sizeof(twh_window_t));
+    window->window_w = width;
+    window->window_h = height;
+    twh_framebuffer_init_window(&window->framebuffer, window, NULL, 0, 0);
+
+    window->surface = wl_compositor_create_surface(g_compositor_wrapper);
+    wl_surface_set_user_data(window->surface, window);
+    window->xdg_surface = xdg_wm_base_get_xdg_surface(g_wm_base_wrapper, window->surface);
+    xdg_surface_add_listener(window->xdg_surface, &g_xdg_surface_listener, window);
+    window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+    xdg_toplevel_add_listener(window->xdg_toplevel, &g_xdg_toplevel_listener, window);
+    xdg_toplevel_set_title(window->xdg_toplevel, title);
+    xdg_toplevel_set_app_id(window->xdg_toplevel, title);
+    wl_surface_commit(window->surface);
+
+    while (!window->configured)
+    {
+        if (dispatch_queue(g_surface_queue, -1) < 0)
+            break;
+    }
+    return window;
+}
+
+void twh_window_release(twh_window_t *wnd)
+{
+    if (wnd == NULL)
+        return;
+
+    if (g_pointer_window == wnd)
+    {
+        g_pointer_window = NULL;
+    }
+    if (g_keyboard_window == wnd)
+    {
+        g_keyboard_window = NULL;
+        g_repeat_key = TWH_KEY_NUM;
+    }
+    if (wnd->frame_callback != NULL)
+    {
+        wl_callback_destroy(wnd->frame_callback);
+    }
+    destroy_pool(&wnd->pool);
+    xdg_toplevel_destroy(wnd->xdg_toplevel);
+    xdg_surface_destroy(wnd->xdg_surface);
+    wl_surface_destroy(wnd->surface);
+    wl_display_flush(g_display);
+    twh_stats_forget(wnd);
+
+    free(wnd);
+    wnd = NULL;
+}
+
+void twh_set_user_data(twh_window_t *wnd, void *userdata)
+{
+    wnd->userdata = userdata;
+}
+
+void *twh_get_user_data(twh_window_t *wnd)
+{
+    return wnd->userdata;
+}
+
+int twh_window_should_close(twh_window_t *wnd)
+{
+    return wnd->should_close;
+}
+
+void twh_window_close(twh_window_t *wnd)
+{
+    wnd->should_close = 1;
+}
+
+void twh_poll_events()
+{
+    double start = twh_stats_begin();
+
+    twh_input_begin_poll();
+    g_event_count = 0;
+
+    read_events(g_input_queue, 0);
+    wl_display_dispatch_queue_pending(g_display, g_input_queue);
+    wl_display_dispatch_queue_pending(g_display, g_surface_queue);
+    if (g_pointer_window != NULL)
+    {
+        flush_motion(g_pointer_window);
+    }
+    repeat_keys();
+
+    wl_display_flush(g_display);
+    twh_stats_count_events(g_event_count);
+    twh_stats_end(TWH_STAGE_EVENTS, start);
+}
+
+void twh_wait_events(double timeout)
+{
+    /* a held key repeats without any event */
+    if (g_repeat_key < TWH_KEY_NUM)
+    {
+        double repeat = g_repeat_next - get_native_time();
+        if (timeout < 0 || repeat < timeout)
+        {
+            timeout = repeat > 0 ? repeat : 0;
+        }
+    }
+    read_events(g_input_queue, timeout);
+    twh_poll_events();
+}
+
+void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback)
+{
+    wnd->key_callback = key_callback;
+}
+
+void twh_set_mouse_callback(twh_window_t *wnd, twh_mouse_callback_func_t mouse_callback)
+{
+    wnd->mouse_callback = mouse_callback;
+}
+
+void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scroll_callback)
+{
+    wnd->scroll_callback = scroll_callback;
+}
+
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback)
+{
+    wnd->motion_callback = motion_callback;
+}
+
+void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
+{
+    *xpos = wnd->cursor_x;
+    *ypos = wnd->cursor_y;
+}
+
+void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
+{
+    if (render_surface(wnd, fb, 1))
+    {
+        twh_stats_rendered(wnd);
+    }
+}
+
+/*
+ * Every commit is queued first, then one flush sends them together. A
+ * surface whose last frame is not shown yet would block the batch, it is
+ * left out and keeps its damage for the next one.
+ */
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count)
+{
+    unsigned char presented[RENDER_BATCH_CHUNK];
+    double start;
+    int base, i, n;
+
+    /* frame callbacks and releases that already arrived, nothing is sent */
+    read_events(g_surface_queue, 0);
+    wl_display_dispatch_queue_pending(g_display, g_surface_queue);
+
+    /* chunks only bound the bookkeeping, most batches fit in one */
+    for (base = 0; base < count; base += RENDER_BATCH_CHUNK)
+    {
+        n = count - base < RENDER_BATCH_CHUNK ? count - base : RENDER_BATCH_CHUNK;
+        for (i = 0; i < n; i++)
+        {
+            presented[i] = (unsigned char)render_surface(windows[base + i], framebuffers[base + i], 0);
+        }
+
+        start = twh_stats_begin();
+        wl_display_flush(g_display);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+
+        for (i = 0; i < n; i++)
+        {
+            twh_window_t *wnd = windows[base + i];
+            if (framebuffers[base + i] == &wnd->framebuffer)
+            {
+                /* the caller writes the surface right after, it must be the back buffer */
+                start = twh_stats_begin();
+                wait_surface(wnd);
+                twh_stats_end(TWH_STAGE_FLUSH, start);
+            }
+            if (presented[i])
+            {
+                twh_stats_rendered(wnd);
+            }
+        }
+    }
+}
+
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd)
+{
+    /* follow the window size, unless it is minimized */
+    if (wnd->window_w > 0 && wnd->window_h > 0 &&
+        (wnd->surface_w != wnd->window_w || wnd->surface_h != wnd->window_h))
+    {
+        resize_surface(wnd, wnd->window_w, wnd->window_h);
+    }
+    if (wnd->surface_w > 0)
+    {
+        wait_surface(wnd);
+    }
+    return &wnd->framebuffer;
+}
+
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height)
+{
+    *width = wnd->window_w;
+    *height = wnd->window_h;
+}
+
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd)
+{
+    return twh_input_current(&wnd->input);
+}
+
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count)
+{
+    twh_swapchain_t *swapchain;
+    int i, error;
+
+    assert(image_count >= 2 && image_count <= SWAPCHAIN_MAX_IMAGES);
+    assert(wnd->swapchain == NULL);
+
+    swapchain = (twh_swapchain_t *)malloc(sizeof(twh_swapchain_t));
+    memset(swapchain, 0, sizeof(twh_swapchain_t));
+    swapchain->window = wnd;
+    if (!twh_framebuffer_create_images(swapchain->images, image_count, wnd->window_w, wnd->window_h))
+    {
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->image_count = image_count;
+    swapchain->queue = wl_display_create_queue(g_display);
+    swapchain->shm = (struct wl_shm *)wl_proxy_create_wrapper(g_shm);
+    wl_proxy_set_queue((struct wl_proxy *)swapchain->shm, swapchain->queue);
+    swapchain->surface = (struct wl_surface *)wl_proxy_create_wrapper(wnd->surface);
+    wl_proxy_set_queue((struct wl_proxy *)swapchain->surface, swapchain->queue);
+    swapchain->window_w = wnd->window_w;
+    swapchain->window_h = wnd->window_h;
+
+    for (i = 0; i < image_count; i++)
+    {
+        swapchain->states[i] = IMAGE_FREE;
+    }
+
+    pthread_mutex_init(&swapchain->mutex, NULL);
+    pthread_cond_init(&swapchain->cond, NULL);
+    wnd->swapchain = swapchain;
+    error = pthread_create(&swapchain->thread, NULL, swapchain_main, swapchain);
+    assert(error == 0);
+    UNUSED_PARAM(error);
+    return swapchain;
+}
+
+void twh_swapchain_release(twh_swapchain_t *swapchain)
+{
+    if (swapchain == NULL)
+        return;
+
+    /* queued images are still presented before the thread quits */
+    pthread_mutex_lock(&swapchain->mutex);
+    swapchain->quit = 1;
+    pthread_cond_broadcast(&swapchain->cond);
+    pthread_mutex_unlock(&swapchain->mutex);
+    pthread_join(swapchain->thread, NULL);
+    pthread_cond_destroy(&swapchain->cond);
+    pthread_mutex_destroy(&swapchain->mutex);
+    swapchain->window->swapchain = NULL;
+
+    twh_framebuffer_release_images(swapchain->images, swapchain->image_count);
+    if (swapchain->frame_callback != NULL)
+    {
+        wl_callback_destroy(swapchain->frame_callback);
+    }
+    destroy_pool(&swapchain->pool);
+    wl_proxy_wrapper_destroy(swapchain->surface);
+    wl_proxy_wrapper_destroy(swapchain->shm);
+    wl_display_flush(g_display);
+    wl_event_queue_destroy(swapchain->queue);
+    free(swapchain);
+}
+
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain)
+{
+    int index;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    index = swapchain->next_acquire;
+    while (swapchain->states[index] != IMAGE_FREE)
+    {
+        pthread_cond_wait(&swapchain->cond, &swapchain->mutex);
+    }
+    swapchain->states[index] = IMAGE_ACQUIRED;
+    swapchain->next_acquire = (index + 1) % swapchain->image_count;
+    pthread_mutex_unlock(&swapchain->mutex);
+
+    return swapchain->images[index];
+}
+
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb)
+{
+    int index;
+
+    for (index = 0; index < swapchain->image_count; index++)
+    {
+        if (swapchain->images[index] == fb)
+            break;
+    }
+    assert(index < swapchain->image_count);
+
+    /* the window buffers no longer match what is on screen */
+    swapchain->window->presented_fb = NULL;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    assert(swapchain->states[index] == IMAGE_ACQUIRED);
+    swapchain->states[index] = IMAGE_QUEUED;
+    pthread_cond_broadcast(&swapchain->cond);
+    pthread_mutex_unlock(&swapchain->mutex);
+}
+
+/* private functions */
+static void open_display(void)
+{
+    g_display = wl_display_connect(NULL);
+    assert(g_display != NULL);
+
+    g_registry = wl_display_get_registry(g_display);
+    wl_registry_add_listener(g_registry, &g_registry_listener, NULL);
+    wl_display_roundtrip(g_display);
+    assert(g_compositor != NULL && g_shm != NULL && g_wm_base != NULL);
+
+    g_surface_queue = wl_display_create_queue(g_display);
+    g_input_queue = wl_display_create_queue(g_display);
+    g_compositor_wrapper = (struct wl_compositor *)wl_proxy_create_wrapper(g_compositor);
+    wl_proxy_set_queue((struct wl_proxy *)g_compositor_wrapper, g_surface_queue);
+    g_shm_wrapper = (struct wl_shm *)wl_proxy_create_wrapper(g_shm);
+    wl_proxy_set_queue((struct wl_proxy *)g_shm_wrapper, g_surface_queue);
+    g_wm_base_wrapper = (struct xdg_wm_base *)wl_proxy_create_wrapper(g_wm_base);
+    wl_proxy_set_queue((struct wl_proxy *)g_wm_base_wrapper, g_surface_queue);
+
+    /* pings and seat changes are answered by twh_poll_events */
+    wl_proxy_set_queue((struct wl_proxy *)g_wm_base, g_input_queue);
+    if (g_seat != NULL)
+    {
+        wl_proxy_set_queue((struct wl_proxy *)g_seat, g_input_queue);
+    }
+    /* whatever was read before lands on the default queue, the seat's capabilities included */
+    wl_display_roundtrip(g_display);
+}
+
+static void close_display(void)
+{
+    if (g_pointer != NULL)
+    {
+        wl_pointer_destroy(g_pointer);
+        g_pointer = NULL;
+    }
+    if (g_keyboard != NULL)
+    {
+        wl_keyboard_destroy(g_keyboard);
+        g_keyboard = NULL;
+    }
+    if (g_seat != NULL)
+    {
+        wl_seat_destroy(g_seat);
+        g_seat = NULL;
+    }
+    wl_proxy_wrapper_destroy(g_wm_base_wrapper);
+    wl_proxy_wrapper_destroy(g_shm_wrapper);
+    wl_proxy_wrapper_destroy(g_compositor_wrapper);
+    xdg_wm_base_destroy(g_wm_base);
+    wl_shm_destroy(g_shm);
+    wl_compositor_destroy(g_compositor);
+    wl_registry_destroy(g_registry);
+    wl_event_queue_destroy(g_input_queue);
+    wl_event_queue_destroy(g_surface_queue);
+    g_wm_base = NULL;
+    g_shm = NULL;
+    g_compositor = NULL;
+    g_registry = NULL;
+    g_pointer_window = NULL;
+    g_keyboard_window = NULL;
+    g_repeat_key = TWH_KEY_NUM;
+
+    wl_display_disconnect(g_display);
+    g_display = NULL;
+}
+
+static double get_native_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* sleeps on the same clock as get_native_time, then spins the last bit */
+static void sleep_until(double deadline)
+{
+    double wake = deadline - PACING_SPIN_TAIL;
+    if (get_native_time() < wake)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wake;
+        ts.tv_nsec = (long)((wake - (double)ts.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+            /* interrupted by a signal, the deadline is absolute */
+        }
+    }
+    while (get_native_time() < deadline)
+    {
+    }
+}
+
+/*
+ * Reads what arrives within `timeout` seconds (-1 waits forever) into the
+ * queues without dispatching anything. Returns 0 right away when `queue`
+ * already holds events, and -1 once the connection is lost. Requests are
+ * flushed before waiting, a read that does not wait leaves them queued.
+ */
+static int read_events(struct wl_event_queue *queue, double timeout)
+{
+    struct pollfd fd;
+    double ms = timeout * 1000 + 0.5;
+    /* clamped, a cast out of range is undefined */
+    int timeout_ms = timeout < 0 ? -1 : ms < (double)INT_MAX ? (int)ms : INT_MAX;
+
+    if (wl_display_prepare_read_queue(g_display, queue) != 0)
+    {
+        return 0;
+    }
+    if (timeout_ms != 0)
+    {
+        wl_display_flush(g_display);
+    }
+
+    fd.fd = wl_display_get_fd(g_display);
+    fd.events = POLLIN;
+    fd.revents = 0;
+    if (poll(&fd, 1, timeout_ms) > 0)
+    {
+        return wl_display_read_events(g_display) == 0 ? 1 : -1;
+    }
+    wl_display_cancel_read(g_display);
+    return wl_display_get_error(g_display) ? -1 : 0;
+}
+
+/*
+ * Dispatches what `queue` holds, or else reads until something arrives or
+ * the `deadline` passes (-1 never does). Returns -1 once the deadline
+ * passed or the connection is lost.
+ */
+static int dispatch_queue(struct wl_event_queue *queue, double deadline)
+{
+    int dispatched = wl_display_dispatch_queue_pending(g_display, queue);
+    double left = deadline - get_native_time();
+
+    if (dispatched != 0)
+    {
+        return dispatched;
+    }
+    if (deadline >= 0 && left <= 0)
+    {
+        return -1;
+    }
+    return read_events(queue, deadline < 0 ? -1 : left) < 0 ? -1 : 0;
+}
+
+static void update_keycode_cache(void)
+{
+    size_t i;
+
+    memset(g_keycode_cache, TWH_KEY_NUM, sizeof(g_keycode_cache));
+    for (i = 0; i < sizeof(g_key_mappings) / sizeof(g_key_mappings[0]); i++)
+    {
+        g_keycode_cache[g_key_mappings[i].code] = g_key_mappings[i].key;
+    }
+}
+
+/*
+ * The buffers inherit the queue of `shm`, whoever waits for their release
+ * dispatches it. Returns 0 and leaves the pool empty when the memory could
+ * not be had.
+ */
+static int create_pool(struct wl_shm *shm, struct surface_pool *pool, int width, int height)
+{
+    size_t buffer_size = (size_t)width * height * SURFACE_CHANNELS;
+    size_t size = buffer_size * SURFACE_BUFFERS;
+    struct wl_shm_pool *shm_pool;
+    void *memory;
+    int fd, i;
+
+    memset(pool, 0, sizeof(struct surface_pool));
+    /* the protocol sizes pools with an int32 */
+    if (size > INT32_MAX)
+    {
+        return 0;
+    }
+
+    /* anonymous, so the present thread and this one never pick the same name */
+    fd = memfd_create("twh-surface", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    while (ftruncate(fd, (off_t)size) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return 0;
+        }
+    }
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+    pool->width = width;
+    pool->height = height;
+    pool->size = size;
+    pool->memory = (unsigned char *)memory;
+
+    shm_pool = wl_shm_create_pool(shm, fd, (int32_t)pool->size);
+    for (i = 0; i < SURFACE_BUFFERS; i++)
+    {
+        struct shm_buffer *buffer = &pool->buffers[i];
+        buffer->pixels = pool->memory + buffer_size * i;
+        buffer->buffer = wl_shm_pool_create_buffer(shm_pool, (int32_t)(buffer_size * i), width, height,
+                                                   width * SURFACE_CHANNELS, WL_SHM_FORMAT_XRGB8888);
+        wl_buffer_add_listener(buffer->buffer, &g_buffer_listener, buffer);
+    }
+    /* the buffers keep the pool alive on the compositor side */
+    wl_shm_pool_destroy(shm_pool);
+    close(fd);
+    return 1;
+}
+
+/* the compositor keeps showing a destroyed buffer it still holds, the memory stays valid for it */
+static void destroy_pool(struct surface_pool *pool)
+{
+    int i;
+
+    if (pool->memory == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < SURFACE_BUFFERS; i++)
+    {
+        wl_buffer_destroy(pool->buffers[i].buffer);
+    }
+    munmap(pool->memory, pool->size);
+    memset(pool, 0, sizeof(struct surface_pool));
+}
+
+static void wait_buffer(struct wl_event_queue *queue, struct shm_buffer *buffer)
+{
+    while (buffer->busy)
+    {
+        if (dispatch_queue(queue, -1) < 0)
+            break;
+    }
+}
+
+/* the pacing of a surface, the last commit is shown before the next one goes out */
+static void wait_frame(struct wl_event_queue *queue, struct wl_callback **frame_callback, double deadline)
+{
+    while (*frame_callback != NULL)
+    {
+        if (dispatch_queue(queue, deadline) < 0)
+            break;
+    }
+}
+
+/* `rects` are in surface coordinates, the commit waits for the next flush */
+static void commit_buffer(struct wl_surface *surface, struct wl_callback **frame_callback, struct shm_buffer *buffer,
+                          const twh_rect_t *rects, int count)
+{
+    int i;
+
+    wl_surface_attach(surface, buffer->buffer, 0, 0);
+    for (i = 0; i < count; i++)
+    {
+        wl_surface_damage_buffer(surface, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    }
+    /* a callback that timed out is dropped, its done would come too late */
+    if (*frame_callback != NULL)
+    {
+        wl_callback_destroy(*frame_callback);
+    }
+    *frame_callback = wl_surface_frame(surface);
+    wl_callback_add_listener(*frame_callback, &g_frame_listener, frame_callback);
+    wl_surface_commit(surface);
+    buffer->busy = 1;
+}
+
+static void *swapchain_main(void *param)
+{
+    twh_swapchain_t *swapchain = (twh_swapchain_t *)param;
+    twh_window_t *wnd = swapchain->window;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    for (;;)
+    {
+        int index = swapchain->next_present;
+        twh_framebuffer_t *fb = swapchain->images[index];
+        twh_rect_t rects[TWH_DAMAGE_RECTS];
+        struct shm_buffer *buffer;
+        int scale, x, y;
+        double start;
+
+        while (!swapchain->quit && swapchain->states[index] != IMAGE_QUEUED)
+        {
+            pthread_cond_wait(&swapchain->cond, &swapchain->mutex);
+        }
+        if (swapchain->states[index] != IMAGE_QUEUED)
+        {
+            break;
+        }
+        scale = twh_blit_fit(fb->width, fb->height, swapchain->window_w, swapchain->window_h, INT_MAX, &x, &y);
+        pthread_mutex_unlock(&swapchain->mutex);
+
+        if (fb->width * scale != swapchain->pool.width || fb->height * scale != swapchain->pool.height)
+        {
+            destroy_pool(&swapchain->pool);
+            create_pool(swapchain->shm, &swapchain->pool, fb->width * scale, fb->height * scale);
+        }
+
+        /* every image is presented whole, its damage is of no use here */
+        twh_framebuffer_take_damage(fb, rects);
+        if (swapchain->pool.memory != NULL)
+        {
+            start = twh_stats_begin();
+            buffer = &swapchain->pool.buffers[swapchain->back];
+            wait_buffer(swapchain->queue, buffer);
+            wait_frame(swapchain->queue, &swapchain->frame_callback, swapchain->frame_deadline);
+            twh_stats_end(TWH_STAGE_FLUSH, start);
+
+            start = twh_stats_begin();
+            twh_blit_bgr(fb, buffer->pixels, scale);
+            twh_stats_end(TWH_STAGE_BLIT, start);
+
+            start = twh_stats_begin();
+            rects[0].x = 0;
+            rects[0].y = 0;
+            rects[0].w = swapchain->pool.width;
+            rects[0].h = swapchain->pool.height;
+            commit_buffer(swapchain->surface, &swapchain->frame_callback, buffer, rects, 1);
+            swapchain->frame_deadline = get_native_time() + FRAME_CALLBACK_TIMEOUT;
+            wl_display_flush(g_display);
+            twh_stats_end(TWH_STAGE_PRESENT, start);
+            swapchain->back = (swapchain->back + 1) % SURFACE_BUFFERS;
+            twh_stats_rendered(wnd);
+        }
+
+        pthread_mutex_lock(&swapchain->mutex);
+        swapchain->states[index] = IMAGE_FREE;
+        swapchain->next_present = (index + 1) % swapchain->image_count;
+        pthread_cond_broadcast(&swapchain->cond);
+    }
+    pthread_mutex_unlock(&swapchain->mutex);
+    return NULL;
+}
+
+/*
+ * Converts and queues the commit of one render, returns 0 when there was
+ * nothing to present. Unless `flush` is set, the caller flushes and waits,
+ * and a surface that is not ready is skipped rather than waited for.
+ */
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush)
+{
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count, i, scale = 1, x, y;
+    double start;
+
+    if (fb != &wnd->framebuffer)
+    {
+        /* there are no letterbox bars, the compositor sizes the window to the surface */
+        scale = twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, INT_MAX, &x, &y);
+        if ((fb->width * scale != wnd->surface_w || fb->height * scale != wnd->surface_h) &&
+            !resize_surface(wnd, fb->width * scale, fb->height * scale))
+        {
+            twh_framebuffer_take_damage(fb, rects);
+            return 0;
+        }
+    }
+    else if (wnd->pool.memory == NULL)
+    {
+        return 0;
+    }
+    if (!flush && !surface_ready(wnd, fb))
+    {
+        return 0;
+    }
+
+    count = twh_framebuffer_take_damage(fb, rects);
+
+    if (fb == &wnd->framebuffer)
+    {
+        if (fb != wnd->presented_fb)
+        {
+            rects[0].x = 0;
+            rects[0].y = 0;
+            rects[0].w = fb->width;
+            rects[0].h = fb->height;
+            count = 1;
+            wnd->presented_fb = fb;
+        }
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        present_surface(wnd, rects, count, flush);
+        if (flush)
+        {
+            /* the caller writes the surface right after, it must be the back buffer */
+            start = twh_stats_begin();
+            wait_surface(wnd);
+            twh_stats_end(TWH_STAGE_FLUSH, start);
+        }
+        return 1;
+    }
+
+    if (fb != wnd->presented_fb)
+    {
+        /* the surface holds another framebuffer's pixels */
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].w = fb->width;
+        rects[0].h = fb->height;
+        count = 1;
+        wnd->presented_fb = fb;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    start = twh_stats_begin();
+    wait_surface(wnd);
+    twh_stats_end(TWH_STAGE_FLUSH, start);
+
+    start = twh_stats_begin();
+    for (i = 0; i < count; i++)
+    {
+        twh_blit_bgr_rect(fb, wnd->pool.buffers[wnd->back].pixels, scale, &rects[i]);
+        twh_flip_rect(&rects[i], fb);
+        twh_scale_rect(&rects[i], scale);
+    }
+    twh_stats_end(TWH_STAGE_BLIT, start);
+
+    present_surface(wnd, rects, count, flush);
+    return 1;
+}
+
+/* the old buffers go away, so does whatever the window framebuffer held */
+static int resize_surface(twh_window_t *wnd, int width, int height)
+{
+    int created;
+
+    destroy_pool(&wnd->pool);
+    created = create_pool(g_shm_wrapper, &wnd->pool, width, height);
+    wnd->back = 0;
+    wnd->stale_count = 0;
+    wnd->surface_w = wnd->pool.width;
+    wnd->surface_h = wnd->pool.height;
+    twh_framebuffer_init_window(&wnd->framebuffer, wnd, wnd->pool.buffers[0].pixels, wnd->surface_w,
+                                wnd->surface_h);
+    wnd->presented_fb = NULL;
+    return created;
+}
+
+/*
+ * Buffers take turns, the back one missed what was presented from the
+ * other since it was last written. Once the compositor released it, those
+ * rects are copied over and the window framebuffer points at it.
+ */
+static void wait_surface(twh_window_t *wnd)
+{
+    struct shm_buffer *back = &wnd->pool.buffers[wnd->back];
+    const struct shm_buffer *front = &wnd->pool.buffers[(wnd->back + 1) % SURFACE_BUFFERS];
+    size_t stride = (size_t)wnd->surface_w * SURFACE_CHANNELS;
+    int i, row;
+
+    wait_buffer(g_surface_queue, back);
+    for (i = 0; i < wnd->stale_count; i++)
+    {
+        const twh_rect_t *rect = &wnd->stale_rects[i];
+        size_t offset = (size_t)rect->x * SURFACE_CHANNELS;
+        for (row = rect->y; row < rect->y + rect->h; row++)
+        {
+            memcpy(back->pixels + row * stride + offset, front->pixels + row * stride + offset,
+                   (size_t)rect->w * SURFACE_CHANNELS);
+        }
+    }
+    wnd->stale_count = 0;
+    wnd->framebuffer.buffer = back->pixels;
+}
+
+/* whether a commit would go out without waiting, after the batch dispatched what arrived */
+static int surface_ready(twh_window_t *wnd, twh_framebuffer_t *fb)
+{
+    if (wnd->frame_callback != NULL && get_native_time() < wnd->frame_deadline)
+    {
+        return 0;
+    }
+    /* the window framebuffer got its back buffer when it was last waited for */
+    return fb == &wnd->framebuffer || !wnd->pool.buffers[wnd->back].busy;
+}
+
+/* commits the back buffer, which becomes the front, and sends it unless a batch flushes later */
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count, int flush)
+{
+    double start;
+
+    start = twh_stats_begin();
+    wait_frame(g_surface_queue, &wnd->frame_callback, wnd->frame_deadline);
+    twh_stats_end(TWH_STAGE_FLUSH, start);
+
+    start = twh_stats_begin();
+    commit_buffer(wnd->surface, &wnd->frame_callback, &wnd->pool.buffers[wnd->back], rects, count);
+    wnd->frame_deadline = get_native_time() + FRAME_CALLBACK_TIMEOUT;
+    if (flush)
+    {
+        wl_display_flush(g_display);
+    }
+    twh_stats_end(TWH_STAGE_PRESENT, start);
+
+    memcpy(wnd->stale_rects, rects, count * sizeof(twh_rect_t));
+    wnd->stale_count = count;
+    wnd->back = (wnd->back + 1) % SURFACE_BUFFERS;
+}
+
+static void handle_key_event(twh_window_t *wnd, TWH_KEY_CODE key, char pressed, double time)
+{
+    twh_event_t event;
+
+    flush_motion(wnd);
+    twh_input_update_key(&wnd->input, key, pressed);
+
+    event.type = TWH_EVENT_KEY;
+    event.window = wnd;
+    event.key.code = key;
+    event.key.pressed = pressed;
+    twh_push_event(&event, time);
+    g_event_count++;
+
+    if (wnd->key_callback)
+    {
+        wnd->key_callback(wnd, key, pressed);
+    }
+}
+
+static void handle_mouse_event(twh_window_t *wnd, uint32_t code, char pressed, uint32_t time)
+{
+    TWH_MOUSE_BUTTON button = TWH_MOUSE_BUTTON_NUM;
+    twh_event_t event;
+
+    switch (code)
+    {
+    case BTN_LEFT:
+        button = TWH_MOUSE_LEFT_BUTTON;
+        break;
+    case BTN_MIDDLE:
+        button = TWH_MOUSE_MIDDLE_BUTTON;
+        break;
+    case BTN_RIGHT:
+        button = TWH_MOUSE_RIGHT_BUTTON;
+        break;
+    default:
+        return;
+    }
+
+    twh_input_update_button(&wnd->input, button, pressed);
+
+    event.type = TWH_EVENT_MOUSE_BUTTON;
+    event.window = wnd;
+    event.mouse.button = button;
+    event.mouse.pressed = pressed;
+    twh_push_event(&event, twh_event_time_from_ms(time));
+    g_event_count++;
+
+    if (wnd->mouse_callback)
+    {
+        wnd->mouse_callback(wnd, button, pressed);
+    }
+}
+
+/* only the last of a run of motions is reported, before whatever input follows it */
+static void flush_motion(twh_window_t *wnd)
+{
+    twh_event_t motion_event;
+
+    if (!wnd->motion_pending)
+    {
+        return;
+    }
+    wnd->motion_pending = 0;
+
+    motion_event.type = TWH_EVENT_MOTION;
+    motion_event.window = wnd;
+    motion_event.motion.x = wnd->cursor_x;
+    motion_event.motion.y = wnd->cursor_y;
+    twh_push_event(&motion_event, twh_event_time_from_ms(wnd->motion_time));
+    g_event_count++;
+
+    if (wnd->motion_callback)
+    {
+        wnd->motion_callback(wnd, wnd->cursor_x, wnd->cursor_y);
+    }
+}
+
+/* held keys repeat as presses only, like the other backends report them */
+static void repeat_keys(void)
+{
+    double now = get_native_time();
+
+    if (g_repeat_key == TWH_KEY_NUM || g_keyboard_window == NULL)
+    {
+        return;
+    }
+    while (g_repeat_next <= now)
+    {
+        handle_key_event(g_keyboard_window, g_repeat_key, 1, twh_stats_now() - (now - g_repeat_next));
+        g_repeat_next += 1.0 / g_repeat_rate;
+    }
+}
+
+/* modifiers and locks don't repeat, as with the X servers' default auto-repeat */
+static int key_repeats(TWH_KEY_CODE key)
+{
+    switch (key)
+    {
+    case TWH_KEY_SHIFT:
+    case TWH_KEY_CONTROL:
+    case TWH_KEY_ALT:
+    case TWH_KEY_CAPS_LOCK:
+    case TWH_KEY_NUM_LOCK:
+    case TWH_KEY_SCROLL_LOCK:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+static void registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+{
+    UNUSED_PARAM(data);
+
+    /* damage_buffer is version 4 of wl_compositor, repeat_info of wl_seat */
+    if (strcmp(interface, wl_compositor_interface.name) == 0)
+    {
+        assert(version >= 4);
+        g_compositor = (struct wl_compositor *)wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+    }
+    else if (strcmp(interface, wl_shm_interface.name) == 0)
+    {
+        g_shm = (struct wl_shm *)wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    }
+    else if (strcmp(interface, xdg_wm_base_interface.name) == 0)
+    {
+        g_wm_base = (struct xdg_wm_base *)wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+        xdg_wm_base_add_listener(g_wm_base, &g_wm_base_listener, NULL);
+    }
+    else if (strcmp(interface, wl_seat_interface.name) == 0 && g_seat == NULL && version >= 4)
+    {
+        g_seat = (struct wl_seat *)wl_registry_bind(registry, name, &wl_seat_interface, 4);
+        wl_seat_add_listener(g_seat, &g_seat_listener, NULL);
+    }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(registry);
+    UNUSED_PARAM(name);
+}
+
+static void buffer_release(void *data, struct wl_buffer *buffer)
+{
+    UNUSED_PARAM(buffer);
+    ((struct shm_buffer *)data)->busy = 0;
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+    struct wl_callback **frame_callback = (struct wl_callback **)data;
+    UNUSED_PARAM(time);
+    wl_callback_destroy(callback);
+    *frame_callback = NULL;
+}
+
+static void wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial)
+{
+    UNUSED_PARAM(data);
+    xdg_wm_base_pong(wm_base, serial);
+}
+
+static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
+{
+    twh_window_t *wnd = (twh_window_t *)data;
+
+    xdg_surface_ack_configure(xdg_surface, serial);
+    wnd->configured = 1;
+
+    /* the surface follows on the next render */
+    if (wnd->configure_w > 0 && wnd->configure_h > 0)
+    {
+        wnd->window_w = wnd->configure_w;
+        wnd->window_h = wnd->configure_h;
+        if (wnd->swapchain != NULL)
+        {
+            pthread_mutex_lock(&wnd->swapchain->mutex);
+            wnd->swapchain->window_w = wnd->window_w;
+            wnd->swapchain->window_h = wnd->window_h;
+            pthread_mutex_unlock(&wnd->swapchain->mutex);
+        }
+    }
+}
+
+/* a size of 0 leaves it to us, the window keeps its size */
+static void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states)
+{
+    twh_window_t *wnd = (twh_window_t *)data;
+    UNUSED_PARAM(xdg_toplevel);
+    UNUSED_PARAM(states);
+    wnd->configure_w = width;
+    wnd->configure_h = height;
+}
+
+static void xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
+{
+    twh_window_t *wnd = (twh_window_t *)data;
+    twh_event_t close_event;
+    UNUSED_PARAM(xdg_toplevel);
+
+    close_event.type = TWH_EVENT_CLOSE;
+    close_event.window = wnd;
+    twh_push_event(&close_event, twh_stats_now());
+    g_event_count++;
+
+    wnd->should_close = 1;
+}
+
+static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t capabilities)
+{
+    UNUSED_PARAM(data);
+
+    if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && g_pointer == NULL)
+    {
+        g_pointer = wl_seat_get_pointer(seat);
+        wl_proxy_set_queue((struct wl_proxy *)g_pointer, g_input_queue);
+        wl_pointer_add_listener(g_pointer, &g_pointer_listener, NULL);
+    }
+    else if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && g_pointer != NULL)
+    {
+        wl_pointer_destroy(g_pointer);
+        g_pointer = NULL;
+        g_pointer_window = NULL;
+    }
+
+    if ((capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && g_keyboard == NULL)
+    {
+        g_keyboard = wl_seat_get_keyboard(seat);
+        wl_proxy_set_queue((struct wl_proxy *)g_keyboard, g_input_queue);
+        wl_keyboard_add_listener(g_keyboard, &g_keyboard_listener, NULL);
+    }
+    else if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && g_keyboard != NULL)
+    {
+        wl_keyboard_destroy(g_keyboard);
+        g_keyboard = NULL;
+        g_keyboard_window = NULL;
+        g_repeat_key = TWH_KEY_NUM;
+    }
+}
+
+static void seat_name(void *data, struct wl_seat *seat, const char *name)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(seat);
+    UNUSED_PARAM(name);
+}
+
+/* surfaces of a destroyed window arrive as NULL */
+static void pointer_enter(void *data, struct wl_pointer *pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(pointer);
+    UNUSED_PARAM(serial);
+
+    g_pointer_window = surface != NULL ? (twh_window_t *)wl_surface_get_user_data(surface) : NULL;
+    if (g_pointer_window != NULL)
+    {
+        g_pointer_window->cursor_x = (float)wl_fixed_to_double(x);
+        g_pointer_window->cursor_y = (float)wl_fixed_to_double(y);
+    }
+}
+
+static void pointer_leave(void *data, struct wl_pointer *pointer, uint32_t serial, struct wl_surface *surface)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(pointer);
+    UNUSED_PARAM(serial);
+    UNUSED_PARAM(surface);
+
+    if (g_pointer_window != NULL)
+    {
+        flush_motion(g_pointer_window);
+        g_pointer_window = NULL;
+    }
+}
+
+static void pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+    twh_window_t *wnd = g_pointer_window;
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(pointer);
+
+    if (wnd == NULL)
+    {
+        return;
+    }
+    wnd->cursor_x = (float)wl_fixed_to_double(x);
+    wnd->cursor_y = (float)wl_fixed_to_double(y);
+    wnd->motion_time = time;
+    wnd->motion_pending = 1;
+}
+
+static void pointer_button(void *data, struct wl_pointer *pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(pointer);
+    UNUSED_PARAM(serial);
+
+    if (g_pointer_window != NULL)
+    {
+        flush_motion(g_pointer_window);
+        handle_mouse_event(g_pointer_window, button, state == WL_POINTER_BUTTON_STATE_PRESSED, time);
+    }
+}
+
+/* a wheel notch is 10 units of the vertical axis, which points down */
+static void pointer_axis(void *data, struct wl_pointer *pointer, uint32_t time, uint32_t axis, wl_fixed_t value)
+{
+    twh_window_t *wnd = g_pointer_window;
+    twh_event_t event;
+    float offset;
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(pointer);
+
+    if (wnd == NULL || axis != WL_POINTER_AXIS_VERTICAL_SCROLL)
+    {
+        return;
+    }
+    flush_motion(wnd);
+    offset = (float)(-wl_fixed_to_double(value) / 10.0);
+
+    event.type = TWH_EVENT_SCROLL;
+    event.window = wnd;
+    event.scroll.offset = offset;
+    twh_push_event(&event, twh_event_time_from_ms(time));
+    g_event_count++;
+
+    if (wnd->scroll_callback)
+    {
+        wnd->scroll_callback(wnd, offset);
+    }
+}
+
+/* keys are mapped by their evdev code, the keymap is of no use without xkbcommon */
+static void keyboard_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format, int32_t fd, uint32_t size)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    UNUSED_PARAM(format);
+    UNUSED_PARAM(size);
+    close(fd);
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    UNUSED_PARAM(serial);
+    UNUSED_PARAM(keys);
+    g_keyboard_window = surface != NULL ? (twh_window_t *)wl_surface_get_user_data(surface) : NULL;
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial, struct wl_surface *surface)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    UNUSED_PARAM(serial);
+    UNUSED_PARAM(surface);
+
+    if (g_keyboard_window != NULL)
+    {
+        twh_input_release_all(&g_keyboard_window->input);
+        g_keyboard_window = NULL;
+    }
+    g_repeat_key = TWH_KEY_NUM;
+}
+
+static void keyboard_key(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
+{
+    TWH_KEY_CODE code = key < sizeof(g_keycode_cache) ? (TWH_KEY_CODE)g_keycode_cache[key] : TWH_KEY_NUM;
+    char pressed = state == WL_KEYBOARD_KEY_STATE_PRESSED;
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    UNUSED_PARAM(serial);
+
+    if (g_keyboard_window == NULL || code == TWH_KEY_NUM)
+    {
+        return;
+    }
+    handle_key_event(g_keyboard_window, code, pressed, twh_event_time_from_ms(time));
+
+    if (pressed && g_repeat_rate > 0 && key_repeats(code))
+    {
+        g_repeat_key = code;
+        g_repeat_code = key;
+        g_repeat_next = get_native_time() + g_repeat_delay / 1000.0;
+    }
+    else if (!pressed && key == g_repeat_code)
+    {
+        g_repeat_key = TWH_KEY_NUM;
+    }
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    UNUSED_PARAM(serial);
+    UNUSED_PARAM(depressed);
+    UNUSED_PARAM(latched);
+    UNUSED_PARAM(locked);
+    UNUSED_PARAM(group);
+}
+
+static void keyboard_repeat_info(void *data, struct wl_keyboard *keyboard, int32_t rate, int32_t delay)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(keyboard);
+    g_repeat_rate = rate;
+    g_repeat_delay = delay;
+    if (rate <= 0)
+    {
+        g_repeat_key = TWH_KEY_NUM;
+    }
+}
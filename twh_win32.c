@@ -2,34 +2,182 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include <windows.h>
 #include <windowsx.h>
 #include <direct.h>
 
 #include "twh.h"
+#include "twh_internal.h"
 
-#define BITMAP_CHANNELS 4
+#define BITMAP_CHANNELS TWH_CHANNELS
+#define SWAPCHAIN_MAX_IMAGES 3
+#define PACING_SPIN_TAIL 0.001 /* seconds busy-waited after sleeping */
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
 
 struct twh_window
 {
     HWND handle;
     HDC memory_dc;
 
-    int bitmap_w;
+    int window_w;
+    int window_h;
+    int bitmap_w; /* the presented framebuffer times its scale */
     int bitmap_h;
+    int bitmap_x; /* where the bitmap sits in the window */
+    int bitmap_y;
     unsigned char *bitmap;
+    twh_framebuffer_t framebuffer;
+    twh_framebuffer_t *presented_fb; /* whose pixels the bitmap holds */
 
     int should_close;
     void *user_data;
+    float cursor_x;
+    float cursor_y;
+    twh_input_state_t input;
 
     twh_key_callback_func_t key_callback;
     twh_mouse_callback_func_t mouse_callback;
     twh_scroll_callback_func_t scroll_callback;
+    twh_motion_callback_func_t motion_callback;
+};
+
+/*
+ * GDI presents are cheap BitBlts from the DIB section, so the swapchain
+ * renders synchronously and only rotates its framebuffers.
+ */
+struct twh_swapchain
+{
+    twh_window_t *window;
+    int image_count;
+    twh_framebuffer_t *images[SWAPCHAIN_MAX_IMAGES];
+    int next_acquire;
 };
 
 static int g_initialized = 0;
-static int g_key_code_table[0xff] = {0};
+static HANDLE g_frame_timer = NULL;
+static double g_frame_period = 0;
+static double g_frame_start = 0;
+static double g_frame_deadline = 0;
+static double g_frame_stats_start = 0;
+
+/* virtual key -> TWH_KEY_CODE + 1, zero marks keys without a mapping */
+#define KEY(vk, key) [vk] = (key) + 1
+static const unsigned char g_key_code_table[256] = {
+    KEY(0x30,          TWH_KEY_0),
+    KEY(0x31,          TWH_KEY_1),
+    KEY(0x32,          TWH_KEY_2),
+    KEY(0x33,          TWH_KEY_3),
+    KEY(0x34,          TWH_KEY_4),
+    KEY(0x35,          TWH_KEY_5),
+    KEY(0x36,          TWH_KEY_6),
+    KEY(0x37,          TWH_KEY_7),
+    KEY(0x38,          TWH_KEY_8),
+    KEY(0x39,          TWH_KEY_9),
+    KEY(0x41,          TWH_KEY_A),
+    KEY(0x42,          TWH_KEY_B),
+    KEY(0x43,          TWH_KEY_C),
+    KEY(0x44,          TWH_KEY_D),
+    KEY(0x45,          TWH_KEY_E),
+    KEY(0x46,          TWH_KEY_F),
+    KEY(0x47,          TWH_KEY_G),
+    KEY(0x48,          TWH_KEY_H),
+    KEY(0x49,          TWH_KEY_I),
+    KEY(0x4A,          TWH_KEY_J),
+    KEY(0x4B,          TWH_KEY_K),
+    KEY(0x4C,          TWH_KEY_L),
+    KEY(0x4D,          TWH_KEY_M),
+    KEY(0x4E,          TWH_KEY_N),
+    KEY(0x4F,          TWH_KEY_O),
+    KEY(0x50,          TWH_KEY_P),
+    KEY(0x51,          TWH_KEY_Q),
+    KEY(0x52,          TWH_KEY_R),
+    KEY(0x53,          TWH_KEY_S),
+    KEY(0x54,          TWH_KEY_T),
+    KEY(0x55,          TWH_KEY_U),
+    KEY(0x56,          TWH_KEY_V),
+    KEY(0x57,          TWH_KEY_W),
+    KEY(0x58,          TWH_KEY_X),
+    KEY(0x59,          TWH_KEY_Y),
+    KEY(0x5A,          TWH_KEY_Z),
+    KEY(0x60,          TWH_KEY_NUMPAD_0),
+    KEY(0x61,          TWH_KEY_NUMPAD_1),
+    KEY(0x62,          TWH_KEY_NUMPAD_2),
+    KEY(0x63,          TWH_KEY_NUMPAD_3),
+    KEY(0x64,          TWH_KEY_NUMPAD_4),
+    KEY(0x65,          TWH_KEY_NUMPAD_5),
+    KEY(0x66,          TWH_KEY_NUMPAD_6),
+    KEY(0x67,          TWH_KEY_NUMPAD_7),
+    KEY(0x68,          TWH_KEY_NUMPAD_8),
+    KEY(0x69,          TWH_KEY_NUMPAD_9),
+    KEY(0x70,          TWH_KEY_F1),
+    KEY(0x71,          TWH_KEY_F2),
+    KEY(0x72,          TWH_KEY_F3),
+    KEY(0x73,          TWH_KEY_F4),
+    KEY(0x74,          TWH_KEY_F5),
+    KEY(0x75,          TWH_KEY_F6),
+    KEY(0x76,          TWH_KEY_F7),
+    KEY(0x77,          TWH_KEY_F8),
+    KEY(0x78,          TWH_KEY_F9),
+    KEY(0x79,          TWH_KEY_F10),
+    KEY(0x7A,          TWH_KEY_F11),
+    KEY(0x7B,          TWH_KEY_F12),
+    KEY(0x7C,          TWH_KEY_F13),
+    KEY(0x7D,          TWH_KEY_F14),
+    KEY(0x7E,          TWH_KEY_F15),
+    KEY(0x7F,          TWH_KEY_F16),
+    KEY(0x80,          TWH_KEY_F17),
+    KEY(0x81,          TWH_KEY_F18),
+    KEY(0x82,          TWH_KEY_F19),
+    KEY(0x83,          TWH_KEY_F20),
+    KEY(0x84,          TWH_KEY_F21),
+    KEY(0x85,          TWH_KEY_F22),
+    KEY(0x86,          TWH_KEY_F23),
+    KEY(0x87,          TWH_KEY_F24),
+    KEY(VK_BACK,       TWH_KEY_BACKSPACE),
+    KEY(VK_TAB,        TWH_KEY_TAB),
+    KEY(VK_RETURN,     TWH_KEY_ENTER),
+    KEY(VK_PAUSE,      TWH_KEY_PAUSE),
+    KEY(VK_SCROLL,     TWH_KEY_SCROLL_LOCK),
+    KEY(VK_SNAPSHOT,   TWH_KEY_PRINT_SCREEN),
+    KEY(VK_CAPITAL,    TWH_KEY_CAPS_LOCK),
+    KEY(VK_ESCAPE,     TWH_KEY_ESCAPE),
+    KEY(VK_SPACE,      TWH_KEY_SPACE),
+    KEY(VK_PRIOR,      TWH_KEY_PAGE_UP),
+    KEY(VK_NEXT,       TWH_KEY_PAGE_DOWN),
+    KEY(VK_END,        TWH_KEY_END),
+    KEY(VK_HOME,       TWH_KEY_HOME),
+    KEY(VK_INSERT,     TWH_KEY_INSERT),
+    KEY(VK_DELETE,     TWH_KEY_DELETE),
+    KEY(VK_UP,         TWH_KEY_UP),
+    KEY(VK_DOWN,       TWH_KEY_DOWN),
+    KEY(VK_LEFT,       TWH_KEY_LEFT),
+    KEY(VK_RIGHT,      TWH_KEY_RIGHT),
+    KEY(VK_NUMLOCK,    TWH_KEY_NUM_LOCK),
+    KEY(VK_CONTROL,    TWH_KEY_CONTROL),
+    KEY(VK_SHIFT,      TWH_KEY_SHIFT),
+    KEY(VK_MENU,       TWH_KEY_ALT),
+    KEY(VK_ADD,        TWH_KEY_NUMPAD_ADD),
+    KEY(VK_SUBTRACT,   TWH_KEY_NUMPAD_SUBTRACT),
+    KEY(VK_MULTIPLY,   TWH_KEY_NUMPAD_MULTIPLY),
+    KEY(VK_DIVIDE,     TWH_KEY_NUMPAD_DIVIDE),
+    KEY(VK_DECIMAL,    TWH_KEY_NUMPAD_DECIMAL),
+    KEY(VK_OEM_1,      TWH_KEY_SEMICOLON),
+    KEY(VK_OEM_2,      TWH_KEY_SLASH),
+    KEY(VK_OEM_3,      TWH_KEY_GRAVE_ACCENT),
+    KEY(VK_OEM_4,      TWH_KEY_LEFT_BRACKET),
+    KEY(VK_OEM_5,      TWH_KEY_BACKSLASH),
+    KEY(VK_OEM_6,      TWH_KEY_RIGHT_BRACKET),
+    KEY(VK_OEM_7,      TWH_KEY_APOSTROPHE),
+    KEY(VK_OEM_COMMA,  TWH_KEY_COMMA),
+    KEY(VK_OEM_MINUS,  TWH_KEY_MINUS),
+    KEY(VK_OEM_PERIOD, TWH_KEY_PERIOD),
+    KEY(VK_OEM_PLUS,   TWH_KEY_EQUAL),
+};
+#undef KEY
 
 #ifdef UNICODE
 static const wchar_t *const WINDOW_CLASS_NAME = L"Class";
@@ -44,23 +192,35 @@ static TWH_KEY_CODE get_key_code(int virtual_key);
 static void handle_key_message(twh_window_t *wnd, WPARAM virtual_key, char pressed);
 static void handle_mouse_button_message(twh_window_t *wnd, TWH_MOUSE_BUTTON mb, char pressed);
 static void handle_mouse_scroll_message(twh_window_t *wnd, float offset);
+static void handle_mouse_move_message(twh_window_t *wnd, int x, int y);
 static LRESULT process_message(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
 static void register_class(void);
 static void unregister_class(void);
 static double get_native_time(void);
+static void sleep_until(double deadline);
 
 static HWND create_win32_window(const char *title, int width, int height);
-static void create_key_code_table(void);
-static void create_bitmap(HWND handle, int width, int height, unsigned char **out_surface, HDC *out_memory_dc);
-static void present_surface(twh_window_t *wnd);
-static void blit_bgr(unsigned char *src, int src_w, int src_h, unsigned char *dst, int dst_w, int dst_h);
+static int create_bitmap(HWND handle, int width, int height, unsigned char **out_surface, HDC *out_memory_dc);
+static void destroy_bitmap(HDC memory_dc);
+static void render_bitmap(twh_window_t *wnd, twh_framebuffer_t *fb, int flush);
+static int resize_bitmap(twh_window_t *wnd, int width, int height);
+static int place_bitmap(twh_window_t *wnd, int x, int y);
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count);
 
 /* implmentations */
 void twh_init()
 {
     assert(g_initialized == 0);
     register_class();
+    twh_blit_init();
+
+    /* high resolution timers exist since Windows 10 1803 */
+    g_frame_timer = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (g_frame_timer == NULL)
+    {
+        g_frame_timer = CreateWaitableTimer(NULL, TRUE, NULL);
+    }
     // initialize_path();
     g_initialized = 1;
 }
@@ -68,6 +228,10 @@ void twh_init()
 void twh_terminate()
 {
     assert(g_initialized == 1);
+    twh_blit_terminate();
+    twh_pixels_trim();
+    CloseHandle(g_frame_timer);
+    g_frame_timer = NULL;
     unregister_class();
     g_initialized = 0;
 }
@@ -82,6 +246,38 @@ float twh_get_timef()
     return (float)(get_native_time() - initial);
 }
 
+void twh_set_target_fps(double fps)
+{
+    g_frame_period = fps > 0 ? 1.0 / fps : 0;
+    g_frame_deadline = 0;
+}
+
+void twh_frame_begin(void)
+{
+    g_frame_start = get_native_time();
+    g_frame_stats_start = twh_stats_begin();
+}
+
+void twh_frame_end(void)
+{
+    twh_stats_end(TWH_STAGE_FRAME, g_frame_stats_start);
+    if (g_frame_period <= 0)
+    {
+        return;
+    }
+
+    /* keep a steady cadence, but don't rush frames to catch up a stall */
+    if (g_frame_deadline <= 0 || get_native_time() - g_frame_deadline > g_frame_period)
+    {
+        g_frame_deadline = g_frame_start + g_frame_period;
+    }
+    else
+    {
+        g_frame_deadline += g_frame_period;
+    }
+    sleep_until(g_frame_deadline);
+}
+
 twh_window_t *twh_window_create(const char *title, int width, int height)
 {
     twh_window_t *window;
@@ -92,16 +288,31 @@ twh_window_t *twh_window_create(const char *title, int width, int height)
     assert(g_initialized && width > 0 && height > 0);
 
     handle = create_win32_window(title, width, height);
-    create_bitmap(handle, width, height, &surface, &memory_dc);
-    create_key_code_table();
+    if (!create_bitmap(handle, width, height, &surface, &memory_dc))
+    {
+        DestroyWindow(handle);
+        return NULL;
+    }
 
     window = (twh_window_t *)malloc(sizeof(twh_window_t));
     memset(window, 0, sizeof(twh_window_t));
     window->handle = handle;
     window->memory_dc = memory_dc;
+    window->window_w = width;
+    window->window_h = height;
     window->bitmap_w = width;
     window->bitmap_h = height;
     window->bitmap = surface;
+    twh_framebuffer_init_window(&window->framebuffer, window, surface, width, height);
+
+    /* WM_MOUSEMOVE keeps the position from here on */
+    {
+        POINT point;
+        GetCursorPos(&point);
+        ScreenToClient(handle, &point);
+        window->cursor_x = (float)point.x;
+        window->cursor_y = (float)point.y;
+    }
 
     SetProp(handle, WINDOW_ENTRY_NAME, window);
     ShowWindow(handle, SW_SHOW);
@@ -110,17 +321,16 @@ twh_window_t *twh_window_create(const char *title, int width, int height)
 
 void twh_window_release(twh_window_t *wnd)
 {
+    if (wnd == NULL)
+        return;
+
     ShowWindow(wnd->handle, SW_HIDE);
     RemoveProp(wnd->handle, WINDOW_ENTRY_NAME);
 
-    DeleteDC(wnd->memory_dc);
+    destroy_bitmap(wnd->memory_dc);
     DestroyWindow(wnd->handle);
+    twh_stats_forget(wnd);
 
-    if (wnd->bitmap)
-    {
-        free(wnd->bitmap);
-        wnd->bitmap = NULL;
-    }
     free(wnd);
     wnd = NULL;
 }
@@ -148,11 +358,28 @@ void twh_window_close(twh_window_t *wnd)
 void twh_poll_events()
 {
     MSG message;
+    double start = twh_stats_begin();
+    unsigned int count = 0;
+
+    twh_input_begin_poll();
     while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE))
     {
         TranslateMessage(&message);
         DispatchMessage(&message);
+        count++;
     }
+    twh_stats_count_events(count);
+    twh_stats_end(TWH_STAGE_EVENTS, start);
+}
+
+void twh_wait_events(double timeout)
+{
+    double ms = timeout * 1000 + 0.5;
+    /* INFINITE itself would never return, a longer timeout stops just short of it */
+    DWORD timeout_ms = timeout < 0 ? INFINITE : ms < (double)(INFINITE - 1) ? (DWORD)ms : INFINITE - 1;
+    /* MWMO_INPUTAVAILABLE also returns for messages already in the queue */
+    MsgWaitForMultipleObjectsEx(0, NULL, timeout_ms, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    twh_poll_events();
 }
 
 void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback)
@@ -170,65 +397,104 @@ void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scrol
     wnd->scroll_callback = scroll_callback;
 }
 
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback)
+{
+    wnd->motion_callback = motion_callback;
+}
+
 void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
 {
-    POINT point;
-    GetCursorPos(&point);
-    ScreenToClient(wnd->handle, &point);
-    *xpos = (float)point.x;
-    *ypos = (float)point.y;
+    *xpos = wnd->cursor_x;
+    *ypos = wnd->cursor_y;
 }
 
-twh_framebuffer_t *twh_framebuffer_create(int width, int height)
+void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
 {
-    twh_framebuffer_t *framebuffer = (twh_framebuffer_t *)malloc(sizeof(twh_framebuffer_t));
-    framebuffer->width = width;
-    framebuffer->height = height;
-    size_t sz = width * height * sizeof(unsigned char) * BITMAP_CHANNELS;
-    framebuffer->buffer = (unsigned char *)malloc(sz);
-    memset(framebuffer->buffer, 0, sz);
-    return framebuffer;
+    render_bitmap(wnd, fb, 1);
 }
 
-void twh_framebuffer_release(twh_framebuffer_t *fb)
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count)
 {
-    if (fb != NULL)
+    double start;
+    int i;
+
+    for (i = 0; i < count; i++)
     {
-        if (fb->buffer != NULL)
-        {
-            free(fb->buffer);
-            fb->buffer = NULL;
-        }
-        free(fb);
-        fb = NULL;
+        render_bitmap(windows[i], framebuffers[i], 0);
     }
+    start = twh_stats_begin();
+    GdiFlush();
+    twh_stats_end(TWH_STAGE_PRESENT, start);
 }
 
-void twh_framebuffer_set_color_u8(twh_framebuffer_t *fb, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd)
 {
-    int index = (y * fb->width + x) * BITMAP_CHANNELS;
-    fb->buffer[index + 0] = r;
-    fb->buffer[index + 1] = g;
-    fb->buffer[index + 2] = b;
+    /* follow the window size, unless it is minimized */
+    if (wnd->window_w > 0 && wnd->window_h > 0 &&
+        (wnd->bitmap_w != wnd->window_w || wnd->bitmap_h != wnd->window_h))
+    {
+        resize_bitmap(wnd, wnd->window_w, wnd->window_h);
+    }
+    return &wnd->framebuffer;
 }
 
-void twh_framebuffer_set_color_u32(twh_framebuffer_t *fb, int x, int y, uint32_t rgb)
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height)
 {
-    int index = (y * fb->width + x) * BITMAP_CHANNELS;
-    fb->buffer[index + 0] = (rgb >> 16) & 0xff;
-    fb->buffer[index + 1] = (rgb >> 8) & 0xff;
-    fb->buffer[index + 2] = rgb & 0xff;
+    *width = wnd->window_w;
+    *height = wnd->window_h;
 }
 
-void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd)
+{
+    return twh_input_current(&wnd->input);
+}
+
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count)
+{
+    twh_swapchain_t *swapchain;
+
+    assert(image_count >= 2 && image_count <= SWAPCHAIN_MAX_IMAGES);
+
+    swapchain = (twh_swapchain_t *)malloc(sizeof(twh_swapchain_t));
+    memset(swapchain, 0, sizeof(twh_swapchain_t));
+    swapchain->window = wnd;
+    if (!twh_framebuffer_create_images(swapchain->images, image_count, wnd->window_w, wnd->window_h))
+    {
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->image_count = image_count;
+    return swapchain;
+}
+
+void twh_swapchain_release(twh_swapchain_t *swapchain)
 {
-    blit_bgr(fb->buffer, fb->width, fb->height, wnd->bitmap, wnd->bitmap_w, wnd->bitmap_h);
-    present_surface(wnd);
+    if (swapchain == NULL)
+        return;
+
+    twh_framebuffer_release_images(swapchain->images, swapchain->image_count);
+    free(swapchain);
+}
+
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain)
+{
+    twh_framebuffer_t *fb = swapchain->images[swapchain->next_acquire];
+    swapchain->next_acquire = (swapchain->next_acquire + 1) % swapchain->image_count;
+    return fb;
+}
+
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb)
+{
+    twh_framebuffer_render(swapchain->window, fb);
 }
 
 static TWH_KEY_CODE get_key_code(int virtual_key)
 {
-    return g_key_code_table[virtual_key];
+    if (virtual_key < 0 || virtual_key > 0xff || g_key_code_table[virtual_key] == 0)
+    {
+        return TWH_KEY_NUM;
+    }
+    return (TWH_KEY_CODE)(g_key_code_table[virtual_key] - 1);
 }
 
 static void handle_key_message(twh_window_t *wnd, WPARAM virtual_key, char pressed)
@@ -237,6 +503,15 @@ static void handle_key_message(twh_window_t *wnd, WPARAM virtual_key, char press
 
     if (key < TWH_KEY_NUM)
     {
+        twh_event_t event;
+        twh_input_update_key(&wnd->input, key, pressed);
+
+        event.type = TWH_EVENT_KEY;
+        event.window = wnd;
+        event.key.code = key;
+        event.key.pressed = pressed;
+        twh_push_event(&event, twh_event_time_from_ms((uint32_t)GetMessageTime()));
+
         if (wnd->key_callback != NULL)
         {
             wnd->key_callback(wnd, key, pressed);
@@ -246,6 +521,15 @@ static void handle_key_message(twh_window_t *wnd, WPARAM virtual_key, char press
 
 static void handle_mouse_button_message(twh_window_t *wnd, TWH_MOUSE_BUTTON mb, char pressed)
 {
+    twh_event_t event;
+    twh_input_update_button(&wnd->input, mb, pressed);
+
+    event.type = TWH_EVENT_MOUSE_BUTTON;
+    event.window = wnd;
+    event.mouse.button = mb;
+    event.mouse.pressed = pressed;
+    twh_push_event(&event, twh_event_time_from_ms((uint32_t)GetMessageTime()));
+
     if (wnd->mouse_callback)
     {
         wnd->mouse_callback(wnd, mb, pressed);
@@ -254,12 +538,38 @@ static void handle_mouse_button_message(twh_window_t *wnd, TWH_MOUSE_BUTTON mb,
 
 static void handle_mouse_scroll_message(twh_window_t *wnd, float offset)
 {
+    twh_event_t event;
+    event.type = TWH_EVENT_SCROLL;
+    event.window = wnd;
+    event.scroll.offset = offset;
+    twh_push_event(&event, twh_event_time_from_ms((uint32_t)GetMessageTime()));
+
     if (wnd->scroll_callback != NULL)
     {
         wnd->scroll_callback(wnd, offset);
     }
 }
 
+/* WM_MOUSEMOVE is generated from the latest position, so it comes coalesced */
+static void handle_mouse_move_message(twh_window_t *wnd, int x, int y)
+{
+    twh_event_t event;
+
+    wnd->cursor_x = (float)x;
+    wnd->cursor_y = (float)y;
+
+    event.type = TWH_EVENT_MOTION;
+    event.window = wnd;
+    event.motion.x = wnd->cursor_x;
+    event.motion.y = wnd->cursor_y;
+    twh_push_event(&event, twh_event_time_from_ms((uint32_t)GetMessageTime()));
+
+    if (wnd->motion_callback != NULL)
+    {
+        wnd->motion_callback(wnd, wnd->cursor_x, wnd->cursor_y);
+    }
+}
+
 static LRESULT process_message(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
     twh_window_t *window = (twh_window_t *)GetProp(hWnd, WINDOW_ENTRY_NAME);
@@ -269,9 +579,27 @@ static LRESULT process_message(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPara
     }
     else if (uMsg == WM_CLOSE)
     {
+        twh_event_t event;
+        event.type = TWH_EVENT_CLOSE;
+        event.window = window;
+        twh_push_event(&event, twh_stats_now());
+
         window->should_close = 1;
         return 0;
     }
+    else if (uMsg == WM_PAINT)
+    {
+        /* frames are only presented where they changed, restore the rest */
+        PAINTSTRUCT paint;
+        HDC window_dc = BeginPaint(hWnd, &paint);
+        if (window->presented_fb != NULL)
+        {
+            BitBlt(window_dc, window->bitmap_x, window->bitmap_y, window->bitmap_w, window->bitmap_h,
+                   window->memory_dc, 0, 0, SRCCOPY);
+        }
+        EndPaint(hWnd, &paint);
+        return 0;
+    }
     else if (uMsg == WM_KEYDOWN)
     {
         handle_key_message(window, wParam, 1);
@@ -312,6 +640,23 @@ static LRESULT process_message(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lPara
         handle_mouse_button_message(window, TWH_MOUSE_MIDDLE_BUTTON, 0);
         return 0;
     }
+    else if (uMsg == WM_SIZE)
+    {
+        /* the bitmap follows on the next render */
+        window->window_w = LOWORD(lParam);
+        window->window_h = HIWORD(lParam);
+        return 0;
+    }
+    else if (uMsg == WM_KILLFOCUS)
+    {
+        twh_input_release_all(&window->input);
+        return 0;
+    }
+    else if (uMsg == WM_MOUSEMOVE)
+    {
+        handle_mouse_move_message(window, GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
+        return 0;
+    }
     else if (uMsg == WM_MOUSEWHEEL)
     {
         float offset = GET_WHEEL_DELTA_WPARAM(wParam) / (float)WHEEL_DELTA;
@@ -335,7 +680,8 @@ static void register_class(void)
     window_class.hInstance = GetModuleHandle(NULL);
     window_class.hIcon = LoadIcon(NULL, IDI_APPLICATION);
     window_class.hCursor = LoadCursor(NULL, IDC_ARROW);
-    window_class.hbrBackground = (HBRUSH)GetStockObject(WHITE_BRUSH);
+    /* also fills the letterbox bars around a scaled framebuffer */
+    window_class.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
     window_class.lpszMenuName = NULL;
     window_class.lpszClassName = WINDOW_CLASS_NAME;
     class_atom = RegisterClass(&window_class);
@@ -361,9 +707,25 @@ static double get_native_time(void)
     return counter.QuadPart * period;
 }
 
+/* sleeps on a waitable timer, then spins the last bit */
+static void sleep_until(double deadline)
+{
+    double remaining = deadline - PACING_SPIN_TAIL - get_native_time();
+    if (remaining > 0 && g_frame_timer != NULL)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)(remaining * 1e7); /* relative, 100ns units */
+        SetWaitableTimer(g_frame_timer, &due, 0, NULL, NULL, FALSE);
+        WaitForSingleObject(g_frame_timer, INFINITE);
+    }
+    while (get_native_time() < deadline)
+    {
+    }
+}
+
 static HWND create_win32_window(const char *title, int width, int height)
 {
-    DWORD style = WS_CAPTION | WS_SYSMENU | WS_MINIMIZEBOX;
+    DWORD style = WS_OVERLAPPEDWINDOW;
     RECT rect;
     HWND handle;
 
@@ -389,133 +751,8 @@ static HWND create_win32_window(const char *title, int width, int height)
     return handle;
 }
 
-static void create_key_code_table(void)
-{
-    /* initialize */
-    memset(g_key_code_table, TWH_KEY_NUM, 0xff * sizeof(int));
-
-    /* Number 1 ~ 9 */
-    g_key_code_table[0x30] = TWH_KEY_0;
-    g_key_code_table[0x31] = TWH_KEY_1;
-    g_key_code_table[0x32] = TWH_KEY_2;
-    g_key_code_table[0x33] = TWH_KEY_3;
-    g_key_code_table[0x34] = TWH_KEY_4;
-    g_key_code_table[0x35] = TWH_KEY_5;
-    g_key_code_table[0x36] = TWH_KEY_6;
-    g_key_code_table[0x37] = TWH_KEY_7;
-    g_key_code_table[0x38] = TWH_KEY_8;
-    g_key_code_table[0x39] = TWH_KEY_9;
-
-    /* Alphabet */
-    g_key_code_table[0x41] = TWH_KEY_A;
-    g_key_code_table[0x42] = TWH_KEY_B;
-    g_key_code_table[0x43] = TWH_KEY_C;
-    g_key_code_table[0x44] = TWH_KEY_D;
-    g_key_code_table[0x45] = TWH_KEY_E;
-    g_key_code_table[0x46] = TWH_KEY_F;
-    g_key_code_table[0x47] = TWH_KEY_G;
-    g_key_code_table[0x48] = TWH_KEY_H;
-    g_key_code_table[0x49] = TWH_KEY_I;
-    g_key_code_table[0x4A] = TWH_KEY_J;
-    g_key_code_table[0x4B] = TWH_KEY_K;
-    g_key_code_table[0x4C] = TWH_KEY_L;
-    g_key_code_table[0x4D] = TWH_KEY_M;
-    g_key_code_table[0x4E] = TWH_KEY_N;
-    g_key_code_table[0x4F] = TWH_KEY_O;
-    g_key_code_table[0x50] = TWH_KEY_P;
-    g_key_code_table[0x51] = TWH_KEY_Q;
-    g_key_code_table[0x52] = TWH_KEY_R;
-    g_key_code_table[0x53] = TWH_KEY_S;
-    g_key_code_table[0x54] = TWH_KEY_T;
-    g_key_code_table[0x55] = TWH_KEY_U;
-    g_key_code_table[0x56] = TWH_KEY_V;
-    g_key_code_table[0x57] = TWH_KEY_W;
-    g_key_code_table[0x58] = TWH_KEY_X;
-    g_key_code_table[0x59] = TWH_KEY_Y;
-    g_key_code_table[0x5A] = TWH_KEY_Z;
-
-    /* Num pad numbers */
-    g_key_code_table[0x60] = TWH_KEY_NUMPAD_0;
-    g_key_code_table[0x61] = TWH_KEY_NUMPAD_1;
-    g_key_code_table[0x62] = TWH_KEY_NUMPAD_2;
-    g_key_code_table[0x63] = TWH_KEY_NUMPAD_3;
-    g_key_code_table[0x64] = TWH_KEY_NUMPAD_4;
-    g_key_code_table[0x65] = TWH_KEY_NUMPAD_5;
-    g_key_code_table[0x66] = TWH_KEY_NUMPAD_6;
-    g_key_code_table[0x67] = TWH_KEY_NUMPAD_7;
-    g_key_code_table[0x68] = TWH_KEY_NUMPAD_8;
-    g_key_code_table[0x69] = TWH_KEY_NUMPAD_9;
-
-    /* F1 ~ F24 */
-    g_key_code_table[0x70] = TWH_KEY_F1;
-    g_key_code_table[0x71] = TWH_KEY_F2;
-    g_key_code_table[0x72] = TWH_KEY_F3;
-    g_key_code_table[0x73] = TWH_KEY_F4;
-    g_key_code_table[0x74] = TWH_KEY_F5;
-    g_key_code_table[0x75] = TWH_KEY_F6;
-    g_key_code_table[0x76] = TWH_KEY_F7;
-    g_key_code_table[0x77] = TWH_KEY_F8;
-    g_key_code_table[0x78] = TWH_KEY_F9;
-    g_key_code_table[0x79] = TWH_KEY_F10;
-    g_key_code_table[0x7A] = TWH_KEY_F11;
-    g_key_code_table[0x7B] = TWH_KEY_F12;
-    g_key_code_table[0x7C] = TWH_KEY_F13;
-    g_key_code_table[0x7D] = TWH_KEY_F14;
-    g_key_code_table[0x7E] = TWH_KEY_F15;
-    g_key_code_table[0x7F] = TWH_KEY_F16;
-    g_key_code_table[0x80] = TWH_KEY_F17;
-    g_key_code_table[0x81] = TWH_KEY_F18;
-    g_key_code_table[0x82] = TWH_KEY_F19;
-    g_key_code_table[0x83] = TWH_KEY_F20;
-    g_key_code_table[0x84] = TWH_KEY_F21;
-    g_key_code_table[0x85] = TWH_KEY_F22;
-    g_key_code_table[0x86] = TWH_KEY_F23;
-    g_key_code_table[0x87] = TWH_KEY_F24;
-
-    /* Functions */
-
-    g_key_code_table[VK_BACK] = TWH_KEY_BACKSPACE;
-    g_key_code_table[VK_TAB] = TWH_KEY_TAB;
-    g_key_code_table[VK_RETURN] = TWH_KEY_ENTER;
-    g_key_code_table[VK_PAUSE] = TWH_KEY_PAUSE;
-    g_key_code_table[VK_SCROLL] = TWH_KEY_SCROLL_LOCK;
-    g_key_code_table[VK_SNAPSHOT] = TWH_KEY_PRINT_SCREEN;
-    g_key_code_table[VK_CAPITAL] = TWH_KEY_CAPS_LOCK;
-    g_key_code_table[VK_ESCAPE] = TWH_KEY_ESCAPE;
-    g_key_code_table[VK_SPACE] = TWH_KEY_SPACE;
-    g_key_code_table[VK_PRIOR] = TWH_KEY_PAGE_UP;
-    g_key_code_table[VK_NEXT] = TWH_KEY_PAGE_DOWN;
-    g_key_code_table[VK_END] = TWH_KEY_END;
-    g_key_code_table[VK_HOME] = TWH_KEY_HOME;
-    g_key_code_table[VK_INSERT] = TWH_KEY_INSERT;
-    g_key_code_table[VK_DELETE] = TWH_KEY_DELETE;
-    g_key_code_table[VK_UP] = TWH_KEY_UP;
-    g_key_code_table[VK_DOWN] = TWH_KEY_DOWN;
-    g_key_code_table[VK_LEFT] = TWH_KEY_LEFT;
-    g_key_code_table[VK_RIGHT] = TWH_KEY_RIGHT;
-    g_key_code_table[VK_NUMLOCK] = TWH_KEY_NUM_LOCK;
-    g_key_code_table[VK_CONTROL] = TWH_KEY_CONTROL;
-    g_key_code_table[VK_SHIFT] = TWH_KEY_SHIFT;
-    g_key_code_table[VK_MENU] = TWH_KEY_ALT;
-    g_key_code_table[VK_ADD] = TWH_KEY_NUMPAD_ADD;
-    g_key_code_table[VK_SUBTRACT] = TWH_KEY_NUMPAD_SUBTRACT;
-    g_key_code_table[VK_MULTIPLY] = TWH_KEY_NUMPAD_MULTIPLY;
-    g_key_code_table[VK_DIVIDE] = TWH_KEY_NUMPAD_DIVIDE;
-    g_key_code_table[VK_DECIMAL] = TWH_KEY_NUMPAD_DECIMAL;
-    g_key_code_table[VK_OEM_1] = TWH_KEY_SEMICOLON;
-    g_key_code_table[VK_OEM_2] = TWH_KEY_SLASH;
-    g_key_code_table[VK_OEM_3] = TWH_KEY_GRAVE_ACCENT;
-    g_key_code_table[VK_OEM_4] = TWH_KEY_LEFT_BRACKET;
-    g_key_code_table[VK_OEM_5] = TWH_KEY_BACKSLASH;
-    g_key_code_table[VK_OEM_6] = TWH_KEY_RIGHT_BRACKET;
-    g_key_code_table[VK_OEM_7] = TWH_KEY_APOSTROPHE;
-    g_key_code_table[VK_OEM_COMMA] = TWH_KEY_COMMA;
-    g_key_code_table[VK_OEM_MINUS] = TWH_KEY_MINUS;
-    g_key_code_table[VK_OEM_PERIOD] = TWH_KEY_PERIOD;
-    g_key_code_table[VK_OEM_PLUS] = TWH_KEY_EQUAL;
-}
-
-static void create_bitmap(HWND handle, int width, int height, unsigned char **out_surface, HDC *out_memory_dc)
+/* returns 0 with no bitmap when out of memory */
+static int create_bitmap(HWND handle, int width, int height, unsigned char **out_surface, HDC *out_memory_dc)
 {
     BITMAPINFOHEADER bi_header;
     HBITMAP dib_bitmap;
@@ -527,9 +764,15 @@ static void create_bitmap(HWND handle, int width, int height, unsigned char **ou
     free(surface);
     surface = NULL;
 
+    *out_surface = NULL;
+    *out_memory_dc = NULL;
     window_dc = GetDC(handle);
     memory_dc = CreateCompatibleDC(window_dc);
     ReleaseDC(handle, window_dc);
+    if (memory_dc == NULL)
+    {
+        return 0;
+    }
 
     memset(&bi_header, 0, sizeof(BITMAPINFOHEADER));
     bi_header.biSize = sizeof(BITMAPINFOHEADER);
@@ -541,42 +784,161 @@ static void create_bitmap(HWND handle, int width, int height, unsigned char **ou
     dib_bitmap = CreateDIBSection(memory_dc, (BITMAPINFO *)&bi_header,
                                   DIB_RGB_COLORS, (void **)&surface,
                                   NULL, 0);
-    assert(dib_bitmap != NULL);
+    if (dib_bitmap == NULL)
+    {
+        DeleteDC(memory_dc);
+        return 0;
+    }
     old_bitmap = (HBITMAP)SelectObject(memory_dc, dib_bitmap);
     DeleteObject(old_bitmap);
 
     *out_surface = surface;
     *out_memory_dc = memory_dc;
+    return 1;
 }
 
-static void present_surface(twh_window_t *wnd)
+static void destroy_bitmap(HDC memory_dc)
 {
-    HDC window_dc = GetDC(wnd->handle);
-    HDC memory_dc = wnd->memory_dc;
-    BitBlt(window_dc, 0, 0, wnd->bitmap_w, wnd->bitmap_h, memory_dc, 0, 0, SRCCOPY);
-    ReleaseDC(wnd->handle, window_dc);
+    HBITMAP dib_bitmap;
+
+    if (memory_dc == NULL)
+    {
+        return;
+    }
+    /* the DIB section owns the pixels, deleting the DC deselects it */
+    dib_bitmap = (HBITMAP)GetCurrentObject(memory_dc, OBJ_BITMAP);
+    DeleteDC(memory_dc);
+    DeleteObject(dib_bitmap);
 }
 
-static void blit_bgr(unsigned char *src, int src_w, int src_h, unsigned char *dst, int dst_w, int dst_h)
+/* unless `flush` is set, the caller finishes the batched GDI calls */
+static void render_bitmap(twh_window_t *wnd, twh_framebuffer_t *fb, int flush)
 {
-    assert(src_w == dst_w && src_h == dst_h);
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count, i, scale, x, y, moved;
+    double start;
 
-    int r, c;
-    int width = dst_w;
-    int height = dst_h;
+    count = twh_framebuffer_take_damage(fb, rects);
 
-    for (r = 0; r < height; r++)
+    if (fb == &wnd->framebuffer)
     {
-        for (c = 0; c < width; c++)
+        if (wnd->memory_dc == NULL)
+        {
+            return;
+        }
+        twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, 1, &x, &y);
+        if (place_bitmap(wnd, x, y))
         {
-            int flipped_r = height - 1 - r;
-            int src_index = (r * width + c) * BITMAP_CHANNELS;
-            int dst_index = (flipped_r * width + c) * BITMAP_CHANNELS;
-            unsigned char *src_pixel = &src[src_index];
-            unsigned char *dst_pixel = &dst[dst_index];
-            dst_pixel[0] = src_pixel[2]; /* blue */
-            dst_pixel[1] = src_pixel[1]; /* green */
-            dst_pixel[2] = src_pixel[0]; /* red */
+            rects[0].x = 0;
+            rects[0].y = 0;
+            rects[0].w = fb->width;
+            rects[0].h = fb->height;
+            count = 1;
         }
+
+        /* GDI may batch the BitBlt, finish it before the caller writes again */
+        wnd->presented_fb = fb;
+        start = twh_stats_begin();
+        present_surface(wnd, rects, count);
+        if (flush)
+        {
+            GdiFlush();
+        }
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+        return;
+    }
+
+    scale = twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, INT_MAX, &x, &y);
+    if ((fb->width * scale != wnd->bitmap_w || fb->height * scale != wnd->bitmap_h) &&
+        !resize_bitmap(wnd, fb->width * scale, fb->height * scale))
+    {
+        return;
+    }
+    moved = place_bitmap(wnd, x, y);
+
+    if (fb != wnd->presented_fb || moved)
+    {
+        /* the bitmap holds another framebuffer's pixels */
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].w = fb->width;
+        rects[0].h = fb->height;
+        count = 1;
+        wnd->presented_fb = fb;
+    }
+
+    start = twh_stats_begin();
+    for (i = 0; i < count; i++)
+    {
+        twh_blit_bgr_rect(fb, wnd->bitmap, scale, &rects[i]);
+        twh_flip_rect(&rects[i], fb);
+        twh_scale_rect(&rects[i], scale);
+    }
+    twh_stats_end(TWH_STAGE_BLIT, start);
+
+    start = twh_stats_begin();
+    present_surface(wnd, rects, count);
+    twh_stats_end(TWH_STAGE_PRESENT, start);
+}
+
+/*
+ * The old bitmap goes away, so does whatever the window framebuffer held.
+ * Out of memory the window is left without a bitmap, 0 x 0 until a later
+ * resize succeeds, and returns 0.
+ */
+static int resize_bitmap(twh_window_t *wnd, int width, int height)
+{
+    int created;
+
+    GdiFlush();
+    destroy_bitmap(wnd->memory_dc);
+    created = create_bitmap(wnd->handle, width, height, &wnd->bitmap, &wnd->memory_dc);
+    wnd->bitmap_w = created ? width : 0;
+    wnd->bitmap_h = created ? height : 0;
+    twh_framebuffer_init_window(&wnd->framebuffer, wnd, wnd->bitmap, wnd->bitmap_w, wnd->bitmap_h);
+    wnd->presented_fb = NULL;
+    return created;
+}
+
+/* returns 1 when the bitmap moved, the window is cleared and needs a full present */
+static int place_bitmap(twh_window_t *wnd, int x, int y)
+{
+    HDC window_dc;
+    RECT client;
+
+    if (x == wnd->bitmap_x && y == wnd->bitmap_y)
+    {
+        return 0;
     }
+    window_dc = GetDC(wnd->handle);
+    GetClientRect(wnd->handle, &client);
+    FillRect(window_dc, &client, (HBRUSH)GetStockObject(BLACK_BRUSH));
+    ReleaseDC(wnd->handle, window_dc);
+    wnd->bitmap_x = x;
+    wnd->bitmap_y = y;
+    return 1;
+}
+
+/* `rects` are in bitmap coordinates */
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count)
+{
+    HDC window_dc;
+    HDC memory_dc = wnd->memory_dc;
+    int i;
+
+    /* without a bitmap there is nothing to show, see resize_bitmap */
+    if (count == 0 || memory_dc == NULL)
+    {
+        return;
+    }
+
+    window_dc = GetDC(wnd->handle);
+    for (i = 0; i < count; i++)
+    {
+        const twh_rect_t *rect = &rects[i];
+        BitBlt(window_dc, wnd->bitmap_x + rect->x, wnd->bitmap_y + rect->y, rect->w, rect->h,
+               memory_dc, rect->x, rect->y, SRCCOPY);
+    }
+    ReleaseDC(wnd->handle, window_dc);
+    twh_stats_rendered(wnd);
 }
@@ -0,0 +1,1820 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <X11/keysym.h>
+
+#include "twh.h"
+#include "twh_internal.h"
+
+/*
+ * The libxcb backend. Requests are sent without waiting for their replies,
+ * which are only read where they are needed, so creating a window or
+ * presenting never blocks on a round trip. Keys are translated with the
+ * core keyboard mapping, there is no need for xcb-keysyms.
+ */
+
+#define SURFACE_CHANNELS TWH_CHANNELS
+#define PACING_SPIN_TAIL 0.0005 /* seconds busy-waited after sleeping */
+#define UNUSED_PARAM(x) ((void)x)
+#define RENDER_BATCH_CHUNK 64
+#define EVENT_TYPE(event) ((event)->response_type & 0x7f)
+#define PUT_IMAGE_HEADER 24 /* bytes of a PutImage request before its data */
+
+/* `shmid` is -1 when the surface is our own memory, `shmseg` is 0 when the server has no access to it */
+struct shm_info
+{
+    int shmid;
+    xcb_shm_seg_t shmseg;
+    xcb_void_cookie_t attach;
+    int unchecked; /* the attach may still fail, see use_shm */
+};
+
+struct twh_window
+{
+    xcb_window_t handle;
+    struct shm_info shm_info;
+    int shm_pending; /* shm put images without completion event */
+
+    int window_w;
+    int window_h;
+    int surface_w; /* the presented framebuffer times its scale, 0 until the first render */
+    int surface_h;
+    int surface_x; /* where the surface sits in the window */
+    int surface_y;
+    unsigned char *surface;
+    twh_framebuffer_t framebuffer;
+    twh_framebuffer_t *presented_fb; /* whose pixels the surface holds */
+
+    int should_close;
+    void *userdata;
+    float cursor_x;
+    float cursor_y;
+    xcb_query_pointer_cookie_t pointer; /* valid while `pointer_pending` */
+    int pointer_pending;
+    twh_input_state_t input;
+
+    twh_key_callback_func_t key_callback;
+    twh_mouse_callback_func_t mouse_callback;
+    twh_scroll_callback_func_t scroll_callback;
+    twh_motion_callback_func_t motion_callback;
+};
+
+#define SWAPCHAIN_MAX_IMAGES 3
+
+enum IMAGE_STATE
+{
+    IMAGE_FREE,
+    IMAGE_ACQUIRED,
+    IMAGE_QUEUED,
+};
+
+/*
+ * Images are acquired and presented round robin. The present thread has a
+ * connection and surface of its own, so it never touches anything the
+ * caller's thread uses.
+ */
+struct twh_swapchain
+{
+    twh_window_t *window;
+
+    xcb_connection_t *connection;
+    xcb_gcontext_t gc;
+    struct shm_info shm_info;
+    unsigned char *surface;
+    int window_w;
+    int window_h;
+    int surface_w;
+    int surface_h;
+    int surface_x;
+    int surface_y;
+    int presented;
+    int exposed;
+    int wake_pipe[2]; /* written when the present thread has work, it sleeps on this and the connection */
+
+    int image_count;
+    twh_framebuffer_t *images[SWAPCHAIN_MAX_IMAGES];
+    int states[SWAPCHAIN_MAX_IMAGES];
+    int next_acquire;
+    int next_present;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
+};
+
+static xcb_connection_t *g_connection = NULL;
+static xcb_screen_t *g_screen = NULL;
+static xcb_gcontext_t g_gc = 0;
+static twh_registry_t g_windows; /* by handle, for dispatching events */
+static int g_shm_queried = 0;
+static int g_shm_available = 0; /* the server has the extension, set once by query_shm */
+static int g_shm_completion = 0;
+
+/* an attach failed, the server cannot map our memory, swapchain threads find out too */
+static pthread_mutex_t g_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_shm_broken = 0;
+
+/* events read while waiting for a completion, handed to the next poll */
+static xcb_generic_event_t **g_deferred = NULL;
+static int g_deferred_head = 0;
+static int g_deferred_count = 0;
+static int g_deferred_capacity = 0;
+
+/* requested by twh_init, the replies are read when first needed */
+static xcb_intern_atom_cookie_t g_protocols_cookie;
+static xcb_intern_atom_cookie_t g_delete_window_cookie;
+static int g_atoms_pending = 0;
+static xcb_atom_t g_wm_protocols = XCB_NONE;
+static xcb_atom_t g_wm_delete_window = XCB_NONE;
+static xcb_get_keyboard_mapping_cookie_t g_keymap_cookie;
+static int g_keymap_pending = 0;
+static unsigned char g_keycode_cache[256]; /* X keycode -> TWH_KEY_CODE */
+
+/* keysym -> TWH_KEY_CODE, sorted by keysym for the binary search in get_key_code */
+static const struct key_mapping
+{
+    unsigned short keysym;
+    unsigned char key;
+} g_key_mappings[] = {
+    {XK_space,        TWH_KEY_SPACE},
+    {XK_apostrophe,   TWH_KEY_APOSTROPHE},
+    {XK_comma,        TWH_KEY_COMMA},
+    {XK_minus,        TWH_KEY_MINUS},
+    {XK_period,       TWH_KEY_PERIOD},
+    {XK_slash,        TWH_KEY_SLASH},
+    {XK_0,            TWH_KEY_0},
+    {XK_1,            TWH_KEY_1},
+    {XK_2,            TWH_KEY_2},
+    {XK_3,            TWH_KEY_3},
+    {XK_4,            TWH_KEY_4},
+    {XK_5,            TWH_KEY_5},
+    {XK_6,            TWH_KEY_6},
+    {XK_7,            TWH_KEY_7},
+    {XK_8,            TWH_KEY_8},
+    {XK_9,            TWH_KEY_9},
+    {XK_semicolon,    TWH_KEY_SEMICOLON},
+    {XK_equal,        TWH_KEY_EQUAL},
+    {XK_bracketleft,  TWH_KEY_LEFT_BRACKET},
+    {XK_backslash,    TWH_KEY_BACKSLASH},
+    {XK_bracketright, TWH_KEY_RIGHT_BRACKET},
+    {XK_grave,        TWH_KEY_GRAVE_ACCENT},
+    {XK_a,            TWH_KEY_A},
+    {XK_b,            TWH_KEY_B},
+    {XK_c,            TWH_KEY_C},
+    {XK_d,            TWH_KEY_D},
+    {XK_e,            TWH_KEY_E},
+    {XK_f,            TWH_KEY_F},
+    {XK_g,            TWH_KEY_G},
+    {XK_h,            TWH_KEY_H},
+    {XK_i,            TWH_KEY_I},
+    {XK_j,            TWH_KEY_J},
+    {XK_k,            TWH_KEY_K},
+    {XK_l,            TWH_KEY_L},
+    {XK_m,            TWH_KEY_M},
+    {XK_n,            TWH_KEY_N},
+    {XK_o,            TWH_KEY_O},
+    {XK_p,            TWH_KEY_P},
+    {XK_q,            TWH_KEY_Q},
+    {XK_r,            TWH_KEY_R},
+    {XK_s,            TWH_KEY_S},
+    {XK_t,            TWH_KEY_T},
+    {XK_u,            TWH_KEY_U},
+    {XK_v,            TWH_KEY_V},
+    {XK_w,            TWH_KEY_W},
+    {XK_x,            TWH_KEY_X},
+    {XK_y,            TWH_KEY_Y},
+    {XK_z,            TWH_KEY_Z},
+    {XK_BackSpace,    TWH_KEY_BACKSPACE},
+    {XK_Tab,          TWH_KEY_TAB},
+    {XK_Return,       TWH_KEY_ENTER},
+    {XK_Pause,        TWH_KEY_PAUSE},
+    {XK_Scroll_Lock,  TWH_KEY_SCROLL_LOCK},
+    {XK_Escape,       TWH_KEY_ESCAPE},
+    {XK_Home,         TWH_KEY_HOME},
+    {XK_Left,         TWH_KEY_LEFT},
+    {XK_Up,           TWH_KEY_UP},
+    {XK_Right,        TWH_KEY_RIGHT},
+    {XK_Down,         TWH_KEY_DOWN},
+    {XK_Page_Up,      TWH_KEY_PAGE_UP},
+    {XK_Page_Down,    TWH_KEY_PAGE_DOWN},
+    {XK_End,          TWH_KEY_END},
+    {XK_Print,        TWH_KEY_PRINT_SCREEN},
+    {XK_Insert,       TWH_KEY_INSERT},
+    {XK_Num_Lock,     TWH_KEY_NUM_LOCK},
+    {XK_KP_Enter,     TWH_KEY_NUMPAD_ENTER},
+    {XK_KP_Multiply,  TWH_KEY_NUMPAD_MULTIPLY},
+    {XK_KP_Add,       TWH_KEY_NUMPAD_ADD},
+    {XK_KP_Subtract,  TWH_KEY_NUMPAD_SUBTRACT},
+    {XK_KP_Decimal,   TWH_KEY_NUMPAD_DECIMAL},
+    {XK_KP_Divide,    TWH_KEY_NUMPAD_DIVIDE},
+    {XK_KP_0,         TWH_KEY_NUMPAD_0},
+    {XK_KP_1,         TWH_KEY_NUMPAD_1},
+    {XK_KP_2,         TWH_KEY_NUMPAD_2},
+    {XK_KP_3,         TWH_KEY_NUMPAD_3},
+    {XK_KP_4,         TWH_KEY_NUMPAD_4},
+    {XK_KP_5,         TWH_KEY_NUMPAD_5},
+    {XK_KP_6,         TWH_KEY_NUMPAD_6},
+    {XK_KP_7,         TWH_KEY_NUMPAD_7},
+    {XK_KP_8,         TWH_KEY_NUMPAD_8},
+    {XK_KP_9,         TWH_KEY_NUMPAD_9},
+    {XK_KP_Equal,     TWH_KEY_NUMPAD_EQUAL},
+    {XK_F1,           TWH_KEY_F1},
+    {XK_F2,           TWH_KEY_F2},
+    {XK_F3,           TWH_KEY_F3},
+    {XK_F4,           TWH_KEY_F4},
+    {XK_F5,           TWH_KEY_F5},
+    {XK_F6,           TWH_KEY_F6},
+    {XK_F7,           TWH_KEY_F7},
+    {XK_F8,           TWH_KEY_F8},
+    {XK_F9,           TWH_KEY_F9},
+    {XK_F10,          TWH_KEY_F10},
+    {XK_F11,          TWH_KEY_F11},
+    {XK_F12,          TWH_KEY_F12},
+    {XK_F13,          TWH_KEY_F13},
+    {XK_F14,          TWH_KEY_F14},
+    {XK_F15,          TWH_KEY_F15},
+    {XK_F16,          TWH_KEY_F16},
+    {XK_F17,          TWH_KEY_F17},
+    {XK_F18,          TWH_KEY_F18},
+    {XK_F19,          TWH_KEY_F19},
+    {XK_F20,          TWH_KEY_F20},
+    {XK_F21,          TWH_KEY_F21},
+    {XK_F22,          TWH_KEY_F22},
+    {XK_F23,          TWH_KEY_F23},
+    {XK_F24,          TWH_KEY_F24},
+    {XK_F25,          TWH_KEY_F25},
+    {XK_Shift_L,      TWH_KEY_SHIFT},
+    {XK_Shift_R,      TWH_KEY_SHIFT},
+    {XK_Control_L,    TWH_KEY_CONTROL},
+    {XK_Control_R,    TWH_KEY_CONTROL},
+    {XK_Caps_Lock,    TWH_KEY_CAPS_LOCK},
+    {XK_Alt_L,        TWH_KEY_ALT},
+    {XK_Alt_R,        TWH_KEY_ALT},
+    {XK_Delete,       TWH_KEY_DELETE},
+};
+static double g_frame_period = 0;
+static double g_frame_start = 0;
+static double g_frame_deadline = 0;
+static double g_frame_stats_start = 0;
+
+/* declarations */
+static void open_connection(void);
+static void close_connection(void);
+static double get_native_time(void);
+static void sleep_until(double deadline);
+
+static xcb_window_t create_xcb_window(const char *title, int width, int height);
+static void load_atoms(void);
+static void request_keyboard_mapping(void);
+static void load_keyboard_mapping(void);
+static void query_shm(void);
+static int create_surface(xcb_connection_t *connection, int width, int height, unsigned char **out_surface, struct shm_info *out_shm_info);
+static int create_shm_surface(xcb_connection_t *connection, int width, int height, unsigned char **out_surface, struct shm_info *out_shm_info);
+static void destroy_surface(xcb_connection_t *connection, unsigned char *surface, int width, int height, struct shm_info *shm_info);
+static int use_shm(xcb_connection_t *connection, struct shm_info *shm_info);
+static void put_image(xcb_connection_t *connection, xcb_window_t handle, xcb_gcontext_t gc, const unsigned char *surface,
+                      int surface_w, int y, int height, int dst_x, int dst_y);
+static int is_shm_completion(xcb_generic_event_t *event);
+static void *swapchain_main(void *param);
+static void create_swapchain_surface(twh_swapchain_t *swapchain, int width, int height);
+static void present_swapchain_surface(twh_swapchain_t *swapchain, int x, int y);
+static void process_swapchain_event(twh_swapchain_t *swapchain, const xcb_generic_event_t *event);
+static int create_wake_pipe(int fds[2]);
+static void wake_swapchain(twh_swapchain_t *swapchain);
+static void wait_swapchain(twh_swapchain_t *swapchain);
+
+static void wait_surface(twh_window_t *wnd);
+static void take_completions(void);
+static void take_surface_event(xcb_generic_event_t *event);
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush);
+static int resize_surface(twh_window_t *wnd, int width, int height);
+static int place_surface(twh_window_t *wnd, int x, int y);
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count);
+static void resolve_pointer(twh_window_t *wnd);
+
+static xcb_generic_event_t *next_event(void);
+static void defer_event(xcb_generic_event_t *event);
+static int is_key_repeat(const xcb_generic_event_t *release, const xcb_generic_event_t *event);
+static int is_same_motion(const xcb_generic_event_t *motion, const xcb_generic_event_t *event);
+static TWH_KEY_CODE get_key_code(xcb_keysym_t keysym);
+static void handle_key_event(twh_window_t *wnd, xcb_keycode_t keycode, char pressed, xcb_timestamp_t time);
+static void handle_mouse_event(twh_window_t *wnd, xcb_button_t xbutton, char pressed, xcb_timestamp_t time);
+static void handle_motion_event(twh_window_t *wnd, xcb_motion_notify_event_t *event);
+static void handle_client_event(twh_window_t *wnd, xcb_client_message_event_t *event);
+static void process_event(xcb_generic_event_t *event);
+
+/* implementaions */
+
+void twh_init(void)
+{
+    assert(g_connection == NULL);
+    open_connection();
+    twh_blit_init();
+}
+
+void twh_terminate(void)
+{
+    assert(g_connection != NULL);
+    twh_blit_terminate();
+    close_connection();
+    twh_pixels_trim();
+}
+
+float twh_get_timef(void)
+{
+    static double initial = -1;
+    if (initial < 0)
+    {
+        initial = get_native_time();
+    }
+    return (float)(get_native_time() - initial);
+}
+
+void twh_set_target_fps(double fps)
+{
+    g_frame_period = fps > 0 ? 1.0 / fps : 0;
+    g_frame_deadline = 0;
+}
+
+void twh_frame_begin(void)
+{
+    g_frame_start = get_native_time();
+    g_frame_stats_start = twh_stats_begin();
+}
+
+void twh_frame_end(void)
+{
+    twh_stats_end(TWH_STAGE_FRAME, g_frame_stats_start);
+    if (g_frame_period <= 0)
+    {
+        return;
+    }
+
+    /* keep a steady cadence, but don't rush frames to catch up a stall */
+    if (g_frame_deadline <= 0 || get_native_time() - g_frame_deadline > g_frame_period)
+    {
+        g_frame_deadline = g_frame_start + g_frame_period;
+    }
+    else
+    {
+        g_frame_deadline += g_frame_period;
+    }
+    sleep_until(g_frame_deadline);
+}
+
+/* the surface is created by the first render, nothing here waits on the server */
+twh_window_t *twh_window_create(const char *title, int width, int height)
+{
+    twh_window_t *window = NULL;
+    xcb_window_t handle;
+
+    assert(g_connection && width > 0 && height > 0);
+
+    handle = create_xcb_window(title, width, height);
+
+    window = (twh_window_t *)malloc(sizeof(twh_window_t));
+    memset(window, 0, sizeof(twh_window_t));
+    window->handle = handle;
+    window->shm_info.shmid = -1;
+    window->window_w = width;
+    window->window_h = height;
+    twh_framebuffer_init_window(&window->framebuffer, window, NULL, 0, 0);
+
+    /* the only pointer query, MotionNotify keeps the position from here on */
+    window->pointer = xcb_query_pointer(g_connection, handle);
+    window->pointer_pending = 1;
+
+    twh_registry_add(&g_windows, handle, window);
+    xcb_map_window(g_connection, handle);
+    xcb_flush(g_connection);
+    return window;
+}
+
+void twh_window_release(twh_window_t *wnd)
+{
+    if (wnd == NULL)
+        return;
+
+    if (wnd->pointer_pending)
+    {
+        xcb_discard_reply(g_connection, wnd->pointer.sequence);
+    }
+    wait_surface(wnd);
+    destroy_surface(g_connection, wnd->surface, wnd->surface_w, wnd->surface_h, &wnd->shm_info);
+    xcb_unmap_window(g_connection, wnd->handle);
+    twh_registry_remove(&g_windows, wnd->handle);
+    xcb_destroy_window(g_connection, wnd->handle);
+    xcb_flush(g_connection);
+    twh_stats_forget(wnd);
+
+    free(wnd);
+    wnd = NULL;
+}
+
+void twh_set_user_data(twh_window_t *wnd, void *userdata)
+{
+    wnd->userdata = userdata;
+}
+
+void *twh_get_user_data(twh_window_t *wnd)
+{
+    return wnd->userdata;
+}
+
+int twh_window_should_close(twh_window_t *wnd)
+{
+    return wnd->should_close;
+}
+
+void twh_window_close(twh_window_t *wnd)
+{
+    wnd->should_close = 1;
+}
+
+/*
+ * A motion or a key release is held back for one event: a run of motions
+ * is reported as its last one, and a release right before a press of the
+ * same key at the same time is an autorepeat, reported as a press only.
+ */
+void twh_poll_events()
+{
+    double start = twh_stats_begin();
+    unsigned int count = 0;
+    xcb_generic_event_t *held = NULL;
+    xcb_generic_event_t *event;
+
+    twh_input_begin_poll();
+    for (;;)
+    {
+        event = next_event();
+        if (held != NULL)
+        {
+            if (event != NULL && is_same_motion(held, event))
+            {
+                free(held);
+                held = event;
+                continue;
+            }
+            if (event == NULL || !is_key_repeat(held, event))
+            {
+                process_event(held);
+                count++;
+            }
+            free(held);
+            held = NULL;
+        }
+        if (event == NULL)
+        {
+            break;
+        }
+
+        if (EVENT_TYPE(event) == XCB_MOTION_NOTIFY || EVENT_TYPE(event) == XCB_KEY_RELEASE)
+        {
+            held = event;
+            continue;
+        }
+        process_event(event);
+        count++;
+        free(event);
+    }
+    xcb_flush(g_connection);
+    twh_stats_count_events(count);
+    twh_stats_end(TWH_STAGE_EVENTS, start);
+}
+
+void twh_wait_events(double timeout)
+{
+    xcb_generic_event_t *event;
+
+    xcb_flush(g_connection);
+    if (g_deferred_head == g_deferred_count)
+    {
+        /* reads whatever already arrived without blocking */
+        event = xcb_poll_for_event(g_connection);
+        if (event != NULL)
+        {
+            defer_event(event);
+        }
+        else
+        {
+            struct pollfd fd;
+            double ms = timeout * 1000 + 0.5;
+            int timeout_ms = timeout < 0 ? -1 : ms < (double)INT_MAX ? (int)ms : INT_MAX;
+            fd.fd = xcb_get_file_descriptor(g_connection);
+            fd.events = POLLIN;
+            fd.revents = 0;
+            poll(&fd, 1, timeout_ms);
+        }
+    }
+    twh_poll_events();
+}
+
+void twh_set_key_callback(twh_window_t *wnd, twh_key_callback_func_t key_callback)
+{
+    wnd->key_callback = key_callback;
+}
+
+void twh_set_mouse_callback(twh_window_t *wnd, twh_mouse_callback_func_t mouse_callback)
+{
+    wnd->mouse_callback = mouse_callback;
+}
+
+void twh_set_scroll_callback(twh_window_t *wnd, twh_scroll_callback_func_t scroll_callback)
+{
+    wnd->scroll_callback = scroll_callback;
+}
+
+void twh_set_motion_callback(twh_window_t *wnd, twh_motion_callback_func_t motion_callback)
+{
+    wnd->motion_callback = motion_callback;
+}
+
+void twh_get_cursor_pos(twh_window_t *wnd, float *xpos, float *ypos)
+{
+    resolve_pointer(wnd);
+    *xpos = wnd->cursor_x;
+    *ypos = wnd->cursor_y;
+}
+
+void twh_framebuffer_render(twh_window_t *wnd, twh_framebuffer_t *fb)
+{
+    if (render_surface(wnd, fb, 1))
+    {
+        twh_stats_rendered(wnd);
+    }
+}
+
+/* every upload is queued first, then one flush sends them together */
+void twh_render_batch(twh_window_t **windows, twh_framebuffer_t **framebuffers, int count)
+{
+    unsigned char presented[RENDER_BATCH_CHUNK];
+    double start;
+    int base, i, n;
+
+    /* chunks only bound the bookkeeping, most batches fit in one */
+    for (base = 0; base < count; base += RENDER_BATCH_CHUNK)
+    {
+        n = count - base < RENDER_BATCH_CHUNK ? count - base : RENDER_BATCH_CHUNK;
+        take_completions();
+        for (i = 0; i < n; i++)
+        {
+            presented[i] = (unsigned char)render_surface(windows[base + i], framebuffers[base + i], 0);
+        }
+
+        start = twh_stats_begin();
+        xcb_flush(g_connection);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+
+        for (i = 0; i < n; i++)
+        {
+            twh_window_t *wnd = windows[base + i];
+            if (framebuffers[base + i] == &wnd->framebuffer)
+            {
+                /* the caller writes the surface right after, don't race the server */
+                start = twh_stats_begin();
+                wait_surface(wnd);
+                twh_stats_end(TWH_STAGE_FLUSH, start);
+            }
+            if (presented[i])
+            {
+                twh_stats_rendered(wnd);
+            }
+        }
+    }
+}
+
+twh_framebuffer_t *twh_window_get_framebuffer(twh_window_t *wnd)
+{
+    /* follow the window size, unless it is minimized */
+    if (wnd->window_w > 0 && wnd->window_h > 0 &&
+        (wnd->surface_w != wnd->window_w || wnd->surface_h != wnd->window_h))
+    {
+        resize_surface(wnd, wnd->window_w, wnd->window_h);
+    }
+    /* an Expose during the last poll may still be uploading the surface */
+    wait_surface(wnd);
+    return &wnd->framebuffer;
+}
+
+void twh_window_get_size(twh_window_t *wnd, int *width, int *height)
+{
+    *width = wnd->window_w;
+    *height = wnd->window_h;
+}
+
+const twh_input_state_t *twh_window_get_input(twh_window_t *wnd)
+{
+    return twh_input_current(&wnd->input);
+}
+
+twh_swapchain_t *twh_swapchain_create(twh_window_t *wnd, int image_count)
+{
+    twh_swapchain_t *swapchain;
+    uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_EXPOSURE;
+    int i, error;
+
+    assert(image_count >= 2 && image_count <= SWAPCHAIN_MAX_IMAGES);
+
+    swapchain = (twh_swapchain_t *)malloc(sizeof(twh_swapchain_t));
+    memset(swapchain, 0, sizeof(twh_swapchain_t));
+    swapchain->window = wnd;
+    if (!twh_framebuffer_create_images(swapchain->images, image_count, wnd->window_w, wnd->window_h))
+    {
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->image_count = image_count;
+    swapchain->connection = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(swapchain->connection) || !create_wake_pipe(swapchain->wake_pipe))
+    {
+        /* out of connections or descriptors, there is no swapchain just as out of memory */
+        xcb_disconnect(swapchain->connection);
+        twh_framebuffer_release_images(swapchain->images, image_count);
+        free(swapchain);
+        return NULL;
+    }
+    swapchain->gc = xcb_generate_id(swapchain->connection);
+    xcb_create_gc(swapchain->connection, swapchain->gc, wnd->handle, 0, NULL);
+    /* our own connection sees the resizes and exposures, the present thread handles them from there */
+    xcb_change_window_attributes(swapchain->connection, wnd->handle, XCB_CW_EVENT_MASK, &event_mask);
+    swapchain->window_w = wnd->window_w;
+    swapchain->window_h = wnd->window_h;
+    create_swapchain_surface(swapchain, wnd->window_w, wnd->window_h);
+
+    for (i = 0; i < image_count; i++)
+    {
+        swapchain->states[i] = IMAGE_FREE;
+    }
+
+    pthread_mutex_init(&swapchain->mutex, NULL);
+    pthread_cond_init(&swapchain->cond, NULL);
+    error = pthread_create(&swapchain->thread, NULL, swapchain_main, swapchain);
+    assert(error == 0);
+    UNUSED_PARAM(error);
+    return swapchain;
+}
+
+void twh_swapchain_release(twh_swapchain_t *swapchain)
+{
+    if (swapchain == NULL)
+        return;
+
+    /* queued images are still presented before the thread quits */
+    pthread_mutex_lock(&swapchain->mutex);
+    swapchain->quit = 1;
+    pthread_mutex_unlock(&swapchain->mutex);
+    wake_swapchain(swapchain);
+    pthread_join(swapchain->thread, NULL);
+    pthread_cond_destroy(&swapchain->cond);
+    pthread_mutex_destroy(&swapchain->mutex);
+
+    twh_framebuffer_release_images(swapchain->images, swapchain->image_count);
+    destroy_surface(swapchain->connection, swapchain->surface, swapchain->surface_w, swapchain->surface_h,
+                    &swapchain->shm_info);
+    xcb_free_gc(swapchain->connection, swapchain->gc);
+    /* connections are not ordered, the last put must be done before the window may be destroyed */
+    free(xcb_get_input_focus_reply(swapchain->connection, xcb_get_input_focus(swapchain->connection), NULL));
+    xcb_disconnect(swapchain->connection);
+    close(swapchain->wake_pipe[0]);
+    close(swapchain->wake_pipe[1]);
+    free(swapchain);
+}
+
+twh_framebuffer_t *twh_swapchain_acquire(twh_swapchain_t *swapchain)
+{
+    int index;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    index = swapchain->next_acquire;
+    while (swapchain->states[index] != IMAGE_FREE)
+    {
+        pthread_cond_wait(&swapchain->cond, &swapchain->mutex);
+    }
+    swapchain->states[index] = IMAGE_ACQUIRED;
+    swapchain->next_acquire = (index + 1) % swapchain->image_count;
+    pthread_mutex_unlock(&swapchain->mutex);
+
+    return swapchain->images[index];
+}
+
+void twh_swapchain_present(twh_swapchain_t *swapchain, twh_framebuffer_t *fb)
+{
+    int index;
+
+    for (index = 0; index < swapchain->image_count; index++)
+    {
+        if (swapchain->images[index] == fb)
+            break;
+    }
+    assert(index < swapchain->image_count);
+
+    /* the window surface no longer matches what is on screen, the present thread restores it now */
+    swapchain->window->presented_fb = NULL;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    assert(swapchain->states[index] == IMAGE_ACQUIRED);
+    swapchain->states[index] = IMAGE_QUEUED;
+    pthread_mutex_unlock(&swapchain->mutex);
+    wake_swapchain(swapchain);
+}
+
+/* private functions */
+
+/* the requests of everything needed later go out together, nothing waits here */
+static void open_connection(void)
+{
+    const xcb_setup_t *setup;
+    xcb_screen_iterator_t screens;
+    xcb_format_iterator_t formats;
+    int screen, i;
+
+    g_connection = xcb_connect(NULL, &screen);
+    assert(!xcb_connection_has_error(g_connection));
+
+    setup = xcb_get_setup(g_connection);
+    screens = xcb_setup_roots_iterator(setup);
+    for (i = 0; i < screen; i++)
+    {
+        xcb_screen_next(&screens);
+    }
+    g_screen = screens.data;
+
+    /* surfaces are written as BGRX, see create_surface */
+    assert(g_screen->root_depth == 24 || g_screen->root_depth == 32);
+    assert(setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST);
+    formats = xcb_setup_pixmap_formats_iterator(setup);
+    for (; formats.rem > 0; xcb_format_next(&formats))
+    {
+        if (formats.data->depth == g_screen->root_depth)
+        {
+            assert(formats.data->bits_per_pixel == SURFACE_CHANNELS * 8);
+        }
+    }
+
+    g_gc = xcb_generate_id(g_connection);
+    xcb_create_gc(g_connection, g_gc, g_screen->root, 0, NULL);
+
+    g_protocols_cookie = xcb_intern_atom(g_connection, 0, strlen("WM_PROTOCOLS"), "WM_PROTOCOLS");
+    g_delete_window_cookie = xcb_intern_atom(g_connection, 0, strlen("WM_DELETE_WINDOW"), "WM_DELETE_WINDOW");
+    g_atoms_pending = 1;
+    request_keyboard_mapping();
+    xcb_prefetch_extension_data(g_connection, &xcb_shm_id);
+    xcb_prefetch_maximum_request_length(g_connection);
+    xcb_flush(g_connection);
+}
+
+static void close_connection(void)
+{
+    int i;
+
+    twh_registry_clear(&g_windows);
+
+    for (i = g_deferred_head; i < g_deferred_count; i++)
+    {
+        free(g_deferred[i]);
+    }
+    free(g_deferred);
+    g_deferred = NULL;
+    g_deferred_head = 0;
+    g_deferred_count = 0;
+    g_deferred_capacity = 0;
+
+    if (g_atoms_pending)
+    {
+        xcb_discard_reply(g_connection, g_protocols_cookie.sequence);
+        xcb_discard_reply(g_connection, g_delete_window_cookie.sequence);
+        g_atoms_pending = 0;
+    }
+    if (g_keymap_pending)
+    {
+        xcb_discard_reply(g_connection, g_keymap_cookie.sequence);
+        g_keymap_pending = 0;
+    }
+    g_shm_queried = 0;
+
+    xcb_free_gc(g_connection, g_gc);
+    xcb_disconnect(g_connection);
+    g_connection = NULL;
+    g_screen = NULL;
+}
+
+static double get_native_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* sleeps on the same clock as get_native_time, then spins the last bit */
+static void sleep_until(double deadline)
+{
+    double wake = deadline - PACING_SPIN_TAIL;
+    if (get_native_time() < wake)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wake;
+        ts.tv_nsec = (long)((wake - (double)ts.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+            /* interrupted by a signal, the deadline is absolute */
+        }
+    }
+    while (get_native_time() < deadline)
+    {
+    }
+}
+
+static xcb_window_t create_xcb_window(const char *title, int width, int height)
+{
+    xcb_window_t handle = xcb_generate_id(g_connection);
+    uint32_t values[3];
+    uint32_t size_hints[18];
+    size_t title_length = strlen(title);
+    char *class_hint;
+
+    /* in the order of the value mask bits */
+    values[0] = g_screen->black_pixel;
+    values[1] = g_screen->white_pixel;
+    values[2] = XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS |
+                XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_EXPOSURE |
+                XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_create_window(g_connection, XCB_COPY_FROM_PARENT, handle, g_screen->root, 0, 0, width, height, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, g_screen->root_visual,
+                      XCB_CW_BACK_PIXEL | XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK, values);
+
+    /* resizable, but never down to nothing: PMinSize of WM_SIZE_HINTS */
+    memset(size_hints, 0, sizeof(size_hints));
+    size_hints[0] = 1 << 4;
+    size_hints[5] = 1;
+    size_hints[6] = 1;
+    xcb_change_property(g_connection, XCB_PROP_MODE_REPLACE, handle, XCB_ATOM_WM_NORMAL_HINTS,
+                        XCB_ATOM_WM_SIZE_HINTS, 32, 18, size_hints);
+
+    /* application name, as instance and class */
+    class_hint = (char *)malloc(title_length * 2 + 2);
+    memcpy(class_hint, title, title_length + 1);
+    memcpy(class_hint + title_length + 1, title, title_length + 1);
+    xcb_change_property(g_connection, XCB_PROP_MODE_REPLACE, handle, XCB_ATOM_WM_CLASS,
+                        XCB_ATOM_STRING, 8, (uint32_t)(title_length * 2 + 2), class_hint);
+    free(class_hint);
+
+    load_atoms();
+    xcb_change_property(g_connection, XCB_PROP_MODE_REPLACE, handle, g_wm_protocols,
+                        XCB_ATOM_ATOM, 32, 1, &g_wm_delete_window);
+
+    return handle;
+}
+
+/* the replies were requested by twh_init, by now they have usually arrived */
+static void load_atoms(void)
+{
+    xcb_intern_atom_reply_t *reply;
+
+    if (!g_atoms_pending)
+    {
+        return;
+    }
+    g_atoms_pending = 0;
+
+    reply = xcb_intern_atom_reply(g_connection, g_protocols_cookie, NULL);
+    assert(reply != NULL);
+    g_wm_protocols = reply->atom;
+    free(reply);
+    reply = xcb_intern_atom_reply(g_connection, g_delete_window_cookie, NULL);
+    assert(reply != NULL);
+    g_wm_delete_window = reply->atom;
+    free(reply);
+}
+
+/* extension facts are the same for every connection, the main one asks */
+static void query_shm(void)
+{
+    const xcb_query_extension_reply_t *extension;
+
+    if (g_shm_queried)
+    {
+        return;
+    }
+    g_shm_queried = 1;
+
+    extension = xcb_get_extension_data(g_connection, &xcb_shm_id);
+    g_shm_available = extension != NULL && extension->present;
+    if (g_shm_available)
+    {
+        g_shm_completion = extension->first_event + XCB_SHM_COMPLETION;
+    }
+}
+
+/*
+ * The main thread queries shm first, swapchain threads only create surfaces
+ * after that. Returns 0 with no surface when out of memory.
+ */
+static int create_surface(xcb_connection_t *connection, int width, int height, unsigned char **out_surface, struct shm_info *out_shm_info)
+{
+    int broken;
+
+    memset(out_shm_info, 0, sizeof(struct shm_info));
+    out_shm_info->shmid = -1;
+    query_shm();
+    pthread_mutex_lock(&g_shm_mutex);
+    broken = g_shm_broken;
+    pthread_mutex_unlock(&g_shm_mutex);
+    if (g_shm_available && !broken && create_shm_surface(connection, width, height, out_surface, out_shm_info))
+    {
+        return 1;
+    }
+
+    /* fallback: the image is copied through the socket on every present */
+    *out_surface = (unsigned char *)twh_pixels_alloc((size_t)width * height * SURFACE_CHANNELS);
+    return *out_surface != NULL;
+}
+
+static int create_shm_surface(xcb_connection_t *connection, int width, int height, unsigned char **out_surface, struct shm_info *out_shm_info)
+{
+    void *shmaddr;
+
+    out_shm_info->shmid = shmget(IPC_PRIVATE, (size_t)width * height * SURFACE_CHANNELS, IPC_CREAT | 0600);
+    if (out_shm_info->shmid < 0)
+    {
+        return 0;
+    }
+    shmaddr = shmat(out_shm_info->shmid, NULL, 0);
+    if (shmaddr == (void *)-1)
+    {
+        shmctl(out_shm_info->shmid, IPC_RMID, NULL);
+        out_shm_info->shmid = -1;
+        return 0;
+    }
+
+    /*
+     * Linux lets the server attach a segment already marked for removal,
+     * so it goes away with the last detach without a round trip first.
+     * Attaching fails on remote displays even if the extension is
+     * reported, the error is checked by the first present.
+     */
+    out_shm_info->shmseg = xcb_generate_id(connection);
+    out_shm_info->attach = xcb_shm_attach_checked(connection, out_shm_info->shmseg, out_shm_info->shmid, 0);
+    out_shm_info->unchecked = 1;
+    shmctl(out_shm_info->shmid, IPC_RMID, NULL);
+
+    *out_surface = (unsigned char *)shmaddr;
+    return 1;
+}
+
+static void destroy_surface(xcb_connection_t *connection, unsigned char *surface, int width, int height, struct shm_info *shm_info)
+{
+    if (shm_info->shmid >= 0)
+    {
+        if (use_shm(connection, shm_info))
+        {
+            xcb_shm_detach(connection, shm_info->shmseg);
+            xcb_flush(connection);
+        }
+        shmdt(surface);
+    }
+    else if (surface != NULL)
+    {
+        twh_pixels_free(surface, (size_t)width * height * SURFACE_CHANNELS);
+    }
+}
+
+/* whether the server reads the surface from shared memory, a refused attach falls back to put image */
+static int use_shm(xcb_connection_t *connection, struct shm_info *shm_info)
+{
+    xcb_generic_error_t *error;
+
+    if (shm_info->shmid < 0)
+    {
+        return 0;
+    }
+    if (shm_info->unchecked)
+    {
+        shm_info->unchecked = 0;
+        error = xcb_request_check(connection, shm_info->attach);
+        if (error != NULL)
+        {
+            free(error);
+            shm_info->shmseg = 0;
+            pthread_mutex_lock(&g_shm_mutex);
+            g_shm_broken = 1;
+            pthread_mutex_unlock(&g_shm_mutex);
+        }
+    }
+    return shm_info->shmseg != 0;
+}
+
+/* full rows y to y + height, split in as few requests as the server accepts */
+static void put_image(xcb_connection_t *connection, xcb_window_t handle, xcb_gcontext_t gc, const unsigned char *surface,
+                      int surface_w, int y, int height, int dst_x, int dst_y)
+{
+    size_t stride = (size_t)surface_w * SURFACE_CHANNELS;
+    size_t max_bytes = (size_t)xcb_get_maximum_request_length(connection) * 4 - PUT_IMAGE_HEADER;
+    int rows = (int)(max_bytes / stride);
+
+    assert(rows > 0);
+    while (height > 0)
+    {
+        int n = height < rows ? height : rows;
+        xcb_put_image(connection, XCB_IMAGE_FORMAT_Z_PIXMAP, handle, gc, surface_w, n, dst_x, dst_y, 0,
+                      g_screen->root_depth, (uint32_t)(stride * n), surface + stride * y);
+        y += n;
+        dst_y += n;
+        height -= n;
+    }
+}
+
+static int is_shm_completion(xcb_generic_event_t *event)
+{
+    return g_shm_available && EVENT_TYPE(event) == g_shm_completion;
+}
+
+static void *swapchain_main(void *param)
+{
+    twh_swapchain_t *swapchain = (twh_swapchain_t *)param;
+    twh_window_t *wnd = swapchain->window;
+    xcb_connection_t *connection = swapchain->connection;
+
+    pthread_mutex_lock(&swapchain->mutex);
+    for (;;)
+    {
+        int index = swapchain->next_present;
+        twh_framebuffer_t *fb = swapchain->images[index];
+        twh_rect_t rects[TWH_DAMAGE_RECTS];
+        int scale, x, y;
+        double start;
+        xcb_generic_event_t *event;
+
+        while (!swapchain->quit && swapchain->states[index] != IMAGE_QUEUED)
+        {
+            pthread_mutex_unlock(&swapchain->mutex);
+            wait_swapchain(swapchain);
+            pthread_mutex_lock(&swapchain->mutex);
+        }
+        if (swapchain->states[index] != IMAGE_QUEUED)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&swapchain->mutex);
+
+        while ((event = xcb_poll_for_event(connection)) != NULL)
+        {
+            process_swapchain_event(swapchain, event);
+            free(event);
+        }
+        scale = twh_blit_fit(fb->width, fb->height, swapchain->window_w, swapchain->window_h, INT_MAX, &x, &y);
+        if (fb->width * scale != swapchain->surface_w || fb->height * scale != swapchain->surface_h)
+        {
+            destroy_surface(connection, swapchain->surface, swapchain->surface_w, swapchain->surface_h,
+                            &swapchain->shm_info);
+            create_swapchain_surface(swapchain, fb->width * scale, fb->height * scale);
+        }
+        if (x != swapchain->surface_x || y != swapchain->surface_y)
+        {
+            xcb_clear_area(connection, 0, wnd->handle, 0, 0, 0, 0);
+            swapchain->surface_x = x;
+            swapchain->surface_y = y;
+        }
+
+        /* the surface held another image, damage is of no use here */
+        twh_framebuffer_take_damage(fb, rects);
+        if (swapchain->surface != NULL)
+        {
+            start = twh_stats_begin();
+            twh_blit_bgr(fb, swapchain->surface, scale);
+            twh_stats_end(TWH_STAGE_BLIT, start);
+            /* the whole surface goes out, that covers any exposure so far */
+            swapchain->exposed = 0;
+            present_swapchain_surface(swapchain, x, y);
+            swapchain->presented = 1;
+            twh_stats_rendered(wnd);
+        }
+
+        pthread_mutex_lock(&swapchain->mutex);
+        swapchain->states[index] = IMAGE_FREE;
+        swapchain->next_present = (index + 1) % swapchain->image_count;
+        pthread_cond_broadcast(&swapchain->cond);
+    }
+    pthread_mutex_unlock(&swapchain->mutex);
+    return NULL;
+}
+
+/* out of memory the swapchain is left without a surface, images are dropped until one fits */
+static void create_swapchain_surface(twh_swapchain_t *swapchain, int width, int height)
+{
+    int created = create_surface(swapchain->connection, width, height, &swapchain->surface, &swapchain->shm_info);
+    swapchain->surface_w = created ? width : 0;
+    swapchain->surface_h = created ? height : 0;
+    swapchain->presented = 0;
+}
+
+static void present_swapchain_surface(twh_swapchain_t *swapchain, int x, int y)
+{
+    xcb_connection_t *connection = swapchain->connection;
+    xcb_window_t handle = swapchain->window->handle;
+    double start = twh_stats_begin();
+    xcb_generic_event_t *event;
+
+    if (use_shm(connection, &swapchain->shm_info))
+    {
+        xcb_shm_put_image(connection, handle, swapchain->gc, swapchain->surface_w, swapchain->surface_h,
+                          0, 0, swapchain->surface_w, swapchain->surface_h, x, y, g_screen->root_depth,
+                          XCB_IMAGE_FORMAT_Z_PIXMAP, 1, swapchain->shm_info.shmseg, 0);
+        xcb_flush(connection);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+
+        /* only this thread reads the connection, nothing else needs to be kept */
+        start = twh_stats_begin();
+        while ((event = xcb_wait_for_event(connection)) != NULL)
+        {
+            int done = is_shm_completion(event);
+            process_swapchain_event(swapchain, event);
+            free(event);
+            if (done)
+            {
+                break;
+            }
+        }
+        twh_stats_end(TWH_STAGE_FLUSH, start);
+    }
+    else
+    {
+        put_image(connection, handle, swapchain->gc, swapchain->surface, swapchain->surface_w,
+                  0, swapchain->surface_h, x, y);
+        xcb_flush(connection);
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+    }
+}
+
+/* an exposure is only noted, the surface may be in use by the put that is waited for */
+static void process_swapchain_event(twh_swapchain_t *swapchain, const xcb_generic_event_t *event)
+{
+    if (EVENT_TYPE(event) == XCB_CONFIGURE_NOTIFY)
+    {
+        const xcb_configure_notify_event_t *configure = (const xcb_configure_notify_event_t *)event;
+        swapchain->window_w = configure->width;
+        swapchain->window_h = configure->height;
+    }
+    else if (EVENT_TYPE(event) == XCB_EXPOSE && ((const xcb_expose_event_t *)event)->count == 0)
+    {
+        swapchain->exposed = 1;
+    }
+}
+
+static int create_wake_pipe(int fds[2])
+{
+    int i;
+
+    if (pipe(fds) != 0)
+    {
+        return 0;
+    }
+    /* a full pipe already wakes the thread, a write never needs to block */
+    for (i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 1;
+}
+
+static void wake_swapchain(twh_swapchain_t *swapchain)
+{
+    char byte = 0;
+    ssize_t written;
+
+    do
+    {
+        written = write(swapchain->wake_pipe[1], &byte, 1);
+    } while (written < 0 && errno == EINTR);
+}
+
+/*
+ * Sleeps until the swapchain is woken or the window system sends events,
+ * then restores the window if it was exposed while no image was queued.
+ */
+static void wait_swapchain(twh_swapchain_t *swapchain)
+{
+    xcb_connection_t *connection = swapchain->connection;
+    xcb_generic_event_t *event;
+    struct pollfd fds[2];
+    char buffer[64];
+
+    /* events already read from the socket would not wake the poll */
+    event = xcb_poll_for_event(connection);
+    if (!swapchain->exposed && event == NULL)
+    {
+        fds[0].fd = xcb_get_file_descriptor(connection);
+        fds[0].events = POLLIN;
+        fds[1].fd = swapchain->wake_pipe[0];
+        fds[1].events = POLLIN;
+        poll(fds, 2, -1);
+    }
+    while (read(swapchain->wake_pipe[0], buffer, sizeof(buffer)) > 0)
+    {
+    }
+
+    while (event != NULL || (event = xcb_poll_for_event(connection)) != NULL)
+    {
+        process_swapchain_event(swapchain, event);
+        free(event);
+        event = NULL;
+    }
+    if (swapchain->exposed && swapchain->presented)
+    {
+        swapchain->exposed = 0;
+        present_swapchain_surface(swapchain, swapchain->surface_x, swapchain->surface_y);
+    }
+}
+
+/*
+ * Converts and queues the uploads of one render, returns 0 when there was
+ * nothing to present. Unless `flush` is set, the caller flushes and waits,
+ * and a surface the server still reads is skipped rather than waited for.
+ */
+static int render_surface(twh_window_t *wnd, twh_framebuffer_t *fb, int flush)
+{
+    twh_rect_t rects[TWH_DAMAGE_RECTS];
+    int count, i, scale, x, y, moved;
+    double start;
+
+    /* waiting would flush in the middle of the batch, the damage is kept for the next one */
+    if (!flush && wnd->shm_pending > 0)
+    {
+        return 0;
+    }
+
+    count = twh_framebuffer_take_damage(fb, rects);
+
+    if (fb == &wnd->framebuffer)
+    {
+        if (wnd->surface == NULL)
+        {
+            return 0;
+        }
+        twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, 1, &x, &y);
+        if (place_surface(wnd, x, y))
+        {
+            rects[0].x = 0;
+            rects[0].y = 0;
+            rects[0].w = fb->width;
+            rects[0].h = fb->height;
+            count = 1;
+        }
+
+        wnd->presented_fb = fb;
+        start = twh_stats_begin();
+        present_surface(wnd, rects, count);
+        if (flush)
+        {
+            xcb_flush(g_connection);
+        }
+        twh_stats_end(TWH_STAGE_PRESENT, start);
+        if (flush)
+        {
+            /* the caller writes the surface right after, don't race the server */
+            start = twh_stats_begin();
+            wait_surface(wnd);
+            twh_stats_end(TWH_STAGE_FLUSH, start);
+        }
+        return count > 0;
+    }
+
+    scale = twh_blit_fit(fb->width, fb->height, wnd->window_w, wnd->window_h, INT_MAX, &x, &y);
+    if ((fb->width * scale != wnd->surface_w || fb->height * scale != wnd->surface_h) &&
+        !resize_surface(wnd, fb->width * scale, fb->height * scale))
+    {
+        return 0;
+    }
+    moved = place_surface(wnd, x, y);
+
+    if (fb != wnd->presented_fb || moved)
+    {
+        /* the surface holds another framebuffer's pixels */
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].w = fb->width;
+        rects[0].h = fb->height;
+        count = 1;
+        wnd->presented_fb = fb;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    start = twh_stats_begin();
+    wait_surface(wnd);
+    twh_stats_end(TWH_STAGE_FLUSH, start);
+
+    start = twh_stats_begin();
+    for (i = 0; i < count; i++)
+    {
+        twh_blit_bgr_rect(fb, wnd->surface, scale, &rects[i]);
+        twh_flip_rect(&rects[i], fb);
+        twh_scale_rect(&rects[i], scale);
+    }
+    twh_stats_end(TWH_STAGE_BLIT, start);
+
+    start = twh_stats_begin();
+    present_surface(wnd, rects, count);
+    if (flush)
+    {
+        xcb_flush(g_connection);
+    }
+    twh_stats_end(TWH_STAGE_PRESENT, start);
+    return 1;
+}
+
+/*
+ * The old surface goes away, so does whatever the window framebuffer held.
+ * Out of memory the window is left without a surface, 0 x 0 as before its
+ * first render, and returns 0.
+ */
+static int resize_surface(twh_window_t *wnd, int width, int height)
+{
+    int created;
+
+    wait_surface(wnd);
+    destroy_surface(g_connection, wnd->surface, wnd->surface_w, wnd->surface_h, &wnd->shm_info);
+    created = create_surface(g_connection, width, height, &wnd->surface, &wnd->shm_info);
+    wnd->surface_w = created ? width : 0;
+    wnd->surface_h = created ? height : 0;
+    twh_framebuffer_init_window(&wnd->framebuffer, wnd, wnd->surface, wnd->surface_w, wnd->surface_h);
+    wnd->presented_fb = NULL;
+    return created;
+}
+
+/* returns 1 when the surface moved, the window is cleared and needs a full present */
+static int place_surface(twh_window_t *wnd, int x, int y)
+{
+    if (x == wnd->surface_x && y == wnd->surface_y)
+    {
+        return 0;
+    }
+    /* the server paints the letterbox bars with the window background */
+    xcb_clear_area(g_connection, 0, wnd->handle, 0, 0, 0, 0);
+    wnd->surface_x = x;
+    wnd->surface_y = y;
+    return 1;
+}
+
+/*
+ * The server reads a shared surface asynchronously, it must not be written
+ * again before the completion event of the last shm put image arrived.
+ * Completions of any window are counted, other events wait for the next poll.
+ */
+static void wait_surface(twh_window_t *wnd)
+{
+    if (wnd->shm_pending > 0)
+    {
+        xcb_flush(g_connection);
+    }
+    while (wnd->shm_pending > 0)
+    {
+        xcb_generic_event_t *event = xcb_wait_for_event(g_connection);
+        if (event == NULL)
+        {
+            /* the connection is gone, so is the server reading the surface */
+            wnd->shm_pending = 0;
+            break;
+        }
+        take_surface_event(event);
+    }
+}
+
+/* counts the completions that already arrived, for every window, without flushing or blocking */
+static void take_completions(void)
+{
+    xcb_generic_event_t *event;
+
+    while ((event = xcb_poll_for_event(g_connection)) != NULL)
+    {
+        take_surface_event(event);
+    }
+}
+
+/* a completion counts for its window, anything else is kept for the next poll */
+static void take_surface_event(xcb_generic_event_t *event)
+{
+    if (is_shm_completion(event))
+    {
+        twh_window_t *window = twh_registry_find(&g_windows, ((xcb_shm_completion_event_t *)event)->drawable);
+        if (window != NULL && window->shm_pending > 0)
+        {
+            window->shm_pending--;
+        }
+        free(event);
+    }
+    else
+    {
+        defer_event(event);
+    }
+}
+
+/* `rects` are in surface coordinates, the requests wait for the next flush */
+static void present_surface(twh_window_t *wnd, const twh_rect_t *rects, int count)
+{
+    int shm, i;
+
+    /* without a surface there is nothing to show, see resize_surface */
+    if (count == 0 || wnd->surface == NULL)
+    {
+        return;
+    }
+    shm = use_shm(g_connection, &wnd->shm_info);
+
+    for (i = 0; i < count; i++)
+    {
+        const twh_rect_t *rect = &rects[i];
+        if (shm)
+        {
+            /* requests run in order, only the last one needs to report back */
+            uint8_t send_event = i == count - 1;
+            xcb_shm_put_image(g_connection, wnd->handle, g_gc, wnd->surface_w, wnd->surface_h,
+                              rect->x, rect->y, rect->w, rect->h,
+                              wnd->surface_x + rect->x, wnd->surface_y + rect->y,
+                              g_screen->root_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, send_event, wnd->shm_info.shmseg, 0);
+        }
+        else
+        {
+            /* put image sends whole rows, a rect of the full width costs no more */
+            put_image(g_connection, wnd->handle, g_gc, wnd->surface, wnd->surface_w, rect->y, rect->h,
+                      wnd->surface_x, wnd->surface_y + rect->y);
+        }
+    }
+    if (shm)
+    {
+        wnd->shm_pending++;
+    }
+}
+
+/* the reply was requested by twh_window_create, unless a motion made it obsolete */
+static void resolve_pointer(twh_window_t *wnd)
+{
+    xcb_query_pointer_reply_t *reply;
+
+    if (!wnd->pointer_pending)
+    {
+        return;
+    }
+    wnd->pointer_pending = 0;
+
+    reply = xcb_query_pointer_reply(g_connection, wnd->pointer, NULL);
+    if (reply != NULL)
+    {
+        wnd->cursor_x = (float)reply->win_x;
+        wnd->cursor_y = (float)reply->win_y;
+        free(reply);
+    }
+}
+
+static xcb_generic_event_t *next_event(void)
+{
+    if (g_deferred_head < g_deferred_count)
+    {
+        xcb_generic_event_t *event = g_deferred[g_deferred_head++];
+        if (g_deferred_head == g_deferred_count)
+        {
+            g_deferred_head = 0;
+            g_deferred_count = 0;
+        }
+        return event;
+    }
+    return xcb_poll_for_event(g_connection);
+}
+
+static void defer_event(xcb_generic_event_t *event)
+{
+    if (g_deferred_count == g_deferred_capacity)
+    {
+        g_deferred_capacity = g_deferred_capacity ? g_deferred_capacity * 2 : 64;
+        g_deferred = (xcb_generic_event_t **)realloc(g_deferred, g_deferred_capacity * sizeof(xcb_generic_event_t *));
+        assert(g_deferred != NULL);
+    }
+    g_deferred[g_deferred_count++] = event;
+}
+
+static int is_key_repeat(const xcb_generic_event_t *release, const xcb_generic_event_t *event)
+{
+    const xcb_key_release_event_t *key_release = (const xcb_key_release_event_t *)release;
+    const xcb_key_press_event_t *key_press = (const xcb_key_press_event_t *)event;
+
+    return EVENT_TYPE(release) == XCB_KEY_RELEASE && EVENT_TYPE(event) == XCB_KEY_PRESS &&
+           key_press->event == key_release->event && key_press->detail == key_release->detail &&
+           key_press->time == key_release->time;
+}
+
+static int is_same_motion(const xcb_generic_event_t *motion, const xcb_generic_event_t *event)
+{
+    return EVENT_TYPE(motion) == XCB_MOTION_NOTIFY && EVENT_TYPE(event) == XCB_MOTION_NOTIFY &&
+           ((const xcb_motion_notify_event_t *)motion)->event == ((const xcb_motion_notify_event_t *)event)->event;
+}
+
+static TWH_KEY_CODE get_key_code(xcb_keysym_t keysym)
+{
+    int low = 0;
+    int high = (int)(sizeof(g_key_mappings) / sizeof(g_key_mappings[0])) - 1;
+
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (g_key_mappings[middle].keysym < keysym)
+            low = middle + 1;
+        else if (g_key_mappings[middle].keysym > keysym)
+            high = middle - 1;
+        else
+            return (TWH_KEY_CODE)g_key_mappings[middle].key;
+    }
+    return TWH_KEY_NUM;
+}
+
+/*
+ * Key events carry keycodes, all of them are translated up front from one
+ * GetKeyboardMapping. Its reply is only read by the first key event.
+ */
+static void request_keyboard_mapping(void)
+{
+    const xcb_setup_t *setup = xcb_get_setup(g_connection);
+
+    if (g_keymap_pending)
+    {
+        xcb_discard_reply(g_connection, g_keymap_cookie.sequence);
+    }
+    g_keymap_cookie = xcb_get_keyboard_mapping(g_connection, setup->min_keycode,
+                                               setup->max_keycode - setup->min_keycode + 1);
+    g_keymap_pending = 1;
+}
+
+static void load_keyboard_mapping(void)
+{
+    const xcb_setup_t *setup = xcb_get_setup(g_connection);
+    xcb_get_keyboard_mapping_reply_t *reply;
+    xcb_keysym_t *keysyms;
+    int keysyms_per_keycode;
+    int keycode;
+
+    if (!g_keymap_pending)
+    {
+        return;
+    }
+    g_keymap_pending = 0;
+
+    memset(g_keycode_cache, TWH_KEY_NUM, sizeof(g_keycode_cache));
+    reply = xcb_get_keyboard_mapping_reply(g_connection, g_keymap_cookie, NULL);
+    if (reply == NULL)
+    {
+        return;
+    }
+    keysyms = xcb_get_keyboard_mapping_keysyms(reply);
+    keysyms_per_keycode = reply->keysyms_per_keycode;
+    for (keycode = setup->min_keycode; keycode <= setup->max_keycode; keycode++)
+    {
+        /* the first keysym the table knows, e.g. KP_7 behind KP_Home */
+        int level;
+        for (level = 0; level < keysyms_per_keycode; level++)
+        {
+            xcb_keysym_t keysym = keysyms[(keycode - setup->min_keycode) * keysyms_per_keycode + level];
+            TWH_KEY_CODE key = get_key_code(keysym);
+            if (key < TWH_KEY_NUM)
+            {
+                g_keycode_cache[keycode] = (unsigned char)key;
+                break;
+            }
+        }
+    }
+    free(reply);
+}
+
+static void handle_key_event(twh_window_t *wnd, xcb_keycode_t keycode, char pressed, xcb_timestamp_t time)
+{
+    TWH_KEY_CODE key;
+
+    load_keyboard_mapping();
+    key = (TWH_KEY_CODE)g_keycode_cache[keycode];
+    if (key < TWH_KEY_NUM)
+    {
+        twh_event_t event;
+        twh_input_update_key(&wnd->input, key, pressed);
+
+        event.type = TWH_EVENT_KEY;
+        event.window = wnd;
+        event.key.code = key;
+        event.key.pressed = pressed;
+        twh_push_event(&event, twh_event_time_from_ms(time));
+
+        if (wnd->key_callback)
+        {
+            wnd->key_callback(wnd, key, pressed);
+        }
+    }
+}
+
+static void handle_mouse_event(twh_window_t *wnd, xcb_button_t xbutton, char pressed, xcb_timestamp_t time)
+{
+    /* mouse button */
+    if (xbutton == XCB_BUTTON_INDEX_1 || xbutton == XCB_BUTTON_INDEX_2 || xbutton == XCB_BUTTON_INDEX_3)
+    {
+        TWH_MOUSE_BUTTON button = TWH_MOUSE_BUTTON_NUM;
+        switch (xbutton)
+        {
+        case XCB_BUTTON_INDEX_1:
+            button = TWH_MOUSE_LEFT_BUTTON;
+            break;
+        case XCB_BUTTON_INDEX_2:
+            button = TWH_MOUSE_MIDDLE_BUTTON;
+            break;
+        case XCB_BUTTON_INDEX_3:
+            button = TWH_MOUSE_RIGHT_BUTTON;
+            break;
+        default:
+            break;
+        }
+
+        if (button < TWH_MOUSE_BUTTON_NUM)
+        {
+            twh_event_t event;
+            twh_input_update_button(&wnd->input, button, pressed);
+
+            event.type = TWH_EVENT_MOUSE_BUTTON;
+            event.window = wnd;
+            event.mouse.button = button;
+            event.mouse.pressed = pressed;
+            twh_push_event(&event, twh_event_time_from_ms(time));
+
+            if (wnd->mouse_callback)
+            {
+                wnd->mouse_callback(wnd, button, pressed);
+            }
+        }
+    }
+    /* mouse wheel */
+    else if (xbutton == XCB_BUTTON_INDEX_4 || xbutton == XCB_BUTTON_INDEX_5)
+    {
+        float offset = xbutton == XCB_BUTTON_INDEX_4 ? 1 : -1;
+
+        twh_event_t event;
+        event.type = TWH_EVENT_SCROLL;
+        event.window = wnd;
+        event.scroll.offset = offset;
+        twh_push_event(&event, twh_event_time_from_ms(time));
+
+        if (wnd->scroll_callback)
+        {
+            wnd->scroll_callback(wnd, offset);
+        }
+    }
+}
+
+/* runs of motions were already coalesced by twh_poll_events */
+static void handle_motion_event(twh_window_t *wnd, xcb_motion_notify_event_t *event)
+{
+    twh_event_t motion_event;
+
+    if (wnd->pointer_pending)
+    {
+        xcb_discard_reply(g_connection, wnd->pointer.sequence);
+        wnd->pointer_pending = 0;
+    }
+    wnd->cursor_x = (float)event->event_x;
+    wnd->cursor_y = (float)event->event_y;
+
+    motion_event.type = TWH_EVENT_MOTION;
+    motion_event.window = wnd;
+    motion_event.motion.x = wnd->cursor_x;
+    motion_event.motion.y = wnd->cursor_y;
+    twh_push_event(&motion_event, twh_event_time_from_ms(event->time));
+
+    if (wnd->motion_callback)
+    {
+        wnd->motion_callback(wnd, wnd->cursor_x, wnd->cursor_y);
+    }
+}
+
+static void handle_client_event(twh_window_t *wnd, xcb_client_message_event_t *event)
+{
+    if (event->type == g_wm_protocols)
+    {
+        xcb_atom_t protocol = event->data.data32[0];
+        if (protocol == g_wm_delete_window)
+        {
+            twh_event_t close_event;
+            close_event.type = TWH_EVENT_CLOSE;
+            close_event.window = wnd;
+            twh_push_event(&close_event, twh_stats_now());
+
+            wnd->should_close = 1;
+        }
+    }
+}
+
+static void process_event(xcb_generic_event_t *event)
+{
+    twh_window_t *window;
+    int type = EVENT_TYPE(event);
+
+    /* errors of requests nobody checks, e.g. of a window already destroyed */
+    if (type == 0)
+    {
+        return;
+    }
+
+    /* not tied to a window, the keyboard layout changed */
+    if (type == XCB_MAPPING_NOTIFY)
+    {
+        if (((xcb_mapping_notify_event_t *)event)->request == XCB_MAPPING_KEYBOARD)
+        {
+            request_keyboard_mapping();
+        }
+        return;
+    }
+
+    if (is_shm_completion(event))
+    {
+        /* counted per surface, another surface failing to attach does not matter */
+        window = twh_registry_find(&g_windows, ((xcb_shm_completion_event_t *)event)->drawable);
+        if (window != NULL && window->shm_pending > 0)
+        {
+            window->shm_pending--;
+        }
+    }
+    else if (type == XCB_EXPOSE)
+    {
+        /* frames are only presented where they changed, restore the rest */
+        xcb_expose_event_t *expose = (xcb_expose_event_t *)event;
+        window = twh_registry_find(&g_windows, expose->window);
+        if (window != NULL && expose->count == 0 && window->presented_fb != NULL)
+        {
+            twh_rect_t rect = {0, 0, window->surface_w, window->surface_h};
+            present_surface(window, &rect, 1);
+        }
+    }
+    else if (type == XCB_CLIENT_MESSAGE)
+    {
+        xcb_client_message_event_t *message = (xcb_client_message_event_t *)event;
+        window = twh_registry_find(&g_windows, message->window);
+        if (window != NULL)
+        {
+            handle_client_event(window, message);
+        }
+    }
+    else if (type == XCB_KEY_PRESS || type == XCB_KEY_RELEASE)
+    {
+        xcb_key_press_event_t *key = (xcb_key_press_event_t *)event;
+        window = twh_registry_find(&g_windows, key->event);
+        if (window != NULL)
+        {
+            handle_key_event(window, key->detail, type == XCB_KEY_PRESS, key->time);
+        }
+    }
+    else if (type == XCB_BUTTON_PRESS || type == XCB_BUTTON_RELEASE)
+    {
+        xcb_button_press_event_t *button = (xcb_button_press_event_t *)event;
+        window = twh_registry_find(&g_windows, button->event);
+        if (window != NULL)
+        {
+            handle_mouse_event(window, button->detail, type == XCB_BUTTON_PRESS, button->time);
+        }
+    }
+    else if (type == XCB_MOTION_NOTIFY)
+    {
+        xcb_motion_notify_event_t *motion = (xcb_motion_notify_event_t *)event;
+        window = twh_registry_find(&g_windows, motion->event);
+        if (window != NULL)
+        {
+            handle_motion_event(window, motion);
+        }
+    }
+    else if (type == XCB_FOCUS_OUT)
+    {
+        window = twh_registry_find(&g_windows, ((xcb_focus_out_event_t *)event)->event);
+        if (window != NULL)
+        {
+            twh_input_release_all(&window->input);
+        }
+    }
+    else if (type == XCB_CONFIGURE_NOTIFY)
+    {
+        /* the surface follows on the next render */
+        xcb_configure_notify_event_t *configure = (xcb_configure_notify_event_t *)event;
+        window = twh_registry_find(&g_windows, configure->window);
+        if (window != NULL)
+        {
+            window->window_w = configure->width;
+            window->window_h = configure->height;
+        }
+    }
+}